@@ -0,0 +1,174 @@
+#include "benchmark.h"
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+struct Options {
+    vector<string> precisions_ = {"float", "double"};
+    vector<string> engines_ = {"tree", "flat", "sparse", "dense"};
+    vector<size_t> nTrees_ = {1000};
+    vector<size_t> depths_ = {10};
+    vector<size_t> nFeatures_ = {100};
+    vector<size_t> batchRows_ = {1000};
+    BenchOptions bench_;
+    string json_;
+    string csv_;
+};
+
+void usage() {
+    cerr << "usage: forestBench [--precision float,double] [--engines name,...|all] [--trees n,...] [--depth n,...] "
+         << "[--features n,...] [--batch n,...] [--warmup n] [--samples n] [--min-time ms] [--seed n] "
+         << "[--perf] [--json path] [--csv path]" << endl << "engines:";
+    for (const char* engine : kBenchEngines) {
+        cerr << " " << engine;
+    }
+    cerr << endl;
+}
+
+vector<string> splitList(const string& list) {
+    vector<string> items;
+    stringstream in(list);
+    string item;
+    while (getline(in, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+vector<size_t> splitSizes(const string& list) {
+    vector<size_t> sizes;
+    for (const string& item : splitList(list)) {
+        sizes.push_back(atol(item.c_str()));
+    }
+    return sizes;
+}
+
+template<typename FT>
+void sweep(const string& precision, const Options& options, ThreadPool& pool, PerfCounters* counters,
+           vector<BenchResult>& results) {
+    for (size_t nTrees : options.nTrees_) {
+        for (size_t depth : options.depths_) {
+            for (size_t nFeatures : options.nFeatures_) {
+                srand(options.bench_.seed_);
+                BenchModel<FT> model(pool, nFeatures, nTrees, depth);
+                size_t maxRows = *max_element(options.batchRows_.begin(), options.batchRows_.end());
+                vector<FT> rows(maxRows*nFeatures);
+                for (FT& value : rows) {
+                    value = static_cast<FT>(rand())/RAND_MAX;
+                }
+                vector<FT> expected(maxRows);
+                typename RandomForest<FT>::Features row(nFeatures);
+                for (size_t i = 0; i < maxRows; ++i) {
+                    copy(rows.begin() + i*nFeatures, rows.begin() + (i + 1)*nFeatures, row.begin());
+                    expected[i] = model.forest_->eval(row);
+                }
+
+                for (size_t batchRows : options.batchRows_) {
+                    for (const string& engine : options.engines_) {
+                        BenchConfig config{precision, engine, nTrees, depth, nFeatures, batchRows};
+                        BenchResult r = runBenchmark(model, config, options.bench_, rows, expected, counters);
+                        cout << left << setw(7) << precision << setw(12) << engine << right
+                             << " trees " << setw(5) << nTrees << " depth " << setw(2) << depth
+                             << " features " << setw(4) << nFeatures << " batch " << setw(6) << batchRows
+                             << fixed << setprecision(2) << "  median " << setw(9) << r.median_ << " ns/row  stddev "
+                             << setw(7) << r.stddev_ << defaultfloat << endl;
+                        if (counters) {
+                            cout << "  per row/step:";
+                            writePerfSample(r.perf_, r.repeats_*batchRows, nTrees, cout);
+                            cout << endl;
+                        }
+                        results.push_back(r);
+                    }
+                }
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "--precision") && hasValue) {
+            options.precisions_ = splitList(argv[++i]);
+        } else if (!strcmp(argv[i], "--engines") && hasValue) {
+            options.engines_ = splitList(argv[++i]);
+            if (1 == options.engines_.size() && "all" == options.engines_[0]) {
+                options.engines_.assign(begin(kBenchEngines), end(kBenchEngines));
+            }
+        } else if (!strcmp(argv[i], "--trees") && hasValue) {
+            options.nTrees_ = splitSizes(argv[++i]);
+        } else if (!strcmp(argv[i], "--depth") && hasValue) {
+            options.depths_ = splitSizes(argv[++i]);
+        } else if (!strcmp(argv[i], "--features") && hasValue) {
+            options.nFeatures_ = splitSizes(argv[++i]);
+        } else if (!strcmp(argv[i], "--batch") && hasValue) {
+            options.batchRows_ = splitSizes(argv[++i]);
+        } else if (!strcmp(argv[i], "--warmup") && hasValue) {
+            options.bench_.warmup_ = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "--samples") && hasValue) {
+            options.bench_.samples_ = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "--min-time") && hasValue) {
+            options.bench_.minSampleSeconds_ = atof(argv[++i])/1000;
+        } else if (!strcmp(argv[i], "--seed") && hasValue) {
+            options.bench_.seed_ = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "--perf")) {
+            options.bench_.perf_ = true;
+        } else if (!strcmp(argv[i], "--json") && hasValue) {
+            options.json_ = argv[++i];
+        } else if (!strcmp(argv[i], "--csv") && hasValue) {
+            options.csv_ = argv[++i];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    for (const auto& sizes : {options.nTrees_, options.depths_, options.nFeatures_, options.batchRows_}) {
+        if (sizes.empty() || *min_element(sizes.begin(), sizes.end()) == 0) {
+            usage();
+            return 1;
+        }
+    }
+
+    try {
+        ThreadPool pool;
+        unique_ptr<PerfCounters> counters;
+        if (options.bench_.perf_) {
+            counters.reset(new PerfCounters());
+            if (!counters->available()) {
+                cerr << "forestBench: no hardware counters (check perf_event_paranoid), reporting n/a" << endl;
+            }
+        }
+        vector<BenchResult> results;
+        for (const string& precision : options.precisions_) {
+            if ("float" == precision) {
+                sweep<float>(precision, options, pool, counters.get(), results);
+            } else if ("double" == precision) {
+                sweep<double>(precision, options, pool, counters.get(), results);
+            } else {
+                throw std::runtime_error("unknown precision " + precision);
+            }
+        }
+        if (!options.json_.empty()) {
+            ofstream out(options.json_.c_str());
+            writeResultsJson(results, out, options.bench_.perf_);
+            if (!out) {
+                throw std::runtime_error("cannot write " + options.json_);
+            }
+        }
+        if (!options.csv_.empty()) {
+            ofstream out(options.csv_.c_str());
+            writeResultsCsv(results, out, options.bench_.perf_);
+            if (!out) {
+                throw std::runtime_error("cannot write " + options.csv_);
+            }
+        }
+    } catch (const std::exception& e) {
+        cerr << "forestBench: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,296 @@
+#pragma once
+
+#include "randomForest.h"
+#include "perfCounters.h"
+
+#include <chrono>
+#include <ostream>
+#include <iomanip>
+
+// one point of the sweep
+struct BenchConfig {
+    string precision_;
+    string engine_;
+    size_t nTrees_;
+    size_t depth_;
+    size_t nFeatures_;
+    size_t batchRows_;
+};
+
+struct BenchResult {
+    BenchConfig config_;
+    size_t nSamples_;
+    size_t repeats_; // batch evaluations per sample
+    double median_; // ns per row
+    double stddev_;
+    double min_;
+    PerfSample perf_; // one extra sample of `repeats_` batches, only with --perf
+};
+
+struct BenchOptions {
+    size_t warmup_ = 2;
+    size_t samples_ = 10;
+    double minSampleSeconds_ = 0.02; // repeats are added until one sample takes at least this long
+    unsigned seed_ = 1;
+    bool perf_ = false;
+};
+
+static const char* const kBenchEngines[] = {
+    "tree", "flat", "sparse", "dense", "blocked", "interleaved", "streaming",
+    "packed", "complete", "quantized", "quickscorer", "parallel",
+};
+
+// median and sample standard deviation of per-row times
+inline void summarize(vector<double> samples, BenchResult& result) {
+    sort(samples.begin(), samples.end());
+    size_t n = samples.size();
+    result.nSamples_ = n;
+    result.min_ = samples[0];
+    result.median_ = n % 2 ? samples[n/2] : (samples[n/2 - 1] + samples[n/2])/2;
+    double mean = 0.;
+    for (double s : samples) {
+        mean += s/n;
+    }
+    double variance = 0.;
+    for (double s : samples) {
+        variance += (s - mean)*(s - mean);
+    }
+    result.stddev_ = n > 1 ? sqrt(variance/(n - 1)) : 0.;
+}
+
+// every engine of one model shape. Layouts are built on first use so a sweep over a few engines
+// does not pay for all of them
+template<typename FeatureType>
+struct BenchModel {
+    using RandomForestF = RandomForest<FeatureType>;
+    using FlatForestF = FlatForest<FeatureType>;
+    using Features = typename RandomForestF::Features;
+    using Engine = function<void(const FeatureType*, size_t, FeatureType*)>;
+
+    shared_ptr<RandomForestF> forest_;
+    shared_ptr<FlatForestF> flat_;
+    shared_ptr<PackedFlatForest<FeatureType>> packed_;
+    shared_ptr<CompleteFlatForest<FeatureType>> complete_;
+    shared_ptr<QuantizedFlatForest<FeatureType, uint16_t>> quantized_;
+    shared_ptr<QuickScorer<FeatureType>> quickScorer_;
+    ThreadPool& pool_;
+    size_t nFeatures_;
+    Features row_;
+
+    BenchModel(ThreadPool& pool, size_t nFeatures, size_t nTrees, size_t depth)
+        : forest_(generateRandomForest<FeatureType>(nFeatures, nTrees, depth))
+        , pool_(pool)
+        , nFeatures_(nFeatures)
+        , row_(nFeatures)
+    {
+    }
+
+    FlatForestF& flat() {
+        if (!flat_) {
+            flat_ = shared_ptr<FlatForestF>(new FlatForestF(*forest_));
+        }
+        return *flat_;
+    }
+
+    // rows are contiguous with stride nFeatures_
+    Engine engine(const string& name) {
+        const size_t stride = nFeatures_;
+        if ("tree" == name || "flat" == name) {
+            bool tree = "tree" == name;
+            if (!tree) {
+                flat();
+            }
+            return [this, stride, tree](const FeatureType* rows, size_t nRows, FeatureType* out) {
+                for (size_t i = 0; i < nRows; ++i) {
+                    copy(rows + i*stride, rows + (i + 1)*stride, row_.begin());
+                    out[i] = tree ? forest_->eval(row_) : flat_->eval(row_);
+                }
+            };
+        }
+        if ("sparse" == name) {
+            flat();
+            return [this, stride](const FeatureType* rows, size_t nRows, FeatureType* out) {
+                const size_t kSize = FlatForestF::kSize;
+                FeatureType* lanes[kSize];
+                for (size_t i = 0; i < nRows; i += kSize) {
+                    // a short last group repeats row i in its idle lanes
+                    for (size_t k = 0; k < kSize; ++k) {
+                        lanes[k] = const_cast<FeatureType*>(rows + (i + k < nRows ? i + k : i)*stride);
+                    }
+                    typename FlatForestF::FloatVectorType v = flat_->evalAVXSparse(lanes);
+                    for (size_t k = 0; k < kSize && i + k < nRows; ++k) {
+                        out[i + k] = v.floatData_[k];
+                    }
+                }
+            };
+        }
+        if ("dense" == name) {
+            flat();
+            return [this, stride](const FeatureType* rows, size_t nRows, FeatureType* out) {
+                flat_->evalBatch(rows, nRows, stride, out);
+            };
+        }
+        if ("blocked" == name) {
+            flat();
+            return [this, stride](const FeatureType* rows, size_t nRows, FeatureType* out) {
+                flat_->evalBatchBlocked(rows, nRows, stride, out);
+            };
+        }
+        if ("interleaved" == name) {
+            flat();
+            return [this, stride](const FeatureType* rows, size_t nRows, FeatureType* out) {
+                flat_->template evalBatchInterleaved<4>(rows, nRows, stride, out);
+            };
+        }
+        if ("streaming" == name) {
+            flat();
+            return [this, stride](const FeatureType* rows, size_t nRows, FeatureType* out) {
+                flat_->evalBatchStreaming(rows, nRows, stride, out);
+            };
+        }
+        if ("parallel" == name) {
+            flat();
+            return [this, stride](const FeatureType* rows, size_t nRows, FeatureType* out) {
+                flat_->evalBatch(pool_, rows, nRows, stride, out);
+            };
+        }
+        if ("packed" == name) {
+            if (!packed_) {
+                packed_ = make_shared<PackedFlatForest<FeatureType>>(*forest_);
+            }
+            return [this, stride](const FeatureType* rows, size_t nRows, FeatureType* out) {
+                packed_->evalBatch(rows, nRows, stride, out);
+            };
+        }
+        if ("complete" == name) {
+            if (!complete_) {
+                complete_ = make_shared<CompleteFlatForest<FeatureType>>(*forest_);
+            }
+            return [this, stride](const FeatureType* rows, size_t nRows, FeatureType* out) {
+                complete_->evalBatch(rows, nRows, stride, out);
+            };
+        }
+        if ("quantized" == name) {
+            if (!quantized_) {
+                quantized_ = make_shared<QuantizedFlatForest<FeatureType, uint16_t>>(*forest_);
+            }
+            // binning is part of the measured cost
+            return [this, stride](const FeatureType* rows, size_t nRows, FeatureType* out) {
+                quantized_->evalBatch(rows, nRows, stride, out);
+            };
+        }
+        if ("quickscorer" == name) {
+            if (!quickScorer_) {
+                quickScorer_ = make_shared<QuickScorer<FeatureType>>(*forest_);
+            }
+            return [this, stride](const FeatureType* rows, size_t nRows, FeatureType* out) {
+                quickScorer_->evalBatch(rows, nRows, stride, out);
+            };
+        }
+        throw std::runtime_error("unknown engine " + name);
+    }
+};
+
+// times one engine on one batch. Warmup runs also pick how many batch evaluations make up a sample.
+// Counters only see the calling thread, so for "parallel" they miss the pool workers
+template<typename FeatureType>
+BenchResult runBenchmark(BenchModel<FeatureType>& model, const BenchConfig& config, const BenchOptions& options,
+                         const vector<FeatureType>& rows, const vector<FeatureType>& expected, PerfCounters* counters = nullptr) {
+    using Clock = chrono::steady_clock;
+    auto engine = model.engine(config.engine_);
+    size_t nRows = config.batchRows_;
+    vector<FeatureType> out(nRows);
+
+    engine(&rows[0], nRows, &out[0]);
+    for (size_t i = 0; i < nRows; ++i) {
+        if (fabs(out[i] - expected[i]) > 1e-3*max<FeatureType>(1, fabs(expected[i]))) {
+            throw std::runtime_error(config.engine_ + " result mismatch");
+        }
+    }
+
+    size_t repeats = 1;
+    for (size_t w = 0; w < options.warmup_; ++w) {
+        auto begin = Clock::now();
+        for (size_t r = 0; r < repeats; ++r) {
+            engine(&rows[0], nRows, &out[0]);
+        }
+        double seconds = chrono::duration<double>(Clock::now() - begin).count();
+        if (seconds < options.minSampleSeconds_) {
+            repeats = max<size_t>(repeats + 1, repeats*options.minSampleSeconds_/max(seconds, 1e-9));
+        }
+    }
+
+    volatile FeatureType sink = 0;
+    vector<double> samples(max<size_t>(1, options.samples_));
+    for (double& sample : samples) {
+        auto begin = Clock::now();
+        for (size_t r = 0; r < repeats; ++r) {
+            engine(&rows[0], nRows, &out[0]);
+        }
+        sample = chrono::duration<double, nano>(Clock::now() - begin).count()/(repeats*nRows);
+        sink = sink + out[0];
+    }
+
+    BenchResult result;
+    result.config_ = config;
+    result.repeats_ = repeats;
+    summarize(samples, result);
+    if (counters) {
+        counters->start();
+        for (size_t r = 0; r < repeats; ++r) {
+            engine(&rows[0], nRows, &out[0]);
+        }
+        result.perf_ = counters->stop();
+    }
+    return result;
+}
+
+// counters per row and per tree-step (one row through one tree), uncounted events are left empty
+inline void writeResultsCsv(const vector<BenchResult>& results, ostream& out, bool perf) {
+    out << "precision,engine,trees,depth,features,batch,samples,repeats,median_ns_per_row,stddev_ns_per_row,min_ns_per_row";
+    for (size_t e = 0; perf && e < kPerfEvents; ++e) {
+        out << ',' << kPerfEventNames[e] << "_per_row," << kPerfEventNames[e] << "_per_step";
+    }
+    out << '\n';
+    for (const auto& r : results) {
+        const BenchConfig& c = r.config_;
+        out << c.precision_ << ',' << c.engine_ << ',' << c.nTrees_ << ',' << c.depth_ << ',' << c.nFeatures_ << ','
+            << c.batchRows_ << ',' << r.nSamples_ << ',' << r.repeats_ << ',' << r.median_ << ',' << r.stddev_ << ','
+            << r.min_;
+        double nRows = double(r.repeats_)*c.batchRows_;
+        for (size_t e = 0; perf && e < kPerfEvents; ++e) {
+            PerfEvent event = static_cast<PerfEvent>(e);
+            out << ',';
+            if (r.perf_.valid(event)) {
+                out << r.perf_.per(event, nRows) << ',' << r.perf_.per(event, nRows*c.nTrees_);
+            } else {
+                out << ',';
+            }
+        }
+        out << '\n';
+    }
+}
+
+inline void writeResultsJson(const vector<BenchResult>& results, ostream& out, bool perf) {
+    out << "[\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& r = results[i];
+        const BenchConfig& c = r.config_;
+        out << "  {\"precision\": \"" << c.precision_ << "\", \"engine\": \"" << c.engine_ << "\", \"trees\": " << c.nTrees_
+            << ", \"depth\": " << c.depth_ << ", \"features\": " << c.nFeatures_ << ", \"batch\": " << c.batchRows_
+            << ", \"samples\": " << r.nSamples_ << ", \"repeats\": " << r.repeats_ << ", \"median_ns_per_row\": " << r.median_
+            << ", \"stddev_ns_per_row\": " << r.stddev_ << ", \"min_ns_per_row\": " << r.min_;
+        double nRows = double(r.repeats_)*c.batchRows_;
+        for (size_t e = 0; perf && e < kPerfEvents; ++e) {
+            PerfEvent event = static_cast<PerfEvent>(e);
+            out << ", \"" << kPerfEventNames[e] << "_per_row\": ";
+            if (r.perf_.valid(event)) {
+                out << r.perf_.per(event, nRows) << ", \"" << kPerfEventNames[e] << "_per_step\": " << r.perf_.per(event, nRows*c.nTrees_);
+            } else {
+                out << "null, \"" << kPerfEventNames[e] << "_per_step\": null";
+            }
+        }
+        out << "}" << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "]\n";
+}
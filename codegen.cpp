@@ -0,0 +1,70 @@
+#include "codegen.h"
+#include "importers.h"
+
+#include <cstring>
+
+struct Options {
+    bool double_ = false;
+    CodeStyle style_ = CodeStyle::Branchy;
+    string namespace_ = "compiledForest";
+    size_t nFeatures_ = 100;
+    size_t nTrees_ = 1000;
+    size_t nLevel_ = 10;
+    unsigned seed_ = 1;
+    string model_;
+    string format_ = "xgboost";
+};
+
+void usage() {
+    cerr << "usage: forestCodegen [--double] [--branchless] [--namespace name] "
+         << "[--features n] [--trees n] [--levels n] [--seed n] "
+         << "[--model path [--format xgboost|lightgbm|sklearn]] > forest.cpp" << endl;
+}
+
+template<typename FT>
+void run(const Options& options) {
+    shared_ptr<RandomForest<FT>> forest;
+    if (options.model_.empty()) {
+        srand(options.seed_);
+        forest = generateRandomForest<FT>(options.nFeatures_, options.nTrees_, options.nLevel_);
+    } else {
+        forest = importModel<FT>(options.model_, options.format_);
+    }
+    generateCode(*forest, options.style_, options.namespace_, cout);
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "--double")) {
+            options.double_ = true;
+        } else if (!strcmp(argv[i], "--branchless")) {
+            options.style_ = CodeStyle::Branchless;
+        } else if (!strcmp(argv[i], "--namespace") && hasValue) {
+            options.namespace_ = argv[++i];
+        } else if (!strcmp(argv[i], "--features") && hasValue) {
+            options.nFeatures_ = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "--trees") && hasValue) {
+            options.nTrees_ = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "--levels") && hasValue) {
+            options.nLevel_ = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "--seed") && hasValue) {
+            options.seed_ = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "--model") && hasValue) {
+            options.model_ = argv[++i];
+        } else if (!strcmp(argv[i], "--format") && hasValue) {
+            options.format_ = argv[++i];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    if (options.double_) {
+        run<double>(options);
+    } else {
+        run<float>(options);
+    }
+    return 0;
+}
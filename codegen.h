@@ -0,0 +1,174 @@
+#pragma once
+
+#include "randomForest.h"
+
+#include <ostream>
+#include <sstream>
+#include <iomanip>
+
+enum class CodeStyle {
+    Branchy,
+    Branchless,
+};
+
+// emits a standalone translation unit with every tree compiled into nested comparisons,
+// thresholds and feature indices are baked in as constants
+template<typename FeatureType>
+struct CodeGenerator {
+    using RandomForestF = RandomForest<FeatureType>;
+    using Node = typename RandomForestF::Node;
+
+    const RandomForestF& forest_;
+    CodeStyle style_;
+    string namespace_;
+
+    CodeGenerator(const RandomForestF& forest, CodeStyle style, const string& ns)
+        : forest_(forest)
+        , style_(style)
+        , namespace_(ns)
+    {
+        if (!forest.isPreorder()) {
+            throw std::runtime_error("tree is not in pre-order");
+        }
+    }
+
+    static string typeName() {
+        return (sizeof(FeatureType) == sizeof(float)) ? "float" : "double";
+    }
+
+    // max_digits10 round-trips every value exactly. Infinite thresholds come from importers ("always go
+    // one way" splits) and have no literal of their own
+    static string literal(FeatureType value) {
+        string limits = "std::numeric_limits<" + typeName() + ">::";
+        if (value != value) {
+            return limits + "quiet_NaN()";
+        }
+        if (isinf(value)) {
+            return (value < 0 ? "-" : "") + limits + "infinity()";
+        }
+        ostringstream out;
+        out << setprecision(numeric_limits<FeatureType>::max_digits10) << value;
+        string result = out.str();
+        if (result.find_first_of(".eEn") == string::npos) {
+            result += ".";
+        }
+        if (sizeof(FeatureType) == sizeof(float)) {
+            result += "f";
+        }
+        return result;
+    }
+
+    // x != x only holds for NaN; code built with -ffast-math loses that test
+    static string condition(const Node& node) {
+        string feature = "f[" + to_string(node.featureIndex_) + "]";
+        string result = feature + " < " + literal(node.featureValue_);
+        if (node.missingLeft_) {
+            result += " || " + feature + " != " + feature;
+        }
+        return result;
+    }
+
+    static string indent(size_t depth) {
+        return string(4*depth, ' ');
+    }
+
+    // nested if/else per tree, walked with an explicit stack of pending nodes and closing braces
+    void emitBranchy(ostream& out, size_t iTree) const {
+        enum class Step {
+            Node,
+            Else,
+            Close,
+        };
+        struct Pending {
+            Step step_;
+            typename RandomForestF::NodeIndex node_;
+            size_t depth_;
+        };
+        vector<Pending> stack(1, Pending{Step::Node, forest_.roots_[iTree], 1});
+        while (!stack.empty()) {
+            Pending pending = stack.back();
+            stack.pop_back();
+            size_t depth = pending.depth_;
+            if (Step::Else == pending.step_) {
+                out << indent(depth) << "} else {\n";
+                continue;
+            }
+            if (Step::Close == pending.step_) {
+                out << indent(depth) << "}\n";
+                continue;
+            }
+            const Node& node = forest_.nodes_[pending.node_];
+            if (node.isLeaf_) {
+                out << indent(depth) << "return " << literal(node.leafValue_) << ";\n";
+                continue;
+            }
+            out << indent(depth) << "if (" << condition(node) << ") {\n";
+            stack.push_back(Pending{Step::Close, 0, depth});
+            stack.push_back(Pending{Step::Node, node.right_, depth + 1});
+            stack.push_back(Pending{Step::Else, 0, depth});
+            stack.push_back(Pending{Step::Node, node.left_, depth + 1});
+        }
+    }
+
+    // every node becomes a select between two already computed values, so the compiler emits
+    // conditional moves/blends instead of jumps. Cost is the whole tree, meant for shallow trees.
+    // Children come after their parent in the arena, so a backward pass names them first
+    string emitBranchless(ostream& out, size_t iTree) const {
+        size_t begin = forest_.roots_[iTree];
+        size_t end = forest_.treeEnd(iTree);
+        vector<string> names(end - begin);
+        size_t counter = 0;
+        for (size_t i = end; i-- > begin;) {
+            const Node& node = forest_.nodes_[i];
+            if (node.isLeaf_) {
+                names[i - begin] = literal(node.leafValue_);
+                continue;
+            }
+            string name = "n" + to_string(counter++);
+            out << indent(1) << "const FeatureType " << name << " = (" << condition(node) << ") ? "
+                << names[node.left_ - begin] << " : " << names[node.right_ - begin] << ";\n";
+            names[i - begin] = name;
+        }
+        return names[0];
+    }
+
+    void emit(ostream& out) const {
+        out << "// generated by forestCodegen, do not edit\n";
+        out << "#include <cstddef>\n";
+        out << "#include <limits>\n";
+        out << "#include <vector>\n\n";
+        out << "namespace " << namespace_ << " {\n\n";
+        out << "using FeatureType = " << typeName() << ";\n";
+        out << "using Features = std::vector<FeatureType>;\n\n";
+        out << "static const size_t kTrees = " << forest_.nTrees() << ";\n\n";
+
+        for (size_t iTree = 0; iTree < forest_.nTrees(); ++iTree) {
+            out << "static inline FeatureType tree" << iTree << "(const FeatureType* f) {\n";
+            if (CodeStyle::Branchy == style_) {
+                emitBranchy(out, iTree);
+            } else {
+                string result = emitBranchless(out, iTree);
+                out << indent(1) << "return " << result << ";\n";
+            }
+            out << "}\n\n";
+        }
+
+        out << "FeatureType eval(const FeatureType* f) {\n";
+        out << indent(1) << "FeatureType result = 0;\n";
+        for (size_t iTree = 0; iTree < forest_.nTrees(); ++iTree) {
+            out << indent(1) << "result += tree" << iTree << "(f);\n";
+        }
+        out << indent(1) << "return result;\n";
+        out << "}\n\n";
+
+        out << "FeatureType eval(const Features& features) {\n";
+        out << indent(1) << "return eval(&features[0]);\n";
+        out << "}\n\n";
+        out << "} // namespace " << namespace_ << "\n";
+    }
+};
+
+template<typename FeatureType>
+void generateCode(const RandomForest<FeatureType>& forest, CodeStyle style, const string& ns, ostream& out) {
+    CodeGenerator<FeatureType>(forest, style, ns).emit(out);
+}
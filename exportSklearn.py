@@ -0,0 +1,51 @@
+#!/usr/bin/env python
+# writes a fitted sklearn tree ensemble regressor in the JSON layout read by SklearnImporter:
+#   python exportSklearn.py model.pickle model.json
+
+import json
+import pickle
+import sys
+
+from sklearn.ensemble import GradientBoostingRegressor
+
+
+def exportTree(tree, scale):
+    result = {
+        "children_left": tree.children_left.tolist(),
+        "children_right": tree.children_right.tolist(),
+        "feature": tree.feature.tolist(),
+        "threshold": tree.threshold.tolist(),
+        "value": [float(v) * scale for v in tree.value[:, 0, 0]],
+    }
+    # sklearn >= 1.3 learns where NaN goes
+    if hasattr(tree, "missing_go_to_left"):
+        result["missing_go_to_left"] = tree.missing_go_to_left.tolist()
+    return result
+
+
+def export(model, out):
+    if isinstance(model, GradientBoostingRegressor):
+        estimators = [e[0] for e in model.estimators_]
+        scale = model.learning_rate
+        average = False
+        baseScore = float(model.init_.constant_[0][0]) if hasattr(model.init_, "constant_") else 0.
+    else:
+        estimators = model.estimators_
+        scale = 1.
+        average = True
+        baseScore = 0.
+
+    out.write('{"n_features": %d, "average": %s, "base_score": %r, "trees": [' % (
+        model.n_features_in_, "true" if average else "false", baseScore))
+    for i, estimator in enumerate(estimators):
+        if i:
+            out.write(",\n")
+        json.dump(exportTree(estimator.tree_, scale), out)
+    out.write("]}\n")
+
+
+if __name__ == "__main__":
+    with open(sys.argv[1], "rb") as f:
+        model = pickle.load(f)
+    with open(sys.argv[2], "w") as out:
+        export(model, out)
@@ -0,0 +1,693 @@
+#pragma once
+
+#include "randomForest.h"
+
+#include <istream>
+#include <sstream>
+#include <map>
+
+// pull parser that reads JSON straight from a stream, callers walk objects and arrays key by key and
+// skip what they do not need, so a model is never held as a document in memory
+struct JsonReader {
+    streambuf* in_;
+
+    JsonReader(istream& in)
+        : in_(in.rdbuf())
+    {
+    }
+
+    int peek() {
+        int c = in_->sgetc();
+        while (c == ' ' || c == '\n' || c == '\r' || c == '\t') {
+            c = in_->snextc();
+        }
+        return c;
+    }
+
+    int get() {
+        int c = peek();
+        in_->sbumpc();
+        return c;
+    }
+
+    void expect(char expected) {
+        if (get() != expected) {
+            throw std::runtime_error(string("json: expected ") + expected);
+        }
+    }
+
+    void beginObject() {
+        expect('{');
+    }
+
+    // false once the object is over
+    bool nextKey(string& key) {
+        int c = peek();
+        if (c == '}') {
+            in_->sbumpc();
+            return false;
+        }
+        if (c == ',') {
+            in_->sbumpc();
+        }
+        key = readString();
+        expect(':');
+        return true;
+    }
+
+    void beginArray() {
+        expect('[');
+    }
+
+    // false once the array is over
+    bool nextItem() {
+        int c = peek();
+        if (c == ']') {
+            in_->sbumpc();
+            return false;
+        }
+        if (c == ',') {
+            in_->sbumpc();
+        }
+        return true;
+    }
+
+    string readString() {
+        expect('"');
+        string result;
+        while (true) {
+            int c = in_->sbumpc();
+            if (c == EOF) {
+                throw std::runtime_error("json: unterminated string");
+            }
+            if (c == '"') {
+                return result;
+            }
+            if (c == '\\') {
+                c = in_->sbumpc();
+                switch (c) {
+                    case 'n': c = '\n'; break;
+                    case 't': c = '\t'; break;
+                    case 'r': c = '\r'; break;
+                    case 'b': c = '\b'; break;
+                    case 'f': c = '\f'; break;
+                    case 'u':
+                        // only ever seen in feature names, which are skipped
+                        for (size_t i = 0; i < 4; ++i) {
+                            in_->sbumpc();
+                        }
+                        c = '?';
+                        break;
+                    default: break;
+                }
+            }
+            result += static_cast<char>(c);
+        }
+    }
+
+    // numbers may also come quoted, xgboost writes its parameters as strings
+    double readNumber() {
+        if (peek() == '"') {
+            return parseNumber(readString());
+        }
+        string token;
+        int c = peek();
+        while (c != EOF && (isalnum(c) || c == '-' || c == '+' || c == '.')) {
+            token += static_cast<char>(c);
+            c = in_->snextc();
+        }
+        return parseNumber(token);
+    }
+
+    static double parseNumber(const string& token) {
+        char* end = nullptr;
+        double result = strtod(token.c_str(), &end);
+        if (token.empty() || *end) {
+            throw std::runtime_error("json: bad number " + token);
+        }
+        return result;
+    }
+
+    bool readBool() {
+        int c = peek();
+        string token;
+        while (c != EOF && isalpha(c)) {
+            token += static_cast<char>(c);
+            c = in_->snextc();
+        }
+        if (token == "true") {
+            return true;
+        }
+        if (token == "false") {
+            return false;
+        }
+        throw std::runtime_error("json: bad bool " + token);
+    }
+
+    template<typename T>
+    void readArray(vector<T>& out) {
+        out.clear();
+        beginArray();
+        while (nextItem()) {
+            out.push_back(static_cast<T>(readNumber()));
+        }
+    }
+
+    void skipValue() {
+        int c = peek();
+        if (c == '{') {
+            beginObject();
+            string key;
+            while (nextKey(key)) {
+                skipValue();
+            }
+        } else if (c == '[') {
+            beginArray();
+            while (nextItem()) {
+                skipValue();
+            }
+        } else if (c == '"') {
+            readString();
+        } else {
+            c = peek();
+            while (c != EOF && c != ',' && c != '}' && c != ']' && !isspace(c)) {
+                c = in_->snextc();
+            }
+        }
+    }
+};
+
+// one tree as parallel node arrays, a node is a leaf when left_ is negative. Thresholds are already
+// converted to the "go left if x < threshold" rule of RandomForest::Node
+template<typename FeatureType>
+struct TreeArrays {
+    vector<int> left_;
+    vector<int> right_;
+    vector<int> feature_;
+    vector<FeatureType> threshold_;
+    vector<FeatureType> value_;
+    vector<int> missingLeft_; // where NaN goes, empty sends it right everywhere
+};
+
+// smallest FeatureType v with x < v exactly when x < threshold (or x <= threshold) for every FeatureType x
+template<typename FeatureType>
+FeatureType strictThreshold(double threshold, bool lessOrEqual) {
+    FeatureType result = static_cast<FeatureType>(threshold);
+    if (lessOrEqual ? (result <= threshold) : (result < threshold)) {
+        result = nextafter(result, numeric_limits<FeatureType>::infinity());
+    }
+    return result;
+}
+
+// node k of the arrays becomes arena node offset + k; reindex() later drops unreachable entries and
+// rejects shared or cyclic children
+template<typename FeatureType>
+void addTree(RandomForest<FeatureType>& forest, const TreeArrays<FeatureType>& tree) {
+    size_t n = tree.left_.size();
+    if (!n) {
+        throw std::runtime_error("empty tree");
+    }
+    if (!tree.missingLeft_.empty() && tree.missingLeft_.size() != n) {
+        throw std::runtime_error("bad tree structure");
+    }
+    size_t offset = forest.nodes_.size();
+    forest.roots_.push_back(offset);
+    for (size_t k = 0; k < n; ++k) {
+        if (tree.left_[k] < 0) {
+            forest.addLeaf(tree.value_[k]);
+            continue;
+        }
+        if (static_cast<size_t>(tree.left_[k]) >= n || tree.right_[k] < 0 || static_cast<size_t>(tree.right_[k]) >= n) {
+            throw std::runtime_error("bad tree structure");
+        }
+        bool missingLeft = !tree.missingLeft_.empty() && tree.missingLeft_[k];
+        forest.addSplit(tree.feature_[k], tree.threshold_[k], offset + tree.left_[k], offset + tree.right_[k], missingLeft);
+    }
+}
+
+// base scores become a single leaf tree so every engine picks them up unchanged
+template<typename FeatureType>
+void addConstantTree(RandomForest<FeatureType>& forest, FeatureType value) {
+    forest.roots_.push_back(forest.addLeaf(value));
+}
+
+template<typename FeatureType>
+void scaleLeaves(RandomForest<FeatureType>& forest, size_t iTree, FeatureType factor) {
+    vector<typename RandomForest<FeatureType>::NodeIndex> stack(1, forest.roots_[iTree]);
+    for (size_t nVisited = 0; !stack.empty(); ++nVisited) {
+        if (nVisited == forest.nodes_.size()) {
+            throw std::runtime_error("bad tree structure");
+        }
+        auto& node = forest.nodes_[stack.back()];
+        stack.pop_back();
+        if (node.isLeaf_) {
+            node.leafValue_ *= factor;
+        } else {
+            stack.push_back(node.left_);
+            stack.push_back(node.right_);
+        }
+    }
+}
+
+// XGBoost JSON model (save_model("model.json")), gbtree and dart boosters. Splits go left if x < condition.
+// The forest returns the raw margin: base_score is moved to margin space the way the objective does it
+template<typename FeatureType>
+struct XGBoostImporter {
+    using RandomForestF = RandomForest<FeatureType>;
+
+    JsonReader json_;
+    shared_ptr<RandomForestF> forest_;
+    double baseScore_;
+    string objective_;
+    vector<double> weightDrop_;
+
+    XGBoostImporter(istream& in)
+        : json_(in)
+        , forest_(make_shared<RandomForestF>())
+        , baseScore_(0.5)
+    {
+    }
+
+    shared_ptr<RandomForestF> import() {
+        string key;
+        json_.beginObject();
+        while (json_.nextKey(key)) {
+            if (key == "learner") {
+                readLearner();
+            } else {
+                json_.skipValue();
+            }
+        }
+        if (!weightDrop_.empty()) {
+            if (weightDrop_.size() != forest_->nTrees()) {
+                throw std::runtime_error("xgboost: weight_drop does not match the trees");
+            }
+            for (size_t i = 0; i < weightDrop_.size(); ++i) {
+                scaleLeaves<FeatureType>(*forest_, i, weightDrop_[i]);
+            }
+        }
+        double margin = baseMargin();
+        if (margin != 0.) {
+            addConstantTree<FeatureType>(*forest_, margin);
+        }
+        if (!forest_->nTrees()) {
+            throw std::runtime_error("xgboost: no trees");
+        }
+        forest_->reindex();
+        return forest_;
+    }
+
+    double baseMargin() const {
+        if (objective_ == "binary:logistic" || objective_ == "reg:logistic" || objective_ == "binary:logitraw") {
+            return -log(1./baseScore_ - 1.);
+        }
+        if (objective_ == "count:poisson" || objective_ == "reg:gamma" || objective_ == "reg:tweedie"
+            || objective_ == "survival:cox" || objective_ == "survival:aft") {
+            return log(baseScore_);
+        }
+        return baseScore_;
+    }
+
+    void readLearner() {
+        string key;
+        json_.beginObject();
+        while (json_.nextKey(key)) {
+            if (key == "gradient_booster") {
+                readBooster();
+            } else if (key == "learner_model_param") {
+                readModelParam();
+            } else if (key == "objective") {
+                readObjective();
+            } else {
+                json_.skipValue();
+            }
+        }
+    }
+
+    void readModelParam() {
+        string key;
+        json_.beginObject();
+        while (json_.nextKey(key)) {
+            if (key == "base_score") {
+                baseScore_ = json_.readNumber();
+            } else if (key == "num_class") {
+                if (json_.readNumber() > 1) {
+                    throw std::runtime_error("xgboost: multi-class models are not supported");
+                }
+            } else {
+                json_.skipValue();
+            }
+        }
+    }
+
+    void readObjective() {
+        string key;
+        json_.beginObject();
+        while (json_.nextKey(key)) {
+            if (key == "name") {
+                objective_ = json_.readString();
+            } else {
+                json_.skipValue();
+            }
+        }
+    }
+
+    void readBooster() {
+        string key;
+        json_.beginObject();
+        while (json_.nextKey(key)) {
+            if (key == "model") {
+                readModel();
+            } else if (key == "gbtree") {
+                readBooster();
+            } else if (key == "weight_drop") {
+                json_.readArray(weightDrop_);
+            } else if (key == "name") {
+                string name = json_.readString();
+                if (name != "gbtree" && name != "dart") {
+                    throw std::runtime_error("xgboost: unsupported booster " + name);
+                }
+            } else {
+                json_.skipValue();
+            }
+        }
+    }
+
+    void readModel() {
+        string key;
+        json_.beginObject();
+        while (json_.nextKey(key)) {
+            if (key == "trees") {
+                json_.beginArray();
+                while (json_.nextItem()) {
+                    readTree();
+                }
+            } else {
+                json_.skipValue();
+            }
+        }
+    }
+
+    void readTree() {
+        TreeArrays<FeatureType> tree;
+        vector<double> conditions;
+        vector<int> splitTypes;
+        string key;
+        json_.beginObject();
+        while (json_.nextKey(key)) {
+            if (key == "left_children") {
+                json_.readArray(tree.left_);
+            } else if (key == "right_children") {
+                json_.readArray(tree.right_);
+            } else if (key == "split_indices") {
+                json_.readArray(tree.feature_);
+            } else if (key == "split_conditions") {
+                json_.readArray(conditions);
+            } else if (key == "split_type") {
+                json_.readArray(splitTypes);
+            } else if (key == "default_left") {
+                json_.readArray(tree.missingLeft_);
+            } else {
+                json_.skipValue();
+            }
+        }
+        for (int splitType: splitTypes) {
+            if (splitType) {
+                throw std::runtime_error("xgboost: categorical splits are not supported");
+            }
+        }
+        size_t n = tree.left_.size();
+        if (tree.right_.size() != n || tree.feature_.size() != n || conditions.size() != n) {
+            throw std::runtime_error("xgboost: inconsistent tree arrays");
+        }
+        tree.threshold_.resize(n);
+        tree.value_.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            tree.threshold_[i] = strictThreshold<FeatureType>(conditions[i], false);
+            tree.value_[i] = conditions[i];
+        }
+        addTree(*forest_, tree);
+    }
+};
+
+// LightGBM text model (save_model("model.txt")), read line by line up to "end of trees". Numerical splits go
+// left if x <= threshold, children below zero are leaves ~child. Leaf values already include shrinkage,
+// random forest mode (average_output) divides by the number of trees
+template<typename FeatureType>
+struct LightGBMImporter {
+    using RandomForestF = RandomForest<FeatureType>;
+
+    istream& in_;
+    shared_ptr<RandomForestF> forest_;
+    bool averageOutput_;
+
+    LightGBMImporter(istream& in)
+        : in_(in)
+        , forest_(make_shared<RandomForestF>())
+        , averageOutput_(false)
+    {
+    }
+
+    template<typename T>
+    static void parseList(const string& value, vector<T>& out) {
+        out.clear();
+        istringstream in(value);
+        string token;
+        while (in >> token) {
+            out.push_back(static_cast<T>(JsonReader::parseNumber(token)));
+        }
+    }
+
+    shared_ptr<RandomForestF> import() {
+        string line;
+        bool inTree = false;
+        map<string, string> fields;
+        while (getline(in_, line)) {
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (line.compare(0, 5, "Tree=") == 0 || line == "end of trees") {
+                if (inTree) {
+                    readTree(fields);
+                }
+                fields.clear();
+                inTree = line != "end of trees";
+                if (!inTree) {
+                    break;
+                }
+                continue;
+            }
+            size_t eq = line.find('=');
+            if (!inTree) {
+                if (line == "average_output") {
+                    averageOutput_ = true;
+                } else if (eq != string::npos && line.substr(0, eq) == "num_tree_per_iteration"
+                           && JsonReader::parseNumber(line.substr(eq + 1)) > 1) {
+                    throw std::runtime_error("lightgbm: multi-class models are not supported");
+                }
+            } else if (eq != string::npos) {
+                fields[line.substr(0, eq)] = line.substr(eq + 1);
+            }
+        }
+        if (inTree) {
+            readTree(fields);
+        }
+        if (!forest_->nTrees()) {
+            throw std::runtime_error("lightgbm: no trees");
+        }
+        if (averageOutput_) {
+            FeatureType factor = FeatureType(1)/forest_->nTrees();
+            for (size_t i = 0; i < forest_->nTrees(); ++i) {
+                scaleLeaves<FeatureType>(*forest_, i, factor);
+            }
+        }
+        forest_->reindex();
+        return forest_;
+    }
+
+    // decision_type bit 1 is default_left, bits 2-3 the missing type. Type None scores NaN as 0, type
+    // NaN sends it the default way, type Zero sends NaN and 0 the default way, which only fits the
+    // x < threshold rule where 0 goes that way anyway
+    static bool missingLeft(int decisionType, double threshold) {
+        bool defaultLeft = decisionType & 2;
+        bool zeroLeft = 0. <= threshold;
+        switch ((decisionType >> 2) & 3) {
+        case 0:
+            return zeroLeft;
+        case 1:
+            if (defaultLeft != zeroLeft) {
+                throw std::runtime_error("lightgbm: zero as missing is not supported");
+            }
+            return defaultLeft;
+        case 2:
+            return defaultLeft;
+        default:
+            throw std::runtime_error("lightgbm: unknown missing type");
+        }
+    }
+
+    // internal nodes keep their index, leaf i becomes node nInternal + i
+    void readTree(map<string, string>& fields) {
+        vector<double> leafValues;
+        parseList(fields["leaf_value"], leafValues);
+        size_t nLeaves = leafValues.size();
+        if (!nLeaves) {
+            throw std::runtime_error("lightgbm: tree without leaves");
+        }
+        if (!fields["num_cat"].empty() && JsonReader::parseNumber(fields["num_cat"]) > 0) {
+            throw std::runtime_error("lightgbm: categorical splits are not supported");
+        }
+
+        TreeArrays<FeatureType> tree;
+        vector<int> left;
+        vector<int> right;
+        vector<int> features;
+        vector<double> thresholds;
+        vector<int> decisionTypes;
+        parseList(fields["left_child"], left);
+        parseList(fields["right_child"], right);
+        parseList(fields["split_feature"], features);
+        parseList(fields["threshold"], thresholds);
+        parseList(fields["decision_type"], decisionTypes);
+        size_t nInternal = nLeaves - 1;
+        if (left.size() != nInternal || right.size() != nInternal || features.size() != nInternal || thresholds.size() != nInternal) {
+            throw std::runtime_error("lightgbm: inconsistent tree arrays");
+        }
+        if (!decisionTypes.empty() && decisionTypes.size() != nInternal) {
+            throw std::runtime_error("lightgbm: inconsistent tree arrays");
+        }
+        for (int decisionType: decisionTypes) {
+            if (decisionType & 1) {
+                throw std::runtime_error("lightgbm: categorical splits are not supported");
+            }
+        }
+
+        auto child = [nInternal](int c) {
+            return (c < 0) ? static_cast<int>(nInternal) + ~c : c;
+        };
+        for (size_t i = 0; i < nInternal; ++i) {
+            tree.left_.push_back(child(left[i]));
+            tree.right_.push_back(child(right[i]));
+            tree.feature_.push_back(features[i]);
+            tree.threshold_.push_back(strictThreshold<FeatureType>(thresholds[i], true));
+            tree.value_.push_back(0);
+            tree.missingLeft_.push_back(missingLeft(decisionTypes.empty() ? 0 : decisionTypes[i], thresholds[i]));
+        }
+        for (size_t i = 0; i < nLeaves; ++i) {
+            tree.left_.push_back(-1);
+            tree.right_.push_back(-1);
+            tree.feature_.push_back(0);
+            tree.threshold_.push_back(0);
+            tree.value_.push_back(leafValues[i]);
+            tree.missingLeft_.push_back(0);
+        }
+        if (!nInternal) {
+            addConstantTree<FeatureType>(*forest_, leafValues[0]);
+        } else {
+            addTree(*forest_, tree);
+        }
+    }
+};
+
+// sklearn forests exported with exportSklearn.py: the tree_ arrays of every estimator, leaf when
+// children_left is -1, splits go left if x <= threshold. "average" is set for RandomForestRegressor
+template<typename FeatureType>
+struct SklearnImporter {
+    using RandomForestF = RandomForest<FeatureType>;
+
+    JsonReader json_;
+    shared_ptr<RandomForestF> forest_;
+
+    SklearnImporter(istream& in)
+        : json_(in)
+        , forest_(make_shared<RandomForestF>())
+    {
+    }
+
+    shared_ptr<RandomForestF> import() {
+        bool average = false;
+        double baseScore = 0.;
+        string key;
+        json_.beginObject();
+        while (json_.nextKey(key)) {
+            if (key == "trees") {
+                json_.beginArray();
+                while (json_.nextItem()) {
+                    readTree();
+                }
+            } else if (key == "average") {
+                average = json_.readBool();
+            } else if (key == "base_score") {
+                baseScore = json_.readNumber();
+            } else {
+                json_.skipValue();
+            }
+        }
+        if (!forest_->nTrees()) {
+            throw std::runtime_error("sklearn: no trees");
+        }
+        if (average) {
+            FeatureType factor = FeatureType(1)/forest_->nTrees();
+            for (size_t i = 0; i < forest_->nTrees(); ++i) {
+                scaleLeaves<FeatureType>(*forest_, i, factor);
+            }
+        }
+        if (baseScore != 0.) {
+            addConstantTree<FeatureType>(*forest_, baseScore);
+        }
+        forest_->reindex();
+        return forest_;
+    }
+
+    void readTree() {
+        TreeArrays<FeatureType> tree;
+        vector<double> thresholds;
+        vector<double> values;
+        string key;
+        json_.beginObject();
+        while (json_.nextKey(key)) {
+            if (key == "children_left") {
+                json_.readArray(tree.left_);
+            } else if (key == "children_right") {
+                json_.readArray(tree.right_);
+            } else if (key == "feature") {
+                json_.readArray(tree.feature_);
+            } else if (key == "threshold") {
+                json_.readArray(thresholds);
+            } else if (key == "value") {
+                json_.readArray(values);
+            } else if (key == "missing_go_to_left") {
+                json_.readArray(tree.missingLeft_);
+            } else {
+                json_.skipValue();
+            }
+        }
+        size_t n = tree.left_.size();
+        if (tree.right_.size() != n || tree.feature_.size() != n || thresholds.size() != n || values.size() != n) {
+            throw std::runtime_error("sklearn: inconsistent tree arrays");
+        }
+        for (size_t i = 0; i < n; ++i) {
+            tree.threshold_.push_back(strictThreshold<FeatureType>(thresholds[i], true));
+            tree.value_.push_back(values[i]);
+        }
+        addTree(*forest_, tree);
+    }
+};
+
+template<typename FeatureType>
+shared_ptr<RandomForest<FeatureType>> importModel(const string& path, const string& format) {
+    ifstream in(path.c_str(), ios::binary);
+    if (!in) {
+        throw std::runtime_error("cannot open " + path);
+    }
+    if (format == "xgboost") {
+        return XGBoostImporter<FeatureType>(in).import();
+    }
+    if (format == "lightgbm") {
+        return LightGBMImporter<FeatureType>(in).import();
+    }
+    if (format == "sklearn") {
+        return SklearnImporter<FeatureType>(in).import();
+    }
+    throw std::runtime_error("unknown model format " + format);
+}
@@ -1,1070 +1,933 @@
-#include <stdlib.h>
+#include "randomForest.h"
+#include "trainer.h"
+#include "outOfCoreTrainer.h"
+#include "modelHandle.h"
+#include "codegen.h"
 
-#include <cstdlib>
-#include <cstddef>
-
-#include <iostream>
-#include <vector>
-#include <string>
-#include <memory>
 #include <chrono>
 
-#include "x86intrin.h"
-
-using namespace std;
+struct ScopedTimer {
+    ScopedTimer(const string& message)
+        : message_(message)
+        , begin_(chrono::high_resolution_clock::now())
+    {
+    }
 
-template<typename FeatureType>
-struct RandomForest {
-    using Features = vector<FeatureType>;
+    ~ScopedTimer() {
+        cout << message_ << " " << chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - begin_).count() << endl;
+    }
 
-    struct Node {
-        bool isLeaf_;
+    string message_;
+    chrono::high_resolution_clock::time_point begin_;
+};
 
-        FeatureType leafValue_;
+template<typename FT>
+void test() {
+    cout << "================" << typeid(FT).name() << "================" << endl;
 
-        int featureIndex_;
-        FeatureType featureValue_;
-        shared_ptr<Node> left_;
-        shared_ptr<Node> right_;
-        size_t index_;
+    using RF = RandomForest<FT>;
+    static constexpr size_t nFeatures = 100;
+    shared_ptr<RF> f;
+    {
+        ScopedTimer timer("gen");
+        f = generateRandomForest<FT>(nFeatures, 1000, 10);
+    }
 
-        float eval(const Features& features) const {
-            if (isLeaf_) {
-                return leafValue_;
-            } else {
-                if (features[featureIndex_] < featureValue_) {
-                    return left_->eval(features);
-                } else {
-                    return right_->eval(features);
-                }
+    static constexpr size_t kN = 1000;
+    vector<typename RF::Features> features(kN);
+    {
+        ScopedTimer timer("gen features");
+        for (size_t i = 0; i < kN; ++i) {
+            features[i].resize(nFeatures);
+            for (size_t j = 0; j < nFeatures; ++j) {
+                features[i][j] = static_cast<FT>(rand())/RAND_MAX;
             }
         }
+    }
 
-        size_t size() const {
-            if (isLeaf_) {
-                return 1;
-            } else {
-                return 1 + left_->size() + right_->size();
+    {
+        ScopedTimer timer("eval");
+        FT sum = 0;
+        for (size_t j = 0; j < 30; ++j) {
+            for (size_t i = 0; i < features.size(); ++i) {
+                sum += f->eval(features[i]);
             }
         }
-    };
+        cout << "sum: " << sum << endl;
+    }
 
-    vector<shared_ptr<Node>> nodes_;
+    using FF = FlatForest<FT>;
+    shared_ptr<FF> ff;
+    {
+        ScopedTimer timer("flattening");
+        ff = shared_ptr<FF>(new FF(*f));
+    }
 
-    FeatureType eval(const Features& features) const {
-        FeatureType result = 0.f;
-        for (const auto& node: nodes_) {
-            result += node->eval(features);
+    {
+        ScopedTimer timer("flat eval");
+        FT sum = 0;
+        for (size_t j = 0; j < 30; ++j) {
+            for (size_t i = 0; i < features.size(); ++i) {
+                sum += ff->eval(features[i]);
+            }
         }
-        return result;
+        cout << "sum2: " << sum << endl;
     }
 
-    size_t size() const {
-        size_t size = 0;
-        for (const auto& node: nodes_) {
-            size += node->size();
+    {
+        ScopedTimer timer("vector eval");
+        FT sum = 0;
+        for (size_t j = 0; j < 30; ++j) {
+            for (size_t i = 0; i < features.size()/FF::kSize; ++i) {
+                FT* data[FF::kSize];
+                for (size_t k = 0; k < FF::kSize; ++k) {
+                    data[k] = &features[FF::kSize*i + k][0];
+                }
+                typename FF::FloatVectorType v = ff->evalAVX(data);
+                for (size_t k = 0; k < FF::kSize; ++k) {
+                    sum += v.floatData_[k];
+                }
+            }
         }
-        return size;
+        cout << "sum3: " << sum << endl;
     }
 
-    void reindex(shared_ptr<Node> node, size_t& index) {
-        node->index_ = index++;
-        if (!node->isLeaf_) {
-            reindex(node->left_, index);
-            reindex(node->right_, index);
-        }
+    static constexpr size_t kBatchN = kN - 3;
+    vector<FT> rows(kBatchN*nFeatures);
+    for (size_t i = 0; i < kBatchN; ++i) {
+        copy(features[i].begin(), features[i].end(), rows.begin() + i*nFeatures);
     }
+    vector<FT> out(kBatchN);
 
-    void reindex() {
-        size_t index = 0;
-        for (auto& node: nodes_) {
-            reindex(node, index);
+    {
+        ScopedTimer timer("batch eval");
+        FT sum = 0;
+        for (size_t j = 0; j < 30; ++j) {
+            ff->evalBatch(&rows[0], kBatchN, nFeatures, &out[0]);
+            for (size_t i = 0; i < kBatchN; ++i) {
+                sum += out[i];
+            }
         }
+        cout << "sum4: " << sum << endl;
     }
-};
-
-union FloatVector {
-    using AVXType = __m256;
-    static const size_t kSize = 8;
-    AVXType data_;
-    float floatData_[8];
-} __attribute__((aligned(32), packed));
-
-union DoubleVector {
-    using AVXType = __m256d;
-    static const size_t kSize = 4;
-    __m256d data_;
-    double floatData_[4];
-} __attribute__((aligned(32), packed));
-
-union IVector8 {
-    using AVXType = __m256i;
-    static const size_t kSize = 8;
-    __m256i data_;
-    int intData_[8];
-} __attribute__((aligned(32), packed));
-
-union IVector4 {
-    using AVXType = __m128i;
-    static const size_t kSize = 4;
-    __m128i data_;
-    int intData_[4];
-} __attribute__((aligned(16), packed));
-
-template<typename T>
-T InitVector(int value);
-
-template<>
-inline __m128i InitVector<__m128i>(int value) {
-    return _mm_set1_epi32(value);
-}
 
-template<>
-inline __m256i InitVector<__m256i>(int value) {
-    return _mm256_set1_epi32(value);
-}
-
-template<typename T>
-struct AVXTraits;
-
-template<>
-struct AVXTraits<float> {
-    using IVectorType = IVector8;
-    using FloatVectorType = FloatVector;
-    static constexpr size_t kSize = 8;
-};
-
-template<>
-struct AVXTraits<double> {
-    using IVectorType = IVector4;
-    using FloatVectorType = DoubleVector;
-    static constexpr size_t kSize = 4;
-};
-
-template<typename FeatureType>
-struct FlatForest {
-    using RandomForestF = RandomForest<FeatureType>;
-    using Traits = AVXTraits<FeatureType>;
-    using IVectorType = typename Traits::IVectorType;
-    using FloatVectorType = typename Traits::FloatVectorType;
-    static constexpr size_t kSize = Traits::kSize;
-
-    int iTerminator_;
-    IVectorType terminator_; // should be the first field
-    vector<int> featureIndex_;
-    vector<FeatureType> featureValue_;
-    vector<int> leftIndex_;
-    vector<int> rightIndex_;
-    vector<FeatureType> nodeValue_;
-
-    FlatForest(const RandomForestF& f) {
-        iTerminator_ = f.size();
-        size_t size = iTerminator_ + 1;
-        featureIndex_.resize(size);
-        featureValue_.resize(size);
-        leftIndex_.resize(size);
-        rightIndex_.resize(size);
-        nodeValue_.resize(size);
-
-        for (size_t i = 1; i < f.nodes_.size(); ++i) {
-            fill(f.nodes_[i - 1], f.nodes_[i]->index_);
-        }
-        fill(f.nodes_[f.nodes_.size() - 1], iTerminator_);
-        leftIndex_[iTerminator_] = iTerminator_;
-        rightIndex_[iTerminator_] = iTerminator_;
-        featureIndex_[iTerminator_] = 0;
-        nodeValue_[iTerminator_] = 0.f;
-        featureValue_[iTerminator_] = numeric_limits<FeatureType>::max();
+    string modelPath = string("/tmp/flatForest.") + typeid(FT).name() + ".bin";
+    {
+        ScopedTimer timer("save");
+        ff->save(modelPath);
+    }
 
-        size_t address = reinterpret_cast<size_t>(&(terminator_.data_));
-        if (address % 16) {
-            cout << "address: " << (address % 16) << " " << sizeof(terminator_.data_) << endl;
-            throw std::runtime_error("bad alignment");
-        }
-        terminator_.data_ = InitVector<typename IVectorType::AVXType>(iTerminator_);
+    shared_ptr<FF> mapped;
+    {
+        ScopedTimer timer("mapped load");
+        mapped = FF::load(modelPath);
     }
 
-    void fill(shared_ptr<typename RandomForestF::Node> node, int nextIndex) {
-        if (node->index_ >= featureIndex_.size()) {
-            throw std::runtime_error("tree invariant failed");
-        }
-        if (!node->isLeaf_) {
-            featureIndex_[node->index_] = node->featureIndex_;
-            featureValue_[node->index_] = node->featureValue_;
-            leftIndex_[node->index_] = node->left_->index_;
-            rightIndex_[node->index_] = node->right_->index_;
-            nodeValue_[node->index_] = 0;
-            fill(node->left_, nextIndex);
-            fill(node->right_, nextIndex);
-        } else {
-            featureIndex_[node->index_] = 0;
-            featureValue_[node->index_] = numeric_limits<FeatureType>::max();
-            leftIndex_[node->index_] = nextIndex;
-            rightIndex_[node->index_] = nextIndex;
-            nodeValue_[node->index_] = node->leafValue_;
+    vector<FT> outMapped(kBatchN);
+    {
+        ScopedTimer timer("mapped batch eval");
+        FT sum = 0;
+        for (size_t j = 0; j < 30; ++j) {
+            mapped->evalBatch(&rows[0], kBatchN, nFeatures, &outMapped[0]);
+            for (size_t i = 0; i < kBatchN; ++i) {
+                sum += outMapped[i];
+            }
         }
+        cout << "sum15: " << sum << endl;
     }
 
-    FeatureType eval(const typename RandomForestF::Features& features) {
-        int begin = 0;
-        FeatureType result = 0.f;
-        while (begin != iTerminator_) {
-            result += nodeValue_[begin];
-            if (features[featureIndex_[begin]] < featureValue_[begin]) {
-                begin = leftIndex_[begin];
-            } else {
-                begin = rightIndex_[begin];
+    {
+        // moves the first 50 trees to the back: append a copy of them to the mapped model, then retire
+        // the originals, and compare with a model flattened from scratch
+        static constexpr size_t kMoved = 50;
+        RF moved = *f;
+        moved.roots_.resize(kMoved);
+        moved.reindex();
+        RF rotated = *f;
+        rotated.roots_.erase(rotated.roots_.begin(), rotated.roots_.begin() + kMoved);
+        rotated.append(moved);
+        rotated.reindex();
+        FF fresh(rotated);
+        {
+            ScopedTimer timer("incremental append and retire");
+            mapped->append(moved);
+            for (size_t t = 0; t < kMoved; ++t) {
+                mapped->retire(0);
+            }
+        }
+        vector<FT> outFresh(kBatchN);
+        vector<FT> outIncremental(kBatchN);
+        fresh.evalBatch(&rows[0], kBatchN, nFeatures, &outFresh[0]);
+        for (int pass = 0; pass < 2; ++pass) {
+            mapped->evalBatch(&rows[0], kBatchN, nFeatures, &outIncremental[0]);
+            if (outIncremental != outFresh || mapped->nTrees() != fresh.nTrees()) {
+                throw std::runtime_error("incremental batch eval mismatch");
             }
+            // retired nodes count towards the block size, so blocks and rounding may differ
+            mapped->evalBatchBlocked(&rows[0], kBatchN, nFeatures, &outIncremental[0]);
+            for (size_t i = 0; i < kBatchN; ++i) {
+                if (abs(outIncremental[i] - outFresh[i]) > 1e-3*abs(outFresh[i])) {
+                    throw std::runtime_error("incremental blocked eval mismatch");
+                }
+            }
+            mapped->compact();
+        }
+        if (mapped->featureIndex_.size() != fresh.featureIndex_.size()) {
+            throw std::runtime_error("compaction left garbage");
         }
-        return result;
     }
+    mapped.reset();
 
-    static inline __m256i poorManBlend8(int mask, const __m256i& a, const __m256i& b) {
-    switch (mask) {
-        case 0:
-            return _mm256_blend_epi32(a, b, 0);
-        case 1:
-                return _mm256_blend_epi32(a, b, 1);
-        case 2:
-                return _mm256_blend_epi32(a, b, 2);
-        case 3:
-                return _mm256_blend_epi32(a, b, 3);
-        case 4:
-                return _mm256_blend_epi32(a, b, 4);
-        case 5:
-                return _mm256_blend_epi32(a, b, 5);
-        case 6:
-                return _mm256_blend_epi32(a, b, 6);
-        case 7:
-                return _mm256_blend_epi32(a, b, 7);
-        case 8:
-                return _mm256_blend_epi32(a, b, 8);
-        case 9:
-                return _mm256_blend_epi32(a, b, 9);
-        case 10:
-                return _mm256_blend_epi32(a, b, 10);
-        case 11:
-                return _mm256_blend_epi32(a, b, 11);
-        case 12:
-                return _mm256_blend_epi32(a, b, 12);
-        case 13:
-                return _mm256_blend_epi32(a, b, 13);
-        case 14:
-                return _mm256_blend_epi32(a, b, 14);
-        case 15:
-                return _mm256_blend_epi32(a, b, 15);
-        case 16:
-                return _mm256_blend_epi32(a, b, 16);
-        case 17:
-                return _mm256_blend_epi32(a, b, 17);
-        case 18:
-                return _mm256_blend_epi32(a, b, 18);
-        case 19:
-                return _mm256_blend_epi32(a, b, 19);
-        case 20:
-                return _mm256_blend_epi32(a, b, 20);
-        case 21:
-                return _mm256_blend_epi32(a, b, 21);
-        case 22:
-                return _mm256_blend_epi32(a, b, 22);
-        case 23:
-                return _mm256_blend_epi32(a, b, 23);
-        case 24:
-                return _mm256_blend_epi32(a, b, 24);
-        case 25:
-                return _mm256_blend_epi32(a, b, 25);
-        case 26:
-                return _mm256_blend_epi32(a, b, 26);
-        case 27:
-                return _mm256_blend_epi32(a, b, 27);
-        case 28:
-                return _mm256_blend_epi32(a, b, 28);
-        case 29:
-                return _mm256_blend_epi32(a, b, 29);
-        case 30:
-                return _mm256_blend_epi32(a, b, 30);
-        case 31:
-                return _mm256_blend_epi32(a, b, 31);
-        case 32:
-                return _mm256_blend_epi32(a, b, 32);
-        case 33:
-                return _mm256_blend_epi32(a, b, 33);
-        case 34:
-                return _mm256_blend_epi32(a, b, 34);
-        case 35:
-                return _mm256_blend_epi32(a, b, 35);
-        case 36:
-                return _mm256_blend_epi32(a, b, 36);
-        case 37:
-                return _mm256_blend_epi32(a, b, 37);
-        case 38:
-                return _mm256_blend_epi32(a, b, 38);
-        case 39:
-                return _mm256_blend_epi32(a, b, 39);
-        case 40:
-                return _mm256_blend_epi32(a, b, 40);
-        case 41:
-                return _mm256_blend_epi32(a, b, 41);
-        case 42:
-                return _mm256_blend_epi32(a, b, 42);
-        case 43:
-                return _mm256_blend_epi32(a, b, 43);
-        case 44:
-                return _mm256_blend_epi32(a, b, 44);
-        case 45:
-                return _mm256_blend_epi32(a, b, 45);
-        case 46:
-                return _mm256_blend_epi32(a, b, 46);
-        case 47:
-                return _mm256_blend_epi32(a, b, 47);
-        case 48:
-                return _mm256_blend_epi32(a, b, 48);
-        case 49:
-                return _mm256_blend_epi32(a, b, 49);
-        case 50:
-                return _mm256_blend_epi32(a, b, 50);
-        case 51:
-                return _mm256_blend_epi32(a, b, 51);
-        case 52:
-                return _mm256_blend_epi32(a, b, 52);
-        case 53:
-                return _mm256_blend_epi32(a, b, 53);
-        case 54:
-                return _mm256_blend_epi32(a, b, 54);
-        case 55:
-                return _mm256_blend_epi32(a, b, 55);
-        case 56:
-                return _mm256_blend_epi32(a, b, 56);
-        case 57:
-                return _mm256_blend_epi32(a, b, 57);
-        case 58:
-                return _mm256_blend_epi32(a, b, 58);
-        case 59:
-                return _mm256_blend_epi32(a, b, 59);
-        case 60:
-                return _mm256_blend_epi32(a, b, 60);
-        case 61:
-                return _mm256_blend_epi32(a, b, 61);
-        case 62:
-                return _mm256_blend_epi32(a, b, 62);
-        case 63:
-                return _mm256_blend_epi32(a, b, 63);
-        case 64:
-                return _mm256_blend_epi32(a, b, 64);
-        case 65:
-                return _mm256_blend_epi32(a, b, 65);
-        case 66:
-                return _mm256_blend_epi32(a, b, 66);
-        case 67:
-                return _mm256_blend_epi32(a, b, 67);
-        case 68:
-                return _mm256_blend_epi32(a, b, 68);
-        case 69:
-                return _mm256_blend_epi32(a, b, 69);
-        case 70:
-                return _mm256_blend_epi32(a, b, 70);
-        case 71:
-                return _mm256_blend_epi32(a, b, 71);
-        case 72:
-                return _mm256_blend_epi32(a, b, 72);
-        case 73:
-                return _mm256_blend_epi32(a, b, 73);
-        case 74:
-                return _mm256_blend_epi32(a, b, 74);
-        case 75:
-                return _mm256_blend_epi32(a, b, 75);
-        case 76:
-                return _mm256_blend_epi32(a, b, 76);
-        case 77:
-                return _mm256_blend_epi32(a, b, 77);
-        case 78:
-                return _mm256_blend_epi32(a, b, 78);
-        case 79:
-                return _mm256_blend_epi32(a, b, 79);
-        case 80:
-                return _mm256_blend_epi32(a, b, 80);
-        case 81:
-                return _mm256_blend_epi32(a, b, 81);
-        case 82:
-                return _mm256_blend_epi32(a, b, 82);
-        case 83:
-                return _mm256_blend_epi32(a, b, 83);
-        case 84:
-                return _mm256_blend_epi32(a, b, 84);
-        case 85:
-                return _mm256_blend_epi32(a, b, 85);
-        case 86:
-                return _mm256_blend_epi32(a, b, 86);
-        case 87:
-                return _mm256_blend_epi32(a, b, 87);
-        case 88:
-                return _mm256_blend_epi32(a, b, 88);
-        case 89:
-                return _mm256_blend_epi32(a, b, 89);
-        case 90:
-                return _mm256_blend_epi32(a, b, 90);
-        case 91:
-                return _mm256_blend_epi32(a, b, 91);
-        case 92:
-                return _mm256_blend_epi32(a, b, 92);
-        case 93:
-                return _mm256_blend_epi32(a, b, 93);
-        case 94:
-                return _mm256_blend_epi32(a, b, 94);
-        case 95:
-                return _mm256_blend_epi32(a, b, 95);
-        case 96:
-                return _mm256_blend_epi32(a, b, 96);
-        case 97:
-                return _mm256_blend_epi32(a, b, 97);
-        case 98:
-                return _mm256_blend_epi32(a, b, 98);
-        case 99:
-                return _mm256_blend_epi32(a, b, 99);
-        case 100:
-                return _mm256_blend_epi32(a, b, 100);
-        case 101:
-                return _mm256_blend_epi32(a, b, 101);
-        case 102:
-                return _mm256_blend_epi32(a, b, 102);
-        case 103:
-                return _mm256_blend_epi32(a, b, 103);
-        case 104:
-                return _mm256_blend_epi32(a, b, 104);
-        case 105:
-                return _mm256_blend_epi32(a, b, 105);
-        case 106:
-                return _mm256_blend_epi32(a, b, 106);
-        case 107:
-                return _mm256_blend_epi32(a, b, 107);
-        case 108:
-                return _mm256_blend_epi32(a, b, 108);
-        case 109:
-                return _mm256_blend_epi32(a, b, 109);
-        case 110:
-                return _mm256_blend_epi32(a, b, 110);
-        case 111:
-                return _mm256_blend_epi32(a, b, 111);
-        case 112:
-                return _mm256_blend_epi32(a, b, 112);
-        case 113:
-                return _mm256_blend_epi32(a, b, 113);
-        case 114:
-                return _mm256_blend_epi32(a, b, 114);
-        case 115:
-                return _mm256_blend_epi32(a, b, 115);
-        case 116:
-                return _mm256_blend_epi32(a, b, 116);
-        case 117:
-                return _mm256_blend_epi32(a, b, 117);
-        case 118:
-                return _mm256_blend_epi32(a, b, 118);
-        case 119:
-                return _mm256_blend_epi32(a, b, 119);
-        case 120:
-                return _mm256_blend_epi32(a, b, 120);
-        case 121:
-                return _mm256_blend_epi32(a, b, 121);
-        case 122:
-                return _mm256_blend_epi32(a, b, 122);
-        case 123:
-                return _mm256_blend_epi32(a, b, 123);
-        case 124:
-                return _mm256_blend_epi32(a, b, 124);
-        case 125:
-                return _mm256_blend_epi32(a, b, 125);
-        case 126:
-                return _mm256_blend_epi32(a, b, 126);
-        case 127:
-                return _mm256_blend_epi32(a, b, 127);
-        case 128:
-                return _mm256_blend_epi32(a, b, 128);
-        case 129:
-                return _mm256_blend_epi32(a, b, 129);
-        case 130:
-                return _mm256_blend_epi32(a, b, 130);
-        case 131:
-                return _mm256_blend_epi32(a, b, 131);
-        case 132:
-                return _mm256_blend_epi32(a, b, 132);
-        case 133:
-                return _mm256_blend_epi32(a, b, 133);
-        case 134:
-                return _mm256_blend_epi32(a, b, 134);
-        case 135:
-                return _mm256_blend_epi32(a, b, 135);
-        case 136:
-                return _mm256_blend_epi32(a, b, 136);
-        case 137:
-                return _mm256_blend_epi32(a, b, 137);
-        case 138:
-                return _mm256_blend_epi32(a, b, 138);
-        case 139:
-                return _mm256_blend_epi32(a, b, 139);
-        case 140:
-                return _mm256_blend_epi32(a, b, 140);
-        case 141:
-                return _mm256_blend_epi32(a, b, 141);
-        case 142:
-                return _mm256_blend_epi32(a, b, 142);
-        case 143:
-                return _mm256_blend_epi32(a, b, 143);
-        case 144:
-                return _mm256_blend_epi32(a, b, 144);
-        case 145:
-                return _mm256_blend_epi32(a, b, 145);
-        case 146:
-                return _mm256_blend_epi32(a, b, 146);
-        case 147:
-                return _mm256_blend_epi32(a, b, 147);
-        case 148:
-                return _mm256_blend_epi32(a, b, 148);
-        case 149:
-                return _mm256_blend_epi32(a, b, 149);
-        case 150:
-                return _mm256_blend_epi32(a, b, 150);
-        case 151:
-                return _mm256_blend_epi32(a, b, 151);
-        case 152:
-                return _mm256_blend_epi32(a, b, 152);
-        case 153:
-                return _mm256_blend_epi32(a, b, 153);
-        case 154:
-                return _mm256_blend_epi32(a, b, 154);
-        case 155:
-                return _mm256_blend_epi32(a, b, 155);
-        case 156:
-                return _mm256_blend_epi32(a, b, 156);
-        case 157:
-                return _mm256_blend_epi32(a, b, 157);
-        case 158:
-                return _mm256_blend_epi32(a, b, 158);
-        case 159:
-                return _mm256_blend_epi32(a, b, 159);
-        case 160:
-                return _mm256_blend_epi32(a, b, 160);
-        case 161:
-                return _mm256_blend_epi32(a, b, 161);
-        case 162:
-                return _mm256_blend_epi32(a, b, 162);
-        case 163:
-                return _mm256_blend_epi32(a, b, 163);
-        case 164:
-                return _mm256_blend_epi32(a, b, 164);
-        case 165:
-                return _mm256_blend_epi32(a, b, 165);
-        case 166:
-                return _mm256_blend_epi32(a, b, 166);
-        case 167:
-                return _mm256_blend_epi32(a, b, 167);
-        case 168:
-                return _mm256_blend_epi32(a, b, 168);
-        case 169:
-                return _mm256_blend_epi32(a, b, 169);
-        case 170:
-                return _mm256_blend_epi32(a, b, 170);
-        case 171:
-                return _mm256_blend_epi32(a, b, 171);
-        case 172:
-                return _mm256_blend_epi32(a, b, 172);
-        case 173:
-                return _mm256_blend_epi32(a, b, 173);
-        case 174:
-                return _mm256_blend_epi32(a, b, 174);
-        case 175:
-                return _mm256_blend_epi32(a, b, 175);
-        case 176:
-                return _mm256_blend_epi32(a, b, 176);
-        case 177:
-                return _mm256_blend_epi32(a, b, 177);
-        case 178:
-                return _mm256_blend_epi32(a, b, 178);
-        case 179:
-                return _mm256_blend_epi32(a, b, 179);
-        case 180:
-                return _mm256_blend_epi32(a, b, 180);
-        case 181:
-                return _mm256_blend_epi32(a, b, 181);
-        case 182:
-                return _mm256_blend_epi32(a, b, 182);
-        case 183:
-                return _mm256_blend_epi32(a, b, 183);
-        case 184:
-                return _mm256_blend_epi32(a, b, 184);
-        case 185:
-                return _mm256_blend_epi32(a, b, 185);
-        case 186:
-                return _mm256_blend_epi32(a, b, 186);
-        case 187:
-                return _mm256_blend_epi32(a, b, 187);
-        case 188:
-                return _mm256_blend_epi32(a, b, 188);
-        case 189:
-                return _mm256_blend_epi32(a, b, 189);
-        case 190:
-                return _mm256_blend_epi32(a, b, 190);
-        case 191:
-                return _mm256_blend_epi32(a, b, 191);
-        case 192:
-                return _mm256_blend_epi32(a, b, 192);
-        case 193:
-                return _mm256_blend_epi32(a, b, 193);
-        case 194:
-                return _mm256_blend_epi32(a, b, 194);
-        case 195:
-                return _mm256_blend_epi32(a, b, 195);
-        case 196:
-                return _mm256_blend_epi32(a, b, 196);
-        case 197:
-                return _mm256_blend_epi32(a, b, 197);
-        case 198:
-                return _mm256_blend_epi32(a, b, 198);
-        case 199:
-                return _mm256_blend_epi32(a, b, 199);
-        case 200:
-                return _mm256_blend_epi32(a, b, 200);
-        case 201:
-                return _mm256_blend_epi32(a, b, 201);
-        case 202:
-                return _mm256_blend_epi32(a, b, 202);
-        case 203:
-                return _mm256_blend_epi32(a, b, 203);
-        case 204:
-                return _mm256_blend_epi32(a, b, 204);
-        case 205:
-                return _mm256_blend_epi32(a, b, 205);
-        case 206:
-                return _mm256_blend_epi32(a, b, 206);
-        case 207:
-                return _mm256_blend_epi32(a, b, 207);
-        case 208:
-                return _mm256_blend_epi32(a, b, 208);
-        case 209:
-                return _mm256_blend_epi32(a, b, 209);
-        case 210:
-                return _mm256_blend_epi32(a, b, 210);
-        case 211:
-                return _mm256_blend_epi32(a, b, 211);
-        case 212:
-                return _mm256_blend_epi32(a, b, 212);
-        case 213:
-                return _mm256_blend_epi32(a, b, 213);
-        case 214:
-                return _mm256_blend_epi32(a, b, 214);
-        case 215:
-                return _mm256_blend_epi32(a, b, 215);
-        case 216:
-                return _mm256_blend_epi32(a, b, 216);
-        case 217:
-                return _mm256_blend_epi32(a, b, 217);
-        case 218:
-                return _mm256_blend_epi32(a, b, 218);
-        case 219:
-                return _mm256_blend_epi32(a, b, 219);
-        case 220:
-                return _mm256_blend_epi32(a, b, 220);
-        case 221:
-                return _mm256_blend_epi32(a, b, 221);
-        case 222:
-                return _mm256_blend_epi32(a, b, 222);
-        case 223:
-                return _mm256_blend_epi32(a, b, 223);
-        case 224:
-                return _mm256_blend_epi32(a, b, 224);
-        case 225:
-                return _mm256_blend_epi32(a, b, 225);
-        case 226:
-                return _mm256_blend_epi32(a, b, 226);
-        case 227:
-                return _mm256_blend_epi32(a, b, 227);
-        case 228:
-                return _mm256_blend_epi32(a, b, 228);
-        case 229:
-                return _mm256_blend_epi32(a, b, 229);
-        case 230:
-                return _mm256_blend_epi32(a, b, 230);
-        case 231:
-                return _mm256_blend_epi32(a, b, 231);
-        case 232:
-                return _mm256_blend_epi32(a, b, 232);
-        case 233:
-                return _mm256_blend_epi32(a, b, 233);
-        case 234:
-                return _mm256_blend_epi32(a, b, 234);
-        case 235:
-                return _mm256_blend_epi32(a, b, 235);
-        case 236:
-                return _mm256_blend_epi32(a, b, 236);
-        case 237:
-                return _mm256_blend_epi32(a, b, 237);
-        case 238:
-                return _mm256_blend_epi32(a, b, 238);
-        case 239:
-                return _mm256_blend_epi32(a, b, 239);
-        case 240:
-                return _mm256_blend_epi32(a, b, 240);
-        case 241:
-                return _mm256_blend_epi32(a, b, 241);
-        case 242:
-                return _mm256_blend_epi32(a, b, 242);
-        case 243:
-                return _mm256_blend_epi32(a, b, 243);
-        case 244:
-                return _mm256_blend_epi32(a, b, 244);
-        case 245:
-                return _mm256_blend_epi32(a, b, 245);
-        case 246:
-                return _mm256_blend_epi32(a, b, 246);
-        case 247:
-                return _mm256_blend_epi32(a, b, 247);
-        case 248:
-                return _mm256_blend_epi32(a, b, 248);
-        case 249:
-                return _mm256_blend_epi32(a, b, 249);
-        case 250:
-                return _mm256_blend_epi32(a, b, 250);
-        case 251:
-                return _mm256_blend_epi32(a, b, 251);
-        case 252:
-                return _mm256_blend_epi32(a, b, 252);
-        case 253:
-                return _mm256_blend_epi32(a, b, 253);
-        case 254:
-                return _mm256_blend_epi32(a, b, 254);
-        case 255:
-                return _mm256_blend_epi32(a, b, 255);
-        default:
-            throw std::runtime_error("bad blend mask");
+    {
+        // a root pointing back at itself would spin the kernels forever, loading must refuse it
+        string bytes;
+        {
+            ifstream in(modelPath.c_str(), ios::binary);
+            bytes.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        }
+        const FlatForestHeader& header = *reinterpret_cast<const FlatForestHeader*>(bytes.data());
+        memset(&bytes[header.leftIndexOffset_], 0, sizeof(int));
+        string corruptPath = modelPath + ".corrupt";
+        {
+            ofstream out(corruptPath.c_str(), ios::binary);
+            out.write(bytes.data(), bytes.size());
+        }
+        bool caught = false;
+        try {
+            FF::load(corruptPath);
+        } catch (const std::runtime_error&) {
+            caught = true;
+        }
+        unlink(corruptPath.c_str());
+        if (!caught) {
+            throw std::runtime_error("corrupt model loaded");
         }
     }
+    unlink(modelPath.c_str());
 
-    FloatVector evalAVXSparse(float** features) {
-        IVector8 current;
-        current.data_ = _mm256_set1_epi32(0);
-        FloatVector result;
-        result.data_ = _mm256_set1_ps(0.f);
-
-        FloatVector nodeValues;
-        IVector8 featureIndices;
-        FloatVector featureValues;
-        IVector8 leftIndices;
-        IVector8 rightIndices;
-        FloatVector featuresHere;
-
-        while (-1 != _mm256_movemask_epi8(_mm256_cmpeq_epi32(current.data_, terminator_.data_))) {
-            nodeValues.data_ = _mm256_i32gather_ps(&nodeValue_[0], current.data_, 4);
-            result.data_ = _mm256_add_ps(result.data_, nodeValues.data_);
-
-            featureIndices.data_ = _mm256_i32gather_epi32(&featureIndex_[0], current.data_, 4);
-            featureValues.data_ = _mm256_i32gather_ps(&featureValue_[0], current.data_, 4);
-            leftIndices.data_ = _mm256_i32gather_epi32(&leftIndex_[0], current.data_, 4);
-            rightIndices.data_ = _mm256_i32gather_epi32(&rightIndex_[0], current.data_, 4);
-            for (size_t i = 0; i < 8; ++i) {
-                featuresHere.floatData_[i] = features[i][featureIndices.intData_[i]];
+    {
+        // the rows with most values dropped, as dense rows and as CSR
+        vector<FT> sparseRows(rows.size());
+        vector<size_t> offsets(1, 0);
+        vector<int> indices;
+        vector<FT> values;
+        for (size_t i = 0; i < kBatchN; ++i) {
+            for (size_t j = 0; j < nFeatures; ++j) {
+                FT value = rows[i*nFeatures + j];
+                if (value >= 0.9) {
+                    sparseRows[i*nFeatures + j] = value;
+                    indices.push_back(j);
+                    values.push_back(value);
+                }
             }
-            int mask = _mm256_movemask_ps(_mm256_cmp_ps(featuresHere.data_, featureValues.data_, _CMP_LT_OS));
-            current.data_ = poorManBlend8(mask, rightIndices.data_, leftIndices.data_);
+            offsets.push_back(indices.size());
         }
-        return result;
-    }
-
-    FloatVector evalAVXDense(float* features0, const IVector8& offsets) {
-        IVector8 current;
-        current.data_ = _mm256_set1_epi32(0);
-        FloatVector result;
-        result.data_ = _mm256_set1_ps(0.f);
-
-        FloatVector nodeValues;
-        IVector8 featureIndices;
-        FloatVector featureValues;
-        IVector8 leftIndices;
-        IVector8 rightIndices;
-        FloatVector featuresHere;
-        IVector8 featureAddresses;
-
-        while (-1 != _mm256_movemask_epi8(_mm256_cmpeq_epi32(current.data_, terminator_.data_))) {
-            nodeValues.data_ = _mm256_i32gather_ps(&nodeValue_[0], current.data_, 4);
-            result.data_ = _mm256_add_ps(result.data_, nodeValues.data_);
-
-            featureIndices.data_ = _mm256_i32gather_epi32(&featureIndex_[0], current.data_, 4);
-            featureValues.data_ = _mm256_i32gather_ps(&featureValue_[0], current.data_, 4);
-            leftIndices.data_ = _mm256_i32gather_epi32(&leftIndex_[0], current.data_, 4);
-            rightIndices.data_ = _mm256_i32gather_epi32(&rightIndex_[0], current.data_, 4);
-
-            featureAddresses.data_ = _mm256_add_epi32(featureIndices.data_, offsets.data_);
-            featuresHere.data_ = _mm256_i32gather_ps(features0, featureAddresses.data_, 4);
-
-            int mask = _mm256_movemask_ps(_mm256_cmp_ps(featuresHere.data_, featureValues.data_, _CMP_LT_OS));
-            current.data_ = poorManBlend8(mask, rightIndices.data_, leftIndices.data_);
+        CsrRows<FT> csr{&offsets[0], &indices[0], &values[0], kBatchN};
+        vector<FT> outDense(kBatchN);
+        vector<FT> outCsr(kBatchN);
+        ff->evalBatch(&sparseRows[0], kBatchN, nFeatures, &outDense[0]);
+        typename FF::CsrScratch scratch(*ff);
+        {
+            ScopedTimer timer("csr batch eval");
+            FT sum = 0;
+            for (size_t j = 0; j < 30; ++j) {
+                ff->evalBatchCsr(csr, &outCsr[0], scratch);
+                for (size_t i = 0; i < kBatchN; ++i) {
+                    sum += outCsr[i];
+                }
+            }
+            cout << "sum17: " << sum << endl;
+        }
+        typename RF::Features row(nFeatures);
+        for (size_t i = 0; i < kBatchN; ++i) {
+            copy(sparseRows.begin() + i*nFeatures, sparseRows.begin() + (i + 1)*nFeatures, row.begin());
+            if (outCsr[i] != outDense[i] || ff->evalCsr(csr, i, scratch) != ff->eval(row)) {
+                throw std::runtime_error("csr eval mismatch");
+            }
         }
-        return result;
     }
 
-    FloatVector evalAVX(float** features) {
-        IVector8 offsets;
-        for (size_t i = 0; i < 8; ++i) {
-            ssize_t diff = (features[i] - features[0])/sizeof(float);
-            if ( diff >= numeric_limits<int>::max() && diff <= numeric_limits<int>::min() ) {
-                return evalAVXSparse(features);
+    {
+        // every third split sends NaN left, a tenth of the values are NaN
+        RF withMissing = *f;
+        for (size_t i = 0; i < withMissing.nodes_.size(); i += 3) {
+            withMissing.nodes_[i].missingLeft_ = true;
+        }
+        FF missingFlat(withMissing);
+        vector<FT> nanRows(rows);
+        for (FT& value : nanRows) {
+            if (value < 0.1) {
+                value = numeric_limits<FT>::quiet_NaN();
+            }
+        }
+        vector<FT> expected(kBatchN);
+        typename RF::Features row(nFeatures);
+        for (size_t i = 0; i < kBatchN; ++i) {
+            copy(nanRows.begin() + i*nFeatures, nanRows.begin() + (i + 1)*nFeatures, row.begin());
+            expected[i] = withMissing.eval(row);
+            if (missingFlat.eval(row) != expected[i]) {
+                throw std::runtime_error("missing value eval mismatch");
+            }
+        }
+        vector<FT> outMissing(kBatchN);
+        {
+            ScopedTimer timer("missing value batch eval");
+            FT sum = 0;
+            for (size_t j = 0; j < 30; ++j) {
+                missingFlat.evalBatch(&nanRows[0], kBatchN, nFeatures, &outMissing[0]);
+                for (size_t i = 0; i < kBatchN; ++i) {
+                    sum += outMissing[i];
+                }
+            }
+            cout << "sum18: " << sum << endl;
+        }
+        if (outMissing != expected) {
+            throw std::runtime_error("missing value batch eval mismatch");
+        }
+        missingFlat.evalBatchStreaming(&nanRows[0], kBatchN, nFeatures, &outMissing[0]);
+        if (outMissing != expected) {
+            throw std::runtime_error("missing value streaming eval mismatch");
+        }
+        missingFlat.template evalBatchInterleaved<2>(&nanRows[0], kBatchN, nFeatures, &outMissing[0]);
+        if (outMissing != expected) {
+            throw std::runtime_error("missing value interleaved eval mismatch");
+        }
+        for (size_t i = 0; i + FF::kSize <= kBatchN; i += FF::kSize) {
+            FT* lanes[FF::kSize];
+            for (size_t k = 0; k < FF::kSize; ++k) {
+                lanes[k] = &nanRows[(i + k)*nFeatures];
+            }
+            typename FF::FloatVectorType v = missingFlat.evalAVXSparse(lanes);
+            for (size_t k = 0; k < FF::kSize; ++k) {
+                if (v.floatData_[k] != expected[i + k]) {
+                    throw std::runtime_error("missing value sparse eval mismatch");
+                }
+            }
+        }
+        missingFlat.evalBatchBlocked(&nanRows[0], kBatchN, nFeatures, &outMissing[0]);
+        for (size_t i = 0; i < kBatchN; ++i) {
+            if (abs(outMissing[i] - expected[i]) > 1e-3*abs(expected[i])) {
+                throw std::runtime_error("missing value blocked eval mismatch");
             }
-            offsets.intData_[i] = diff;
         }
-        return evalAVXDense(features[0], offsets);
     }
 
-    static inline __m128i poorManBlend4(int mask, const __m128i& a, const __m128i& b) {
-    switch (mask) {
-        case 0:
-                return _mm_blend_epi32(a, b, 0);
-        case 1:
-                return _mm_blend_epi32(a, b, 1);
-        case 2:
-                return _mm_blend_epi32(a, b, 2);
-        case 3:
-                return _mm_blend_epi32(a, b, 3);
-        case 4:
-                return _mm_blend_epi32(a, b, 4);
-        case 5:
-                return _mm_blend_epi32(a, b, 5);
-        case 6:
-                return _mm_blend_epi32(a, b, 6);
-        case 7:
-                return _mm_blend_epi32(a, b, 7);
-        case 8:
-                return _mm_blend_epi32(a, b, 8);
-        case 9:
-                return _mm_blend_epi32(a, b, 9);
-        case 10:
-                return _mm_blend_epi32(a, b, 10);
-        case 11:
-                return _mm_blend_epi32(a, b, 11);
-        case 12:
-                return _mm_blend_epi32(a, b, 12);
-        case 13:
-                return _mm_blend_epi32(a, b, 13);
-        case 14:
-                return _mm_blend_epi32(a, b, 14);
-        case 15:
-                return _mm_blend_epi32(a, b, 15);
-        default:
-            throw std::runtime_error("bad blend mask");
+    {
+        // eleven outputs per leaf, output 0 is the single-output model
+        static constexpr size_t kOutputs = 11;
+        RF multi = *f;
+        multi.nOutputs_ = kOutputs;
+        for (auto& node : multi.nodes_) {
+            if (node.isLeaf_) {
+                node.firstOutput_ = multi.outputs_.size();
+                for (size_t j = 0; j < kOutputs; ++j) {
+                    multi.outputs_.push_back(node.leafValue_*(j + 1)/(j + 2)*2);
+                }
+            }
+        }
+        FF multiFlat(multi);
+        string multiPath = modelPath + ".multi";
+        multiFlat.save(multiPath);
+        shared_ptr<FF> multiMapped = FF::load(multiPath);
+        unlink(multiPath.c_str());
+
+        vector<FT> outMulti(kBatchN*kOutputs);
+        {
+            ScopedTimer timer("multi-output batch eval");
+            FT sum = 0;
+            for (size_t j = 0; j < 30; ++j) {
+                multiFlat.evalBatchOutputs(&rows[0], kBatchN, nFeatures, &outMulti[0]);
+                for (size_t i = 0; i < kBatchN; ++i) {
+                    sum += outMulti[i*kOutputs + kOutputs - 1];
+                }
+            }
+            cout << "sum19: " << sum << endl;
+        }
+        vector<FT> outMapped(kBatchN*kOutputs);
+        multiMapped->evalBatchOutputs(&rows[0], kBatchN, nFeatures, &outMapped[0]);
+        vector<FT> expected(kOutputs);
+        vector<FT> scalar(kOutputs);
+        for (size_t i = 0; i < kBatchN; ++i) {
+            multi.eval(features[i], &expected[0]);
+            multiFlat.eval(features[i], &scalar[0]);
+            if (expected[0] != f->eval(features[i]) || scalar != expected
+                || !equal(expected.begin(), expected.end(), &outMulti[i*kOutputs])
+                || !equal(expected.begin(), expected.end(), &outMapped[i*kOutputs])) {
+                throw std::runtime_error("multi-output eval mismatch");
+            }
         }
     }
 
-    DoubleVector evalAVXSparse(double** features) {
-        IVector4 current;
-        current.data_ = _mm_set1_epi32(0);
-        DoubleVector result;
-        result.data_ = _mm256_set1_pd(0.);
-
-        DoubleVector nodeValues;
-        IVector4 featureIndices;
-        DoubleVector featureValues;
-        IVector4 leftIndices;
-        IVector4 rightIndices;
-        DoubleVector featuresHere;
-        while (((1 << 16) - 1) != _mm_movemask_epi8(_mm_cmpeq_epi32(current.data_, terminator_.data_))) {
-            nodeValues.data_ = _mm256_i32gather_pd(&nodeValue_[0], current.data_, 8);
-            result.data_ = _mm256_add_pd(result.data_, nodeValues.data_);
+    {
+        // half storage takes the decisions of the full model on rows rounded to halves, so the reference
+        // is that model with leaf values rounded and rows widened back
+        using HFF = HalfFlatForest<FT, Float16>;
+        HFF hff(*f);
+        vector<uint16_t> halves;
+        hff.halfRows(&rows[0], kBatchN, nFeatures, halves);
+        vector<FT> outHalf(kBatchN);
+        {
+            ScopedTimer timer("fp16 batch eval");
+            FT sum = 0;
+            for (size_t j = 0; j < 30; ++j) {
+                hff.evalBatch(&halves[0], kBatchN, hff.nFeatures_, &outHalf[0]);
+                for (size_t i = 0; i < kBatchN; ++i) {
+                    sum += outHalf[i];
+                }
+            }
+            cout << "sum20: " << sum << endl;
+        }
+        RF rounded = *f;
+        for (auto& node : rounded.nodes_) {
+            node.leafValue_ = Float16::toFloat(Float16::fromFloat(node.leafValue_));
+        }
+        typename RF::Features row(nFeatures);
+        for (size_t i = 0; i < kBatchN; ++i) {
+            for (size_t j = 0; j < hff.nFeatures_; ++j) {
+                row[j] = Float16::toFloat(halves[i*hff.nFeatures_ + j]);
+            }
+            FT expected = rounded.eval(row);
+            if (hff.eval(&halves[i*hff.nFeatures_]) != outHalf[i] || abs(outHalf[i] - expected) > 1e-5*max<FT>(1, abs(expected))) {
+                throw std::runtime_error("fp16 eval mismatch");
+            }
+        }
 
-            featureIndices.data_ = _mm_i32gather_epi32(&featureIndex_[0], current.data_, 4);
-            featureValues.data_ = _mm256_i32gather_pd(&featureValue_[0], current.data_, 8);
-            leftIndices.data_ = _mm_i32gather_epi32(&leftIndex_[0], current.data_, 4);
-            rightIndices.data_ = _mm_i32gather_epi32(&rightIndex_[0], current.data_, 4);
-            for (size_t i = 0; i < 4; ++i) {
-                featuresHere.floatData_[i] = features[i][featureIndices.intData_[i]];
+        HalfFlatForest<FT, BFloat16> bff(*f);
+        vector<FT> outBf16(kBatchN);
+        bff.evalBatch(&rows[0], kBatchN, nFeatures, &outBf16[0]);
+        bff.halfRows(&rows[0], kBatchN, nFeatures, halves);
+        rounded = *f;
+        for (auto& node : rounded.nodes_) {
+            node.leafValue_ = BFloat16::toFloat(BFloat16::fromFloat(node.leafValue_));
+        }
+        for (size_t i = 0; i < kBatchN; ++i) {
+            for (size_t j = 0; j < bff.nFeatures_; ++j) {
+                row[j] = BFloat16::toFloat(halves[i*bff.nFeatures_ + j]);
+            }
+            FT expected = rounded.eval(row);
+            if (bff.eval(&halves[i*bff.nFeatures_]) != outBf16[i] || abs(outBf16[i] - expected) > 1e-5*max<FT>(1, abs(expected))) {
+                throw std::runtime_error("bfloat16 eval mismatch");
             }
-            int mask = _mm256_movemask_pd(_mm256_cmp_pd(featuresHere.data_, featureValues.data_, _CMP_LT_OS));
-            current.data_ = poorManBlend4(mask, rightIndices.data_, leftIndices.data_);
         }
-        return std::move(result);
     }
 
-    DoubleVector evalAVXDense(double* features0, const IVector4& offsets) {
-        IVector4 current;
-        current.data_ = _mm_set1_epi32(0);
-        DoubleVector result;
-        result.data_ = _mm256_set1_pd(0.);
-
-        DoubleVector nodeValues;
-        IVector4 featureIndices;
-        DoubleVector featureValues;
-        IVector4 leftIndices;
-        IVector4 rightIndices;
-        DoubleVector featuresHere;
-        IVector4 featureAddresses;
-        while (((1 << 16) - 1) != _mm_movemask_epi8(_mm_cmpeq_epi32(current.data_, terminator_.data_))) {
-            nodeValues.data_ = _mm256_i32gather_pd(&nodeValue_[0], current.data_, 8);
-            result.data_ = _mm256_add_pd(result.data_, nodeValues.data_);
-
-            featureIndices.data_ = _mm_i32gather_epi32(&featureIndex_[0], current.data_, 4);
-            featureValues.data_ = _mm256_i32gather_pd(&featureValue_[0], current.data_, 8);
-            leftIndices.data_ = _mm_i32gather_epi32(&leftIndex_[0], current.data_, 4);
-            rightIndices.data_ = _mm_i32gather_epi32(&rightIndex_[0], current.data_, 4);
+    {
+        // readers score through the handle while copies of the model get published under them
+        ModelHandle<FF> handle(ff);
+        atomic<bool> done(false);
+        atomic<size_t> nReads(0);
+        atomic<bool> failed(false);
+        auto read = [&]() {
+            typename ModelHandle<FF>::Reader reader(handle);
+            vector<FT> outRead(kBatchN);
+            while (!done.load()) {
+                {
+                    auto model = reader.lock();
+                    model->evalBatch(&rows[0], kBatchN, nFeatures, &outRead[0]);
+                }
+                if (outRead != out) {
+                    failed.store(true);
+                }
+                ++nReads;
+            }
+        };
+        vector<thread> readers;
+        for (size_t i = 0; i < 2; ++i) {
+            readers.push_back(thread(read));
+        }
+        weak_ptr<FF> first;
+        {
+            ScopedTimer timer("hot swaps");
+            for (size_t i = 0; i < 20; ++i) {
+                shared_ptr<FF> copy(new FF(*ff));
+                if (!i) {
+                    first = copy;
+                }
+                handle.publish(copy);
+                this_thread::sleep_for(chrono::milliseconds(2));
+            }
+            handle.publish(ff);
+        }
+        done.store(true);
+        for (thread& t : readers) {
+            t.join();
+        }
+        handle.drain();
+        cout << "reads during swaps: " << nReads.load() << endl;
+        if (failed.load() || !first.expired()) {
+            throw std::runtime_error("hot swap mismatch");
+        }
+    }
 
-            featureAddresses.data_ = _mm_add_epi32(featureIndices.data_, offsets.data_);
-            featuresHere.data_ = _mm256_i32gather_pd(features0, featureAddresses.data_, 8);
+    vector<FT> outRelaid(kBatchN);
+    {
+        NodeProfile profile;
+        {
+            ScopedTimer timer("profile");
+            ff->profile(&rows[0], kBatchN, nFeatures, profile);
+        }
+        string profilePath = NodeProfile::profilePath(modelPath);
+        profile.save(profilePath);
+        NodeProfile loaded = NodeProfile::load(profilePath);
+        unlink(profilePath.c_str());
+        if (loaded.visits_ != profile.visits_ || loaded.visits_[0] != kBatchN) {
+            throw std::runtime_error("profile round trip mismatch");
+        }
 
-            int mask = _mm256_movemask_pd(_mm256_cmp_pd(featuresHere.data_, featureValues.data_, _CMP_LT_OS));
-            current.data_ = poorManBlend4(mask, rightIndices.data_, leftIndices.data_);
+        shared_ptr<FF> relaid(new FF(*ff));
+        {
+            ScopedTimer timer("relayout");
+            relaid->relayout(loaded);
+        }
+        ScopedTimer timer("relaid batch eval");
+        FT sum = 0;
+        for (size_t j = 0; j < 30; ++j) {
+            relaid->evalBatch(&rows[0], kBatchN, nFeatures, &outRelaid[0]);
+            for (size_t i = 0; i < kBatchN; ++i) {
+                sum += outRelaid[i];
+            }
         }
-        return result;
+        cout << "sum16: " << sum << endl;
     }
 
-    DoubleVector evalAVX(double** features) {
-        IVector4 offsets;
-        for (size_t i = 0; i < 4; ++i) {
-            ssize_t diff = (features[i] - features[0])/sizeof(float);
-            if ( diff >= numeric_limits<int>::max() && diff <= numeric_limits<int>::min() ) {
-                return evalAVXSparse(features);
+    vector<FT> outBlocked(kBatchN);
+    {
+        ScopedTimer timer("blocked batch eval");
+        FT sum = 0;
+        for (size_t j = 0; j < 30; ++j) {
+            ff->evalBatchBlocked(&rows[0], kBatchN, nFeatures, &outBlocked[0]);
+            for (size_t i = 0; i < kBatchN; ++i) {
+                sum += outBlocked[i];
             }
-            offsets.intData_[i] = diff;
         }
-        return evalAVXDense(features[0], offsets);
+        cout << "sum12: " << sum << " (" << ff->defaultTreesPerBlock() << " trees per block)" << endl;
     }
 
-    static void* operator new(size_t size) throw()
+    using PFF = PackedFlatForest<FT>;
+    shared_ptr<PFF> pff;
     {
-        cout << "new " << offsetof(FlatForest<FeatureType>, terminator_) << endl;
-        void* mem = malloc(size + 32 + sizeof(void*));
-        char* alignedMem = reinterpret_cast<char*>(mem) + sizeof(void*);
-        size_t sMem = reinterpret_cast<size_t>(alignedMem);
-        if (sMem % 32) {
-            alignedMem += 32 - (sMem % 32);
-        }
-        *(reinterpret_cast<void**>(alignedMem - sizeof(void*))) = mem;
-
-        return alignedMem;
+        ScopedTimer timer("packing");
+        pff = make_shared<PFF>(*f);
     }
 
-    static void operator delete(void* ptr) throw()
+    vector<FT> outPacked(kBatchN);
     {
-        cout << "delete" << endl;
-        void** mem = reinterpret_cast<void**>(reinterpret_cast<char*>(ptr) - sizeof(void*));
-
-        free(*mem);
+        ScopedTimer timer("packed batch eval");
+        FT sum = 0;
+        for (size_t j = 0; j < 30; ++j) {
+            pff->evalBatch(&rows[0], kBatchN, nFeatures, &outPacked[0]);
+            for (size_t i = 0; i < kBatchN; ++i) {
+                sum += outPacked[i];
+            }
+        }
+        cout << "sum10: " << sum << endl;
     }
 
-    static void* operator new(std::size_t, void *) throw() = delete;
-    static void operator delete (void *, void *) throw() = delete;
-};
-
-template<typename FeatureType>
-shared_ptr<typename RandomForest<FeatureType>::Node> generateRandomNode(size_t nFeatures, size_t maxLevel, size_t level) {
-    bool isLeaf = 0 == (rand() % (maxLevel - level));
-    auto node = make_shared<typename RandomForest<FeatureType>::Node>();
-    node->isLeaf_ = isLeaf;
-    if (isLeaf) {
-        node->leafValue_ = static_cast<FeatureType>(rand())/RAND_MAX;
-    } else {
-        node->featureIndex_ = rand() % nFeatures;
-        node->featureValue_ = static_cast<FeatureType>(rand())/RAND_MAX;
-        node->left_ = generateRandomNode<FeatureType>(nFeatures, maxLevel, level + 1);
-        node->right_ = generateRandomNode<FeatureType>(nFeatures, maxLevel, level + 1);
+    using CFF = CompleteFlatForest<FT>;
+    shared_ptr<CFF> cff;
+    {
+        ScopedTimer timer("complete layout");
+        cff = make_shared<CFF>(*f);
     }
-    return node;
-}
 
-template<typename FeatureType>
-shared_ptr<RandomForest<FeatureType>> generateRandomForest(size_t nFeatures, size_t nTrees, size_t nLevel) {
-    auto result = make_shared<RandomForest<FeatureType>>();
-    for (size_t iTree = 0; iTree < nTrees; ++iTree) {
-        result->nodes_.emplace_back(generateRandomNode<FeatureType>(nFeatures, nLevel, 0));
+    vector<FT> outComplete(kBatchN);
+    {
+        ScopedTimer timer("complete batch eval");
+        FT sum = 0;
+        for (size_t j = 0; j < 30; ++j) {
+            cff->evalBatch(&rows[0], kBatchN, nFeatures, &outComplete[0]);
+            for (size_t i = 0; i < kBatchN; ++i) {
+                sum += outComplete[i];
+            }
+        }
+        cout << "sum13: " << sum << " (depth " << cff->depth_ << ")" << endl;
     }
-    result->reindex();
-
-    return result;
-}
 
-struct ScopedTimer {
-    ScopedTimer(const string& message)
-        : message_(message)
-        , begin_(chrono::high_resolution_clock::now())
+    using QFF = QuantizedFlatForest<FT, uint16_t>;
+    shared_ptr<QFF> qff;
     {
+        ScopedTimer timer("quantization");
+        qff = make_shared<QFF>(*f);
     }
 
-    ~ScopedTimer() {
-        cout << message_ << " " << chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - begin_).count() << endl;
+    vector<uint16_t> bins;
+    {
+        ScopedTimer timer("binning");
+        qff->binRows(&rows[0], kBatchN, nFeatures, bins);
     }
 
-    string message_;
-    chrono::high_resolution_clock::time_point begin_;
-};
-
-template<typename FT>
-void test() {
-    cout << "================" << typeid(FT).name() << "================" << endl;
+    vector<FT> outQuantized(kBatchN);
+    {
+        ScopedTimer timer("quantized batch eval");
+        FT sum = 0;
+        for (size_t j = 0; j < 30; ++j) {
+            qff->evalBatch(&bins[0], kBatchN, &outQuantized[0]);
+            for (size_t i = 0; i < kBatchN; ++i) {
+                sum += outQuantized[i];
+            }
+        }
+        cout << "sum14: " << sum << endl;
+    }
 
-    using RF = RandomForest<FT>;
-    static constexpr size_t nFeatures = 100;
-    shared_ptr<RF> f;
+    using QS = QuickScorer<FT>;
+    shared_ptr<QS> qs;
     {
-        ScopedTimer timer("gen");
-        f = generateRandomForest<FT>(nFeatures, 1000, 10);
+        ScopedTimer timer("quick scorer build");
+        qs = make_shared<QS>(*f);
     }
 
-    static constexpr size_t kN = 1000;
-    vector<typename RF::Features> features(kN);
+    vector<FT> outQuickScorer(kBatchN);
     {
-        ScopedTimer timer("gen features");
-        for (size_t i = 0; i < kN; ++i) {
-            features[i].resize(nFeatures);
-            for (size_t j = 0; j < nFeatures; ++j) {
-                features[i][j] = static_cast<FT>(rand())/RAND_MAX;
+        ScopedTimer timer("quick scorer eval");
+        FT sum = 0;
+        for (size_t j = 0; j < 30; ++j) {
+            qs->evalBatch(&rows[0], kBatchN, nFeatures, &outQuickScorer[0]);
+            for (size_t i = 0; i < kBatchN; ++i) {
+                sum += outQuickScorer[i];
             }
         }
+        cout << "sum11: " << sum << endl;
     }
 
+    vector<FT> outInterleaved2(kBatchN);
     {
-        ScopedTimer timer("eval");
+        ScopedTimer timer("interleaved x2 eval");
         FT sum = 0;
         for (size_t j = 0; j < 30; ++j) {
-            for (size_t i = 0; i < features.size(); ++i) {
-                sum += f->eval(features[i]);
+            ff->template evalBatchInterleaved<2>(&rows[0], kBatchN, nFeatures, &outInterleaved2[0]);
+            for (size_t i = 0; i < kBatchN; ++i) {
+                sum += outInterleaved2[i];
             }
         }
-        cout << "sum: " << sum << endl;
+        cout << "sum7: " << sum << endl;
     }
 
-    using FF = FlatForest<FT>;
-    shared_ptr<FF> ff;
+    vector<FT> outInterleaved4(kBatchN);
     {
-        ScopedTimer timer("flattening");
-        ff = shared_ptr<FF>(new FF(*f));
+        ScopedTimer timer("interleaved x4 eval");
+        FT sum = 0;
+        for (size_t j = 0; j < 30; ++j) {
+            ff->template evalBatchInterleaved<4>(&rows[0], kBatchN, nFeatures, &outInterleaved4[0]);
+            for (size_t i = 0; i < kBatchN; ++i) {
+                sum += outInterleaved4[i];
+            }
+        }
+        cout << "sum8: " << sum << endl;
     }
 
+    vector<FT> outStreaming(kBatchN);
     {
-        ScopedTimer timer("flat eval");
+        ScopedTimer timer("streaming batch eval");
         FT sum = 0;
         for (size_t j = 0; j < 30; ++j) {
-            for (size_t i = 0; i < features.size(); ++i) {
-                sum += ff->eval(features[i]);
+            ff->evalBatchStreaming(&rows[0], kBatchN, nFeatures, &outStreaming[0]);
+            for (size_t i = 0; i < kBatchN; ++i) {
+                sum += outStreaming[i];
             }
         }
-        cout << "sum2: " << sum << endl;
+        cout << "sum6: " << sum << endl;
+    }
+    {
+        bool caught = false;
+        try {
+            ff->evalBatchStreaming(&rows[0], kBatchN, size_t(1) << 31, &outStreaming[0]);
+        } catch (const std::runtime_error&) {
+            caught = true;
+        }
+        if (!caught) {
+            throw std::runtime_error("streaming batch eval accepted a huge stride");
+        }
     }
 
+    ThreadPool pool;
+    vector<FT> outParallel(kBatchN);
     {
-        ScopedTimer timer("vector eval");
+        ScopedTimer timer("parallel batch eval");
         FT sum = 0;
         for (size_t j = 0; j < 30; ++j) {
-            for (size_t i = 0; i < features.size()/FF::kSize; ++i) {
-                FT* data[FF::kSize];
-                for (size_t k = 0; k < FF::kSize; ++k) {
-                    data[k] = &features[FF::kSize*i + k][0];
+            ff->evalBatch(pool, &rows[0], kBatchN, nFeatures, &outParallel[0]);
+            for (size_t i = 0; i < kBatchN; ++i) {
+                sum += outParallel[i];
+            }
+        }
+        cout << "sum5: " << sum << " (" << pool.size() << " threads)" << endl;
+    }
+    {
+        // a throwing chunk reaches the caller once every chunk is done, workers and pool survive it
+        ThreadPool throwingPool(3);
+        atomic<size_t> nItems(0);
+        bool caught = false;
+        try {
+            throwingPool.parallelFor(1000, 10, [&](size_t begin, size_t end) {
+                nItems += end - begin;
+                if (begin % 20) {
+                    throw std::runtime_error("chunk failed");
                 }
-                typename FF::FloatVectorType v = ff->evalAVX(data);
-                for (size_t k = 0; k < FF::kSize; ++k) {
-                    sum += v.floatData_[k];
+            });
+        } catch (const std::runtime_error&) {
+            caught = true;
+        }
+        if (!caught || nItems != 1000) {
+            throw std::runtime_error("parallelFor exception not propagated");
+        }
+        caught = false;
+        try {
+            ff->evalBatch(throwingPool, &rows[0], kBatchN, size_t(1) << 31, &outParallel[0]);
+        } catch (const std::runtime_error&) {
+            caught = true;
+        }
+        if (!caught) {
+            throw std::runtime_error("parallel batch eval accepted a huge stride");
+        }
+    }
+
+    {
+        TrainerParams params;
+        params.nTrees_ = 50;
+        params.maxDepth_ = 8;
+        shared_ptr<RF> trained;
+        {
+            ScopedTimer timer("train");
+            trained = trainRandomForest<FT>(pool, &rows[0], &out[0], kBatchN, nFeatures, nFeatures, params);
+        }
+        FT mean = 0;
+        for (size_t i = 0; i < kBatchN; ++i) {
+            mean += out[i]/kBatchN;
+        }
+        FT variance = 0;
+        for (size_t i = 0; i < kBatchN; ++i) {
+            variance += (out[i] - mean)*(out[i] - mean)/kBatchN;
+        }
+        auto mse = [&](const RF& forest) {
+            FT error = 0;
+            for (size_t i = 0; i < kBatchN; ++i) {
+                FT diff = forest.eval(features[i]) - out[i];
+                error += diff*diff/kBatchN;
+            }
+            return error;
+        };
+        cout << "train mse: " << mse(*trained) << " label variance: " << variance << " nodes: " << trained->size() << endl;
+
+        // written in small batches the way a dataset larger than memory would be
+        string binnedPath = string("/tmp/binned.") + typeid(FT).name() + ".bin";
+        {
+            ScopedTimer timer("write binned");
+            auto edges = sampleEdges(&rows[0], kBatchN, nFeatures, nFeatures, params.maxBins_);
+            {
+                // abandoned halfway: finish() refuses and the file does not load
+                BinnedDatasetWriter<FT> partial(binnedPath, edges, kBatchN);
+                partial.append(&rows[0], &out[0], kBatchN/2, nFeatures);
+                bool caught = false;
+                try {
+                    partial.finish();
+                } catch (const std::runtime_error&) {
+                    caught = true;
+                }
+                try {
+                    MappedBinnedDataset<FT> data(binnedPath);
+                    caught = false;
+                } catch (const std::runtime_error&) {
                 }
+                if (!caught) {
+                    throw std::runtime_error("unfinished binned dataset accepted");
+                }
+            }
+            BinnedDatasetWriter<FT> writer(binnedPath, edges, kBatchN);
+            const size_t kChunk = 128;
+            for (size_t i = 0; i < kBatchN; i += kChunk) {
+                writer.append(&rows[i*nFeatures], &out[i], min(kChunk, kBatchN - i), nFeatures);
             }
+            writer.finish();
         }
-        cout << "sum3: " << sum << endl;
+        shared_ptr<RF> outOfCore;
+        {
+            ScopedTimer timer("train out of core");
+            MappedBinnedDataset<FT> data(binnedPath);
+            outOfCore = OutOfCoreTrainer<FT>(data, params).train(pool);
+        }
+        shared_ptr<RF> smallBudget;
+        {
+            // one node histogram per pass and no subtraction, the forest only differs by rounding
+            ScopedTimer timer("train out of core small budget");
+            MappedBinnedDataset<FT> data(binnedPath);
+            TrainerParams smallParams = params;
+            smallParams.histogramBudget_ = 1;
+            smallBudget = OutOfCoreTrainer<FT>(data, smallParams).train(pool);
+        }
+        unlink(binnedPath.c_str());
+        cout << "out of core train mse: " << mse(*outOfCore) << " nodes: " << outOfCore->size() << endl;
+        if (abs(mse(*smallBudget) - mse(*outOfCore)) > 0.05*mse(*outOfCore)) {
+            throw std::runtime_error("out of core histogram budget changes the forest");
+        }
+    }
+
+    for (size_t i = 0; i < kBatchN; ++i) {
+        if (outParallel[i] != out[i]) {
+            throw std::runtime_error("parallel batch eval mismatch");
+        }
+        if (outMapped[i] != out[i]) {
+            throw std::runtime_error("mapped batch eval mismatch");
+        }
+        if (outRelaid[i] != out[i]) {
+            throw std::runtime_error("relaid batch eval mismatch");
+        }
+        if (outStreaming[i] != out[i]) {
+            throw std::runtime_error("streaming batch eval mismatch");
+        }
+        if (outInterleaved2[i] != out[i] || outInterleaved4[i] != out[i]) {
+            throw std::runtime_error("interleaved batch eval mismatch");
+        }
+        if (outPacked[i] != out[i] || pff->eval(features[i]) != ff->eval(features[i])) {
+            throw std::runtime_error("packed eval mismatch");
+        }
+        if (abs(outBlocked[i] - out[i]) > 1e-3*abs(out[i])) {
+            cout << "blocked mismatch at " << i << ": " << out[i] << " " << outBlocked[i] << endl;
+            throw std::runtime_error("blocked batch eval mismatch");
+        }
+        if (outComplete[i] != out[i] || cff->eval(features[i]) != ff->eval(features[i])) {
+            throw std::runtime_error("complete layout eval mismatch");
+        }
+        if (outQuantized[i] != out[i] || qff->eval(&bins[i*qff->nFeatures_]) != out[i]) {
+            throw std::runtime_error("quantized eval mismatch");
+        }
+        FT reference = f->eval(features[i]);
+        if (outQuickScorer[i] != reference || qs->eval(features[i]) != reference) {
+            cout << "quick scorer mismatch at " << i << ": " << reference << " " << outQuickScorer[i] << endl;
+            throw std::runtime_error("quick scorer mismatch");
+        }
+        FT expected = ff->eval(features[i]);
+        if (abs(expected - out[i]) > 1e-3*abs(expected)) {
+            cout << "batch mismatch at " << i << ": " << expected << " " << out[i] << endl;
+            throw std::runtime_error("batch eval mismatch");
+        }
+    }
+
+    {
+        // -inf features go left at every split but must not move leaves or lanes parked on the terminator,
+        // an odd row count leaves parked lanes in the last vector
+        vector<FT> infRows(rows);
+        for (size_t i = 0; i < kBatchN; i += 2) {
+            for (size_t j = 0; j < nFeatures; j += 3) {
+                infRows[i*nFeatures + j] = -numeric_limits<FT>::infinity();
+            }
+        }
+        size_t nInfRows = kBatchN - 3;
+        vector<FT> outInf(nInfRows);
+        vector<FT> outInfPacked(nInfRows);
+        ff->evalBatch(&infRows[0], nInfRows, nFeatures, &outInf[0]);
+        pff->evalBatch(&infRows[0], nInfRows, nFeatures, &outInfPacked[0]);
+        typename RF::Features row(nFeatures);
+        for (size_t i = 0; i < nInfRows; ++i) {
+            copy(infRows.begin() + i*nFeatures, infRows.begin() + (i + 1)*nFeatures, row.begin());
+            if (outInfPacked[i] != outInf[i] || pff->eval(row) != ff->eval(row)) {
+                throw std::runtime_error("packed -inf eval mismatch");
+            }
+        }
+    }
+
+    {
+        // thresholds on a 1/16 grid leave at most 17 per feature, which fits 8 bit bins
+        RF coarse = *f;
+        for (auto& node : coarse.nodes_) {
+            node.featureValue_ = round(node.featureValue_*16)/16;
+        }
+        FF coarseFlat(coarse);
+        QuantizedFlatForest<FT, uint8_t> coarseQuantized(coarse);
+        vector<uint8_t> smallBins;
+        coarseQuantized.binRows(&rows[0], kBatchN, nFeatures, smallBins);
+        vector<FT> outCoarse(kBatchN);
+        vector<FT> outSmallBins(kBatchN);
+        coarseFlat.evalBatch(&rows[0], kBatchN, nFeatures, &outCoarse[0]);
+        coarseQuantized.evalBatch(&smallBins[0], kBatchN, &outSmallBins[0]);
+        for (size_t i = 0; i < kBatchN; ++i) {
+            if (outSmallBins[i] != outCoarse[i] || coarseQuantized.eval(&smallBins[i*coarseQuantized.nFeatures_]) != outCoarse[i]) {
+                throw std::runtime_error("8 bit quantized eval mismatch");
+            }
+        }
+        // the full model has far more than 255 distinct thresholds per feature
+        bool caught = false;
+        try {
+            QuantizedFlatForest<FT, uint8_t> overflow(*f);
+        } catch (const std::runtime_error&) {
+            caught = true;
+        }
+        if (!caught) {
+            throw std::runtime_error("8 bit bins accepted too many thresholds");
+        }
+    }
+}
+
+// compiles the generated source with a driver that scores embedded rows and checks it against the forest.
+// Some thresholds are infinite, as imported "always go one way" splits are, and so are some features
+template<typename FT>
+void testCodegen() {
+    using RF = RandomForest<FT>;
+    using Generator = CodeGenerator<FT>;
+    static constexpr size_t kFeatures = 5;
+    static constexpr size_t kRows = 64;
+    srand(7);
+    shared_ptr<RF> f = generateRandomForest<FT>(kFeatures, 20, 6);
+    size_t iSplit = 0;
+    for (auto& node : f->nodes_) {
+        if (!node.isLeaf_ && 0 == ++iSplit % 5) {
+            node.featureValue_ = (iSplit % 2 ? 1 : -1)*numeric_limits<FT>::infinity();
+        }
+    }
+    vector<typename RF::Features> rows(kRows, typename RF::Features(kFeatures));
+    for (size_t i = 0; i < kRows; ++i) {
+        for (size_t j = 0; j < kFeatures; ++j) {
+            rows[i][j] = 0 == (i + j) % 7 ? ((i % 2 ? 1 : -1)*numeric_limits<FT>::infinity())
+                                          : static_cast<FT>(rand())/RAND_MAX;
+        }
+    }
+
+    string base = string("/tmp/forestCodegen.") + typeid(FT).name();
+    for (CodeStyle style : {CodeStyle::Branchy, CodeStyle::Branchless}) {
+        {
+            ofstream source(base + ".cpp");
+            generateCode(*f, style, "compiledForest", source);
+            source << "\n#include <cstdio>\n\nint main() {\n";
+            source << "    static const compiledForest::FeatureType rows[][" << kFeatures << "] = {\n";
+            for (const auto& row : rows) {
+                source << "        {";
+                for (FT value : row) {
+                    source << Generator::literal(value) << ", ";
+                }
+                source << "},\n";
+            }
+            source << "    };\n";
+            source << "    for (const auto& row : rows) {\n";
+            source << "        printf(\"%a\\n\", double(compiledForest::eval(row)));\n";
+            source << "    }\n";
+            source << "    return 0;\n}\n";
+        }
+        const char* compiler = getenv("CXX") ? getenv("CXX") : "g++";
+        string command = string(compiler) + " -O1 -std=c++11 " + base + ".cpp -o " + base;
+        if (system(command.c_str())) {
+            throw std::runtime_error("generated code does not compile");
+        }
+        FILE* out = popen(base.c_str(), "r");
+        if (!out) {
+            throw std::runtime_error("cannot run generated code");
+        }
+        char line[64];
+        for (size_t i = 0; i < kRows; ++i) {
+            if (!fgets(line, sizeof(line), out) || static_cast<FT>(strtod(line, nullptr)) != f->eval(rows[i])) {
+                pclose(out);
+                throw std::runtime_error("generated code mismatch");
+            }
+        }
+        pclose(out);
+        unlink((base + ".cpp").c_str());
+        unlink(base.c_str());
     }
+    cout << "codegen with infinite thresholds ok" << endl;
 }
 
 int main() {
     test<double>();
     test<float>();
+    testCodegen<double>();
+    testCodegen<float>();
     return 0;
 }
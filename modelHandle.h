@@ -0,0 +1,185 @@
+#pragma once
+
+#include "randomForest.h"
+
+#include <atomic>
+#include <mutex>
+
+// read-mostly holder of the model a service scores with, in the spirit of RCU. A read announces the
+// epoch it started in and loads the current model, no locks and no reference counting on that path.
+// publish() swaps the model atomically and keeps the old one until every read that may still use it
+// has finished, so a swap never pauses scoring. Only writers take the mutex
+template<typename Model>
+struct ModelHandle {
+    static constexpr size_t kMaxReaders = 256;
+    static constexpr uint64_t kIdle = 0;
+
+    static constexpr size_t kCacheLine = 64;
+
+    // one cache line per reader, announcing a read does not bounce the other readers' lines
+    struct alignas(kCacheLine) Slot {
+        atomic<uint64_t> epoch_;
+        atomic<bool> taken_;
+    };
+    static_assert(sizeof(Slot) == kCacheLine && alignof(Slot) == kCacheLine, "a slot must fill one cache line");
+
+    struct Retired {
+        uint64_t epoch_; // reads that started in this epoch or later cannot see model_
+        shared_ptr<const Model> model_;
+    };
+
+    // the model stays valid while the guard lives
+    struct Guard {
+        Slot* slot_;
+        const Model* model_;
+
+        Guard(Slot* slot, const Model* model)
+            : slot_(slot)
+            , model_(model)
+        {
+        }
+
+        Guard(Guard&& other)
+            : slot_(other.slot_)
+            , model_(other.model_)
+        {
+            other.slot_ = nullptr;
+        }
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+
+        ~Guard() {
+            if (slot_) {
+                slot_->epoch_.store(kIdle, memory_order_release);
+            }
+        }
+
+        explicit operator bool() const {
+            return model_ != nullptr;
+        }
+
+        const Model& operator*() const {
+            return *model_;
+        }
+
+        const Model* operator->() const {
+            return model_;
+        }
+    };
+
+    // one per scoring thread, registered once. Guards of one reader must not overlap
+    struct Reader {
+        ModelHandle& handle_;
+        Slot& slot_;
+
+        Reader(ModelHandle& handle)
+            : handle_(handle)
+            , slot_(handle.acquireSlot())
+        {
+        }
+
+        ~Reader() {
+            slot_.epoch_.store(kIdle, memory_order_release);
+            slot_.taken_.store(false, memory_order_release);
+        }
+
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+
+        // the announcement is ordered before the model load, so a writer that has not seen it yet
+        // swapped the model before this load and the read gets the new one
+        Guard lock() {
+            slot_.epoch_.store(handle_.epoch_.load());
+            return Guard(&slot_, handle_.current_.load());
+        }
+    };
+
+    atomic<const Model*> current_;
+    atomic<uint64_t> epoch_;
+    Slot slots_[kMaxReaders];
+    mutex writeMutex_;
+    shared_ptr<const Model> owner_; // keeps current_ alive
+    vector<Retired> retired_;
+
+    ModelHandle(shared_ptr<const Model> model = nullptr)
+        : current_(model.get())
+        , epoch_(kIdle + 1)
+        , owner_(move(model))
+    {
+        for (Slot& slot : slots_) {
+            slot.epoch_.store(kIdle);
+            slot.taken_.store(false);
+        }
+    }
+
+    // readers must be gone by now
+    ~ModelHandle() = default;
+
+    ModelHandle(const ModelHandle&) = delete;
+    ModelHandle& operator=(const ModelHandle&) = delete;
+
+    // new only guarantees 16 byte alignment before C++17 and the slots need whole cache lines. make_shared
+    // bypasses this, so before C++17 (or without -faligned-new) create handles with new or on the stack
+    static void* operator new(size_t size) {
+        void* result;
+        if (posix_memalign(&result, kCacheLine, size)) {
+            throw bad_alloc();
+        }
+        return result;
+    }
+
+    static void operator delete(void* p) {
+        free(p);
+    }
+
+    Slot& acquireSlot() {
+        for (Slot& slot : slots_) {
+            bool expected = false;
+            if (!slot.taken_.load(memory_order_relaxed) && slot.taken_.compare_exchange_strong(expected, true)) {
+                return slot;
+            }
+        }
+        throw std::runtime_error("too many model readers");
+    }
+
+    // the old model is released right away if no read is using it, otherwise by a later publish() or
+    // reclaim(). The caller's own references keep it alive as usual
+    void publish(shared_ptr<const Model> model) {
+        lock_guard<mutex> lock(writeMutex_);
+        current_.store(model.get());
+        uint64_t epoch = epoch_.fetch_add(1) + 1;
+        if (owner_) {
+            retired_.push_back(Retired{epoch, move(owner_)});
+        }
+        owner_ = move(model);
+        reclaimLocked();
+    }
+
+    // releases the retired models no read can still use, returns how many are left
+    size_t reclaim() {
+        lock_guard<mutex> lock(writeMutex_);
+        return reclaimLocked();
+    }
+
+    // waits until every read that started before the last publish() has finished
+    void drain() {
+        while (reclaim()) {
+            this_thread::yield();
+        }
+    }
+
+    size_t reclaimLocked() {
+        uint64_t oldest = numeric_limits<uint64_t>::max();
+        for (const Slot& slot : slots_) {
+            uint64_t epoch = slot.epoch_.load();
+            if (epoch != kIdle) {
+                oldest = min(oldest, epoch);
+            }
+        }
+        retired_.erase(remove_if(retired_.begin(), retired_.end(),
+                                 [oldest](const Retired& r) { return r.epoch_ <= oldest; }),
+                       retired_.end());
+        return retired_.size();
+    }
+};
@@ -0,0 +1,495 @@
+#pragma once
+
+#include "trainer.h"
+
+// binned training set on disk: header, per-feature bin edges, labels, then one uint8 column per feature.
+// Columns are contiguous so a histogram pass reads every column front to back exactly once
+struct BinnedDatasetHeader {
+    char magic_[8];
+    uint32_t version_;
+    uint32_t featureSize_;
+    uint64_t nRows_;
+    uint64_t nFeatures_;
+    uint64_t edgeCountsOffset_;
+    uint64_t edgesOffset_;
+    uint64_t labelsOffset_;
+    uint64_t columnsOffset_;
+};
+
+static const char kBinnedDatasetMagic[8] = {'R', 'F', 'B', 'I', 'N', 'S', 0, 0};
+static constexpr uint32_t kBinnedDatasetVersion = 1;
+static constexpr size_t kMaxEdges = Histogram::kBins - 1;
+
+inline uint64_t alignUp(uint64_t offset, uint64_t alignment) {
+    return (offset + alignment - 1)/alignment*alignment;
+}
+
+// edges from rows that fit in memory, typically a sample of the full training set
+template<typename FeatureType>
+vector<vector<FeatureType>> sampleEdges(const FeatureType* rows, size_t nRows, size_t nFeatures, size_t stride, size_t maxBins) {
+    vector<vector<FeatureType>> edges(nFeatures);
+    vector<FeatureType> column(nRows);
+    for (size_t j = 0; j < nFeatures; ++j) {
+        for (size_t i = 0; i < nRows; ++i) {
+            column[i] = rows[i*stride + j];
+        }
+        edges[j] = BinnedDataset<FeatureType>::quantileEdges(column, min(maxBins, Histogram::kBins));
+    }
+    return edges;
+}
+
+// the total row count is fixed up front, rows are then appended in batches of any size. The header goes
+// out in finish() once every row is there, a file left unfinished does not load as a dataset
+template<typename FeatureType>
+struct BinnedDatasetWriter {
+    int fd_;
+    BinnedDatasetHeader header_;
+    vector<vector<FeatureType>> edges_;
+    size_t written_;
+    vector<uint8_t> bins_;
+
+    BinnedDatasetWriter(const string& path, const vector<vector<FeatureType>>& edges, size_t nRows)
+        : fd_(-1)
+        , edges_(edges)
+        , written_(0)
+    {
+        memset(&header_, 0, sizeof(header_));
+        memcpy(header_.magic_, kBinnedDatasetMagic, sizeof(kBinnedDatasetMagic));
+        header_.version_ = kBinnedDatasetVersion;
+        header_.featureSize_ = sizeof(FeatureType);
+        header_.nRows_ = nRows;
+        header_.nFeatures_ = edges.size();
+        header_.edgeCountsOffset_ = alignUp(sizeof(header_), kFlatForestAlignment);
+        header_.edgesOffset_ = alignUp(header_.edgeCountsOffset_ + edges.size()*sizeof(uint32_t), kFlatForestAlignment);
+        header_.labelsOffset_ = alignUp(header_.edgesOffset_ + edges.size()*kMaxEdges*sizeof(FeatureType), kFlatForestAlignment);
+        header_.columnsOffset_ = alignUp(header_.labelsOffset_ + nRows*sizeof(FeatureType), kFlatForestAlignment);
+
+        vector<uint32_t> counts(edges.size());
+        vector<FeatureType> padded(edges.size()*kMaxEdges);
+        for (size_t j = 0; j < edges.size(); ++j) {
+            if (edges[j].size() > kMaxEdges) {
+                throw std::runtime_error("too many bin edges");
+            }
+            counts[j] = edges[j].size();
+            copy(edges[j].begin(), edges[j].end(), padded.begin() + j*kMaxEdges);
+        }
+
+        fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd_ < 0) {
+            throw std::runtime_error("cannot create " + path);
+        }
+        // the destructor does not run for a constructor that throws
+        try {
+            if (ftruncate(fd_, header_.columnsOffset_ + nRows*edges.size()) < 0) {
+                throw std::runtime_error("cannot size " + path);
+            }
+            write(&counts[0], counts.size()*sizeof(uint32_t), header_.edgeCountsOffset_);
+            write(&padded[0], padded.size()*sizeof(FeatureType), header_.edgesOffset_);
+        } catch (...) {
+            close(fd_);
+            throw;
+        }
+    }
+
+    ~BinnedDatasetWriter() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    void write(const void* data, size_t size, uint64_t offset) {
+        const char* bytes = reinterpret_cast<const char*>(data);
+        while (size) {
+            ssize_t n = pwrite(fd_, bytes, size, offset);
+            if (n <= 0) {
+                throw std::runtime_error("cannot write binned dataset");
+            }
+            bytes += n;
+            size -= n;
+            offset += n;
+        }
+    }
+
+    void append(const FeatureType* rows, const FeatureType* labels, size_t nRows, size_t stride) {
+        if (fd_ < 0) {
+            throw std::runtime_error("binned dataset is already finished");
+        }
+        if (written_ + nRows > header_.nRows_) {
+            throw std::runtime_error("more rows than the dataset was created for");
+        }
+        bins_.resize(nRows);
+        for (size_t j = 0; j < edges_.size(); ++j) {
+            const auto& edges = edges_[j];
+            for (size_t i = 0; i < nRows; ++i) {
+                bins_[i] = upper_bound(edges.begin(), edges.end(), rows[i*stride + j]) - edges.begin();
+            }
+            write(&bins_[0], nRows, header_.columnsOffset_ + j*header_.nRows_ + written_);
+        }
+        write(labels, nRows*sizeof(FeatureType), header_.labelsOffset_ + written_*sizeof(FeatureType));
+        written_ += nRows;
+    }
+
+    void finish() {
+        if (fd_ < 0) {
+            throw std::runtime_error("binned dataset is already finished");
+        }
+        if (written_ != header_.nRows_) {
+            throw std::runtime_error("binned dataset is missing rows");
+        }
+        write(&header_, sizeof(header_), 0);
+        int fd = fd_;
+        fd_ = -1;
+        if (close(fd) < 0) {
+            throw std::runtime_error("cannot write binned dataset");
+        }
+    }
+};
+
+template<typename FeatureType>
+struct MappedBinnedDataset {
+    shared_ptr<MappedFile> mapping_;
+    size_t nRows_;
+    size_t nFeatures_;
+    vector<vector<FeatureType>> edges_;
+    const FeatureType* labels_;
+    const uint8_t* columns_;
+
+    MappedBinnedDataset(const string& path)
+        : mapping_(make_shared<MappedFile>(path))
+    {
+        if (mapping_->size() < sizeof(BinnedDatasetHeader)) {
+            throw std::runtime_error("binned dataset is too small");
+        }
+        const BinnedDatasetHeader& header = *reinterpret_cast<const BinnedDatasetHeader*>(mapping_->data());
+        if (memcmp(header.magic_, kBinnedDatasetMagic, sizeof(kBinnedDatasetMagic)) || header.version_ != kBinnedDatasetVersion) {
+            throw std::runtime_error("not a binned dataset");
+        }
+        if (header.featureSize_ != sizeof(FeatureType)) {
+            throw std::runtime_error("binned dataset feature type does not match");
+        }
+        nRows_ = header.nRows_;
+        nFeatures_ = header.nFeatures_;
+        const uint32_t* counts = mapArray<uint32_t>(header.edgeCountsOffset_, nFeatures_);
+        const FeatureType* edges = mapArray<FeatureType>(header.edgesOffset_, nFeatures_, kMaxEdges);
+        labels_ = mapArray<FeatureType>(header.labelsOffset_, nRows_);
+        columns_ = mapArray<uint8_t>(header.columnsOffset_, nFeatures_, nRows_);
+        edges_.resize(nFeatures_);
+        for (size_t j = 0; j < nFeatures_; ++j) {
+            if (counts[j] > kMaxEdges) {
+                throw std::runtime_error("bad bin edge count");
+            }
+            edges_[j].assign(edges + j*kMaxEdges, edges + j*kMaxEdges + counts[j]);
+        }
+        madvise(const_cast<char*>(mapping_->data()), mapping_->size(), MADV_SEQUENTIAL);
+    }
+
+    // nArrays arrays of size items each, the offset and both extents come from the file
+    template<typename T>
+    const T* mapArray(uint64_t offset, uint64_t nArrays, uint64_t size = 1) const {
+        if (offset % kFlatForestAlignment || offset > mapping_->size()) {
+            throw std::runtime_error("binned dataset array out of bounds");
+        }
+        uint64_t available = (mapping_->size() - offset)/sizeof(T);
+        if (size && nArrays > available/size) {
+            throw std::runtime_error("binned dataset array out of bounds");
+        }
+        return reinterpret_cast<const T*>(mapping_->data() + offset);
+    }
+
+    const uint8_t* column(size_t iFeature) const {
+        return columns_ + iFeature*nRows_;
+    }
+};
+
+// grows every tree level by level over a MappedBinnedDataset. Per row only a uint32 node slot and a one
+// byte bootstrap weight stay in memory. The weight is Poisson distributed and hashed from (seed, tree,
+// row), so no sample of row indices is materialized. The nodes of a level get their histograms in batches
+// sized by histogramBudget_, each batch is one pass over the columns the tree tries, and a second pass
+// per level moves rows to their children. Features are sampled per tree (random subspaces) so a parent
+// and its children share histogram columns: only the smaller child is built, its sibling is the parent
+// minus it. Parents whose histograms do not fit the budget get both children built
+template<typename FeatureType>
+struct OutOfCoreTrainer {
+    using RandomForestF = RandomForest<FeatureType>;
+    static constexpr uint32_t kNoSlot = numeric_limits<uint32_t>::max();
+    static constexpr size_t kMaxWeight = 8;
+
+    const MappedBinnedDataset<FeatureType>& data_;
+    TrainerParams params_;
+
+    OutOfCoreTrainer(const MappedBinnedDataset<FeatureType>& data, const TrainerParams& params)
+        : data_(data)
+        , params_(params)
+    {
+    }
+
+    static uint64_t mix(uint64_t x) {
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30))*0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27))*0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    uint32_t weight(size_t iTree, size_t row) const {
+        double u = (mix(mix(params_.seed_ + iTree) ^ row) >> 11)*(1./(1ULL << 53));
+        double p = exp(-params_.sampleFraction_);
+        double cdf = p;
+        uint32_t k = 0;
+        while (u > cdf && k < kMaxWeight) {
+            ++k;
+            p *= params_.sampleFraction_/k;
+            cdf += p;
+        }
+        return k;
+    }
+
+    static void accumulate(double* bin, uint32_t weight, FeatureType label) {
+        _mm_storeu_pd(bin, _mm_add_pd(_mm_loadu_pd(bin), _mm_set_pd(weight, double(weight)*label)));
+    }
+
+    // node under construction, children index into the same vector
+    struct BuildNode {
+        int feature_ = -1;
+        size_t bin_ = 0;
+        size_t left_ = 0;
+        size_t right_ = 0;
+        double sum_ = 0.;
+        double count_ = 0.;
+    };
+
+    // build nodes keep their order, children always come after their parent
+    void addTree(const vector<BuildNode>& nodes, RandomForestF& forest) const {
+        size_t offset = forest.nodes_.size();
+        forest.roots_.push_back(offset);
+        for (const BuildNode& build: nodes) {
+            if (build.feature_ < 0) {
+                forest.addLeaf(build.count_ ? build.sum_/build.count_/params_.nTrees_ : 0.);
+            } else {
+                forest.addSplit(build.feature_, data_.edges_[build.feature_][build.bin_], offset + build.left_, offset + build.right_);
+            }
+        }
+    }
+
+    // node of the level being grown. A derived histogram still holds the parent's and becomes this
+    // node's once the sibling's is subtracted
+    struct OpenNode {
+        size_t node_;
+        size_t sibling_;
+        bool derived_;
+        vector<double> histogram_;
+    };
+
+    // best split over a node's histogram, children get their totals from the winning bin
+    bool split(const OpenNode& open, const vector<uint32_t>& treeFeatures, vector<BuildNode>& nodes) const {
+        BuildNode& node = nodes[open.node_];
+        double parentScore = node.sum_*node.sum_/node.count_;
+        double bestGain = 0.;
+        double bestSum = 0.;
+        double bestCount = 0.;
+        for (size_t t = 0; t < treeFeatures.size(); ++t) {
+            const double* histogram = &open.histogram_[2*t*Histogram::kBins];
+            size_t feature = treeFeatures[t];
+            double leftSum = 0.;
+            double leftCount = 0.;
+            for (size_t b = 0; b < data_.edges_[feature].size(); ++b) {
+                leftSum += histogram[2*b];
+                leftCount += histogram[2*b + 1];
+                double rightCount = node.count_ - leftCount;
+                if (leftCount < params_.minSamplesLeaf_ || rightCount < params_.minSamplesLeaf_) {
+                    continue;
+                }
+                double rightSum = node.sum_ - leftSum;
+                double gain = leftSum*leftSum/leftCount + rightSum*rightSum/rightCount - parentScore;
+                if (gain > bestGain) {
+                    bestGain = gain;
+                    bestSum = leftSum;
+                    bestCount = leftCount;
+                    node.feature_ = feature;
+                    node.bin_ = b;
+                }
+            }
+        }
+        if (node.feature_ < 0) {
+            return false;
+        }
+        node.left_ = nodes.size();
+        node.right_ = nodes.size() + 1;
+        nodes.resize(nodes.size() + 2);
+        BuildNode& left = nodes[nodes.size() - 2];
+        BuildNode& right = nodes[nodes.size() - 1];
+        left.sum_ = bestSum;
+        left.count_ = bestCount;
+        right.sum_ = nodes[open.node_].sum_ - bestSum;
+        right.count_ = nodes[open.node_].count_ - bestCount;
+        return true;
+    }
+
+    void buildTree(ThreadPool& pool, size_t iTree, vector<uint32_t>& slots, RandomForestF& forest) const {
+        const size_t nRows = data_.nRows_;
+        const size_t nFeatures = data_.nFeatures_;
+        const size_t nTry = min(nFeatures, max<size_t>(1, params_.featureFraction_*nFeatures));
+        const size_t kRowGrain = 1 << 16;
+        const size_t kNone = numeric_limits<size_t>::max();
+        mt19937 random(params_.seed_ + iTree);
+
+        vector<uint32_t> treeFeatures(nFeatures);
+        for (size_t j = 0; j < nFeatures; ++j) {
+            treeFeatures[j] = j;
+        }
+        for (size_t t = 0; t < nTry; ++t) {
+            swap(treeFeatures[t], treeFeatures[t + random() % (nFeatures - t)]);
+        }
+        treeFeatures.resize(nTry);
+
+        // {sum of labels, count} per bin and tried feature. Half the budget goes to the batch being
+        // built, a quarter to histograms kept for the next level, the rest covers those kept from the last
+        const size_t histogramSize = 2*nTry*Histogram::kBins;
+        const size_t histogramBytes = histogramSize*sizeof(double);
+        const size_t batchNodes = max<size_t>(1, params_.histogramBudget_/2/histogramBytes);
+        const size_t maxKept = params_.histogramBudget_/4/histogramBytes;
+
+        vector<uint8_t> rowWeights(nRows);
+        pool.parallelFor(nRows, kRowGrain, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                rowWeights[i] = weight(iTree, i);
+                slots[i] = rowWeights[i] ? 0 : kNoSlot;
+            }
+        });
+        // the root's totals, every other node gets them from its parent's split
+        double totals[2] = {0., 0.};
+        for (size_t i = 0; i < nRows; ++i) {
+            accumulate(totals, rowWeights[i], data_.labels_[i]);
+        }
+        vector<BuildNode> nodes(1);
+        nodes[0].sum_ = totals[0];
+        nodes[0].count_ = totals[1];
+
+        vector<OpenNode> level(1, OpenNode{0, kNone, false, vector<double>()});
+        for (size_t depth = 0; !level.empty(); ++depth) {
+            bool last = depth >= params_.maxDepth_;
+            vector<bool> splittable(level.size());
+            for (size_t s = 0; s < level.size(); ++s) {
+                OpenNode& open = level[s];
+                const BuildNode& node = nodes[open.node_];
+                splittable[s] = !last && node.count_ > 0 && node.count_ >= params_.minSamplesSplit_
+                    && node.count_ >= 2*params_.minSamplesLeaf_;
+                if (open.derived_ && !splittable[s]) {
+                    open.derived_ = false;
+                    vector<double>().swap(open.histogram_);
+                }
+            }
+            // a derived node's sibling is built whenever either of them splits
+            vector<size_t> toBuild;
+            for (size_t s = 0; s < level.size(); ++s) {
+                const OpenNode& open = level[s];
+                bool siblingDerived = kNone != open.sibling_ && level[open.sibling_].derived_;
+                if (!open.derived_ && (splittable[s] || siblingDerived)) {
+                    toBuild.push_back(s);
+                }
+            }
+
+            vector<OpenNode> next;
+            vector<uint32_t> leftSlots(level.size(), kNoSlot);
+            size_t kept = 0;
+            // a split node hands its histogram to its larger child while the budget allows
+            auto grow = [&](size_t s) {
+                OpenNode& open = level[s];
+                if (!split(open, treeFeatures, nodes)) {
+                    vector<double>().swap(open.histogram_);
+                    return;
+                }
+                const BuildNode& node = nodes[open.node_];
+                leftSlots[s] = next.size();
+                bool rightLarger = nodes[node.right_].count_ > nodes[node.left_].count_;
+                bool keep = kept < maxKept;
+                kept += keep;
+                next.push_back(OpenNode{node.left_, next.size() + 1, keep && !rightLarger, vector<double>()});
+                next.push_back(OpenNode{node.right_, next.size() - 1, keep && rightLarger, vector<double>()});
+                if (keep) {
+                    next[next.size() - (rightLarger ? 1 : 2)].histogram_.swap(open.histogram_);
+                }
+                vector<double>().swap(open.histogram_);
+            };
+
+            vector<int> batchSlot(level.size(), -1);
+            for (size_t first = 0; first < toBuild.size(); first += batchNodes) {
+                size_t end = min(toBuild.size(), first + batchNodes);
+                for (size_t k = first; k < end; ++k) {
+                    batchSlot[toBuild[k]] = k;
+                    level[toBuild[k]].histogram_.assign(histogramSize, 0.);
+                }
+                pool.parallelFor(nTry, 1, [&](size_t begin, size_t tEnd) {
+                    for (size_t t = begin; t < tEnd; ++t) {
+                        const uint8_t* column = data_.column(treeFeatures[t]);
+                        for (size_t i = 0; i < nRows; ++i) {
+                            uint32_t slot = slots[i];
+                            if (kNoSlot == slot || batchSlot[slot] < 0) {
+                                continue;
+                            }
+                            accumulate(&level[slot].histogram_[2*(t*Histogram::kBins + column[i])], rowWeights[i], data_.labels_[i]);
+                        }
+                    }
+                });
+                for (size_t k = first; k < end; ++k) {
+                    size_t s = toBuild[k];
+                    batchSlot[s] = -1;
+                    size_t sibling = level[s].sibling_;
+                    if (kNone != sibling && level[sibling].derived_) {
+                        vector<double>& derived = level[sibling].histogram_;
+                        const vector<double>& built = level[s].histogram_;
+                        for (size_t b = 0; b < histogramSize; ++b) {
+                            derived[b] -= built[b];
+                        }
+                        level[sibling].derived_ = false;
+                        grow(sibling);
+                    }
+                    if (splittable[s]) {
+                        grow(s);
+                    } else {
+                        vector<double>().swap(level[s].histogram_);
+                    }
+                }
+            }
+
+            // reads the split column of every row still in the tree, one stream per distinct split feature
+            vector<int> splitFeatures(level.size());
+            vector<size_t> splitBins(level.size());
+            for (size_t s = 0; s < level.size(); ++s) {
+                splitFeatures[s] = nodes[level[s].node_].feature_;
+                splitBins[s] = nodes[level[s].node_].bin_;
+            }
+            pool.parallelFor(nRows, kRowGrain, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i) {
+                    uint32_t slot = slots[i];
+                    if (kNoSlot == slot) {
+                        continue;
+                    }
+                    if (splitFeatures[slot] < 0) {
+                        slots[i] = kNoSlot;
+                    } else {
+                        bool left = data_.column(splitFeatures[slot])[i] <= splitBins[slot];
+                        slots[i] = leftSlots[slot] + (left ? 0 : 1);
+                    }
+                }
+            });
+            level.swap(next);
+        }
+        addTree(nodes, forest);
+    }
+
+    shared_ptr<RandomForestF> train(ThreadPool& pool) const {
+        if (data_.nRows_ >= kNoSlot) {
+            throw std::runtime_error("too many rows");
+        }
+        if (!data_.nRows_ || !data_.nFeatures_) {
+            throw std::runtime_error("empty training set");
+        }
+        auto forest = make_shared<RandomForestF>();
+        vector<uint32_t> slots(data_.nRows_);
+        for (size_t iTree = 0; iTree < params_.nTrees_; ++iTree) {
+            buildTree(pool, iTree, slots, *forest);
+        }
+        forest->reindex();
+        return forest;
+    }
+};
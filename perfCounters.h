@@ -0,0 +1,179 @@
+#pragma once
+
+#include "randomForest.h"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+enum class PerfEvent {
+    Cycles,
+    Instructions,
+    L1dMisses,
+    LlcMisses,
+    DtlbMisses,
+    BranchMisses,
+};
+
+static constexpr size_t kPerfEvents = 6;
+
+static const char* const kPerfEventNames[kPerfEvents] = {
+    "cycles", "instructions", "l1d_misses", "llc_misses", "dtlb_misses", "branch_misses",
+};
+
+// counts of one measured region, an event the kernel or the CPU does not provide stays invalid
+struct PerfSample {
+    double values_[kPerfEvents] = {};
+    bool valid_[kPerfEvents] = {};
+
+    bool valid(PerfEvent event) const {
+        return valid_[static_cast<size_t>(event)];
+    }
+
+    double value(PerfEvent event) const {
+        return values_[static_cast<size_t>(event)];
+    }
+
+    double per(PerfEvent event, double units) const {
+        return valid(event) && units ? value(event)/units : numeric_limits<double>::quiet_NaN();
+    }
+};
+
+// user space hardware counters of the calling thread through perf_event_open. Events are opened one by
+// one rather than as a group so a missing event does not disable the others; when the PMU multiplexes
+// them, counts are scaled by enabled/running time
+struct PerfCounters {
+    int fds_[kPerfEvents];
+
+    PerfCounters() {
+        for (size_t e = 0; e < kPerfEvents; ++e) {
+            fds_[e] = openEvent(static_cast<PerfEvent>(e));
+        }
+    }
+
+    ~PerfCounters() {
+        for (int fd : fds_) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    static uint64_t cacheMiss(uint64_t cache) {
+        return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    }
+
+    static int openEvent(PerfEvent event) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        switch (event) {
+        case PerfEvent::Cycles:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case PerfEvent::Instructions:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case PerfEvent::L1dMisses:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = cacheMiss(PERF_COUNT_HW_CACHE_L1D);
+            break;
+        case PerfEvent::LlcMisses:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = cacheMiss(PERF_COUNT_HW_CACHE_LL);
+            break;
+        case PerfEvent::DtlbMisses:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = cacheMiss(PERF_COUNT_HW_CACHE_DTLB);
+            break;
+        case PerfEvent::BranchMisses:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+            break;
+        }
+        return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    bool available() const {
+        for (int fd : fds_) {
+            if (fd >= 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void start() {
+        for (int fd : fds_) {
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    PerfSample stop() {
+        for (int fd : fds_) {
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            }
+        }
+        PerfSample sample;
+        for (size_t e = 0; e < kPerfEvents; ++e) {
+            uint64_t data[3]; // value, time enabled, time running
+            if (fds_[e] < 0 || read(fds_[e], data, sizeof(data)) != sizeof(data) || !data[2]) {
+                continue;
+            }
+            sample.values_[e] = static_cast<double>(data[0])*data[1]/data[2];
+            sample.valid_[e] = true;
+        }
+        return sample;
+    }
+};
+
+// "name per-row/per-step" for every event, n/a for the ones that could not be counted
+inline void writePerfSample(const PerfSample& sample, size_t nRows, size_t nTrees, ostream& out) {
+    for (size_t e = 0; e < kPerfEvents; ++e) {
+        PerfEvent event = static_cast<PerfEvent>(e);
+        out << " " << kPerfEventNames[e] << " ";
+        if (sample.valid(event)) {
+            out << sample.per(event, nRows) << "/" << sample.per(event, double(nRows)*nTrees);
+        } else {
+            out << "n/a";
+        }
+    }
+}
+
+// like ScopedTimer, prints the counters of a region normalized per row and per tree-step
+// (one row through one tree)
+struct ScopedPerfCounters {
+    ScopedPerfCounters(PerfCounters& counters, const string& message, size_t nRows, size_t nTrees)
+        : counters_(counters)
+        , message_(message)
+        , nRows_(nRows)
+        , nTrees_(nTrees)
+    {
+        counters_.start();
+    }
+
+    ~ScopedPerfCounters() {
+        PerfSample sample = counters_.stop();
+        cout << message_;
+        writePerfSample(sample, nRows_, nTrees_, cout);
+        cout << endl;
+    }
+
+    PerfCounters& counters_;
+    string message_;
+    size_t nRows_;
+    size_t nTrees_;
+};
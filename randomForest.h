@@ -0,0 +1,3598 @@
+#pragma once
+
+#include <stdlib.h>
+
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <queue>
+#include <limits>
+#include <stdexcept>
+#include <exception>
+#include <fstream>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "x86intrin.h"
+
+using namespace std;
+
+struct ThreadPool {
+    using Task = function<void()>;
+
+    struct Queue {
+        mutex lock_;
+        deque<Task> tasks_;
+    };
+
+    ThreadPool(size_t nThreads = 0)
+        : queues_(nThreads ? nThreads : max<size_t>(1, thread::hardware_concurrency()))
+        , pending_(0)
+        , stop_(false)
+        , next_(0)
+    {
+        for (size_t i = 0; i < queues_.size(); ++i) {
+            workers_.emplace_back([this, i]() { work(i); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> guard(sleepLock_);
+            stop_ = true;
+        }
+        wakeUp_.notify_all();
+        for (auto& worker: workers_) {
+            worker.join();
+        }
+    }
+
+    size_t size() const {
+        return queues_.size();
+    }
+
+    void push(Task task) {
+        size_t iQueue = next_++ % queues_.size();
+        // counted before it is visible, so a worker that pops it right away cannot take pending_ below zero
+        {
+            lock_guard<mutex> guard(sleepLock_);
+            ++pending_;
+        }
+        {
+            lock_guard<mutex> guard(queues_[iQueue].lock_);
+            queues_[iQueue].tasks_.emplace_back(std::move(task));
+        }
+        wakeUp_.notify_one();
+    }
+
+    // pops from the back of its own queue, steals from the front of the others
+    bool runOne(size_t iQueue) {
+        Task task;
+        for (size_t i = 0; i < queues_.size(); ++i) {
+            Queue& queue = queues_[(iQueue + i) % queues_.size()];
+            lock_guard<mutex> guard(queue.lock_);
+            if (!queue.tasks_.empty()) {
+                if (0 == i) {
+                    task = std::move(queue.tasks_.back());
+                    queue.tasks_.pop_back();
+                } else {
+                    task = std::move(queue.tasks_.front());
+                    queue.tasks_.pop_front();
+                }
+                break;
+            }
+        }
+        if (!task) {
+            return false;
+        }
+        {
+            lock_guard<mutex> guard(sleepLock_);
+            --pending_;
+        }
+        task();
+        return true;
+    }
+
+    // splits [0, n) into chunks of at least grain items, the calling thread helps until all are done.
+    // The first exception a chunk throws is rethrown here once every chunk has finished
+    void parallelFor(size_t n, size_t grain, const function<void(size_t, size_t)>& f) {
+        if (!n) {
+            return;
+        }
+        grain = max<size_t>(grain, 1);
+        size_t nChunks = min((n + grain - 1)/grain, 4*size());
+        size_t chunk = (n + nChunks - 1)/nChunks;
+        chunk = (chunk + grain - 1)/grain*grain;
+        nChunks = (n + chunk - 1)/chunk;
+
+        // the completion state lives on this stack, so workers only touch it under doneLock and this
+        // call returns after taking doneLock itself, once the last worker has let go of it
+        size_t remaining = nChunks;
+        exception_ptr error;
+        mutex doneLock;
+        condition_variable done;
+        for (size_t iChunk = 0; iChunk < nChunks; ++iChunk) {
+            size_t begin = iChunk*chunk;
+            size_t end = min(n, begin + chunk);
+            push([&, begin, end]() {
+                exception_ptr chunkError;
+                try {
+                    f(begin, end);
+                } catch (...) {
+                    chunkError = current_exception();
+                }
+                lock_guard<mutex> guard(doneLock);
+                if (chunkError && !error) {
+                    error = chunkError;
+                }
+                if (0 == --remaining) {
+                    done.notify_all();
+                }
+            });
+        }
+
+        size_t iQueue = 0;
+        while (runOne(iQueue++ % size())) {
+        }
+        unique_lock<mutex> guard(doneLock);
+        done.wait(guard, [&]() { return 0 == remaining; });
+        if (error) {
+            rethrow_exception(error);
+        }
+    }
+
+private:
+    void work(size_t iQueue) {
+        while (true) {
+            if (runOne(iQueue)) {
+                continue;
+            }
+            unique_lock<mutex> guard(sleepLock_);
+            wakeUp_.wait(guard, [this]() { return stop_ || pending_ > 0; });
+            if (stop_) {
+                return;
+            }
+        }
+    }
+
+    vector<Queue> queues_;
+    vector<thread> workers_;
+    mutex sleepLock_;
+    condition_variable wakeUp_;
+    size_t pending_;
+    bool stop_;
+    atomic<size_t> next_;
+};
+
+// all nodes of all trees live in one arena and children are arena indices, so a forest is a couple of
+// allocations instead of one per node. Builders may append nodes in any order; reindex() then compacts the
+// arena so every tree is contiguous and in pre-order (left child right after its parent, the next tree
+// starts where the previous one ends), which is what the flat layouts are built from
+template<typename FeatureType>
+struct RandomForest {
+    using Features = vector<FeatureType>;
+    using NodeIndex = uint32_t;
+
+    struct Node {
+        bool isLeaf_;
+
+        FeatureType leafValue_;
+
+        int featureIndex_;
+        FeatureType featureValue_;
+        bool missingLeft_; // where a NaN feature goes, x < featureValue_ decides everything else
+        NodeIndex left_;
+        NodeIndex right_;
+        NodeIndex firstOutput_; // leaves of a multi-output forest, their values start at outputs_[firstOutput_]
+    };
+
+    vector<Node> nodes_;
+    vector<NodeIndex> roots_;
+    // with more than one output every leaf holds nOutputs_ contiguous values (one per class, say) and
+    // leafValue_ repeats the first, so the scalar evaluators score output 0
+    size_t nOutputs_ = 1;
+    vector<FeatureType> outputs_;
+
+    size_t nTrees() const {
+        return roots_.size();
+    }
+
+    NodeIndex addLeaf(FeatureType leafValue) {
+        Node node;
+        node.isLeaf_ = true;
+        node.leafValue_ = leafValue;
+        node.featureIndex_ = 0;
+        node.featureValue_ = 0;
+        node.missingLeft_ = false;
+        node.left_ = 0;
+        node.right_ = 0;
+        node.firstOutput_ = 0;
+        return addNode(node);
+    }
+
+    // nOutputs_ values
+    NodeIndex addLeaf(const FeatureType* values) {
+        if (nOutputs_ == 1) {
+            return addLeaf(values[0]);
+        }
+        if (outputs_.size() + nOutputs_ >= numeric_limits<NodeIndex>::max()) {
+            throw std::runtime_error("too many outputs");
+        }
+        NodeIndex leaf = addLeaf(values[0]);
+        nodes_[leaf].firstOutput_ = outputs_.size();
+        outputs_.insert(outputs_.end(), values, values + nOutputs_);
+        return leaf;
+    }
+
+    // children can be set later, builders that pick the split before growing the subtrees need that
+    NodeIndex addSplit(int featureIndex, FeatureType featureValue, NodeIndex left = 0, NodeIndex right = 0,
+                       bool missingLeft = false) {
+        if (featureIndex < 0) {
+            throw std::runtime_error("bad feature index");
+        }
+        Node node;
+        node.isLeaf_ = false;
+        node.leafValue_ = 0;
+        node.featureIndex_ = featureIndex;
+        node.featureValue_ = featureValue;
+        node.missingLeft_ = missingLeft;
+        node.left_ = left;
+        node.right_ = right;
+        node.firstOutput_ = 0;
+        return addNode(node);
+    }
+
+    NodeIndex addNode(const Node& node) {
+        if (nodes_.size() >= numeric_limits<NodeIndex>::max()) {
+            throw std::runtime_error("too many nodes");
+        }
+        nodes_.push_back(node);
+        return nodes_.size() - 1;
+    }
+
+    // trees of other are added after the existing ones
+    void append(const RandomForest& other) {
+        if (nodes_.empty()) {
+            nOutputs_ = other.nOutputs_;
+        }
+        if (nOutputs_ != other.nOutputs_) {
+            throw std::runtime_error("forests have different output counts");
+        }
+        size_t offset = nodes_.size();
+        size_t outputOffset = outputs_.size();
+        if (offset + other.nodes_.size() >= numeric_limits<NodeIndex>::max()
+            || outputOffset + other.outputs_.size() >= numeric_limits<NodeIndex>::max()) {
+            throw std::runtime_error("too many nodes");
+        }
+        nodes_.insert(nodes_.end(), other.nodes_.begin(), other.nodes_.end());
+        outputs_.insert(outputs_.end(), other.outputs_.begin(), other.outputs_.end());
+        for (size_t i = offset; i < nodes_.size(); ++i) {
+            if (!nodes_[i].isLeaf_) {
+                nodes_[i].left_ += offset;
+                nodes_[i].right_ += offset;
+            } else if (nOutputs_ > 1) {
+                nodes_[i].firstOutput_ += outputOffset;
+            }
+        }
+        for (NodeIndex root: other.roots_) {
+            roots_.push_back(root + offset);
+        }
+    }
+
+    static bool goesLeft(const Node& node, FeatureType x) {
+        return x < node.featureValue_ || (x != x && node.missingLeft_);
+    }
+
+    // layouts that only know x < featureValue_ send every NaN right and refuse such models
+    bool hasMissingLeft() const {
+        for (const Node& node: nodes_) {
+            if (!node.isLeaf_ && node.missingLeft_) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    FeatureType eval(const Features& features) const {
+        FeatureType result = 0.f;
+        for (NodeIndex root: roots_) {
+            const Node* node = &nodes_[root];
+            while (!node->isLeaf_) {
+                node = &nodes_[goesLeft(*node, features[node->featureIndex_]) ? node->left_ : node->right_];
+            }
+            result += node->leafValue_;
+        }
+        return result;
+    }
+
+    // all nOutputs_ outputs from one walk
+    void eval(const Features& features, FeatureType* out) const {
+        if (nOutputs_ == 1) {
+            out[0] = eval(features);
+            return;
+        }
+        fill_n(out, nOutputs_, FeatureType(0));
+        for (NodeIndex root: roots_) {
+            const Node* node = &nodes_[root];
+            while (!node->isLeaf_) {
+                node = &nodes_[goesLeft(*node, features[node->featureIndex_]) ? node->left_ : node->right_];
+            }
+            const FeatureType* values = &outputs_[node->firstOutput_];
+            for (size_t j = 0; j < nOutputs_; ++j) {
+                out[j] += values[j];
+            }
+        }
+    }
+
+    size_t size() const {
+        size_t size = 0;
+        vector<NodeIndex> stack;
+        for (NodeIndex root: roots_) {
+            stack.push_back(root);
+            while (!stack.empty()) {
+                const Node& node = nodes_[stack.back()];
+                stack.pop_back();
+                ++size;
+                if (!node.isLeaf_) {
+                    stack.push_back(node.right_);
+                    stack.push_back(node.left_);
+                }
+            }
+        }
+        return size;
+    }
+
+    // first node after tree iTree, only meaningful once the forest is reindexed
+    NodeIndex treeEnd(size_t iTree) const {
+        return (iTree + 1 < roots_.size()) ? roots_[iTree + 1] : nodes_.size();
+    }
+
+    bool isPreorder() const {
+        if (roots_.empty()) {
+            return nodes_.empty();
+        }
+        if (roots_[0] != 0) {
+            return false;
+        }
+        for (size_t iTree = 0; iTree < roots_.size(); ++iTree) {
+            NodeIndex end = treeEnd(iTree);
+            if (roots_[iTree] >= end) {
+                return false;
+            }
+            for (NodeIndex i = roots_[iTree]; i < end; ++i) {
+                const Node& node = nodes_[i];
+                if (!node.isLeaf_ && (node.left_ != i + 1 || node.right_ <= node.left_ || node.right_ >= end)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // copies the reachable nodes into a fresh arena in pre-order, unreachable ones are dropped. A node
+    // reached twice (shared or cyclic children) would outgrow the arena and is rejected
+    void reindex() {
+        struct Pending {
+            NodeIndex node_;
+            NodeIndex parent_;
+            bool isLeft_;
+        };
+        static constexpr NodeIndex kNoParent = numeric_limits<NodeIndex>::max();
+
+        vector<Node> nodes;
+        nodes.reserve(nodes_.size());
+        vector<FeatureType> outputs;
+        vector<NodeIndex> roots(roots_.size());
+        vector<Pending> stack;
+        for (size_t iTree = 0; iTree < roots_.size(); ++iTree) {
+            roots[iTree] = nodes.size();
+            stack.push_back(Pending{roots_[iTree], kNoParent, false});
+            while (!stack.empty()) {
+                Pending pending = stack.back();
+                stack.pop_back();
+                if (pending.node_ >= nodes_.size() || nodes.size() == nodes_.size()) {
+                    throw std::runtime_error("tree invariant failed");
+                }
+                NodeIndex index = nodes.size();
+                nodes.push_back(nodes_[pending.node_]);
+                if (kNoParent != pending.parent_) {
+                    (pending.isLeft_ ? nodes[pending.parent_].left_ : nodes[pending.parent_].right_) = index;
+                }
+                const Node& node = nodes_[pending.node_];
+                if (!node.isLeaf_) {
+                    stack.push_back(Pending{node.right_, index, false});
+                    stack.push_back(Pending{node.left_, index, true});
+                } else if (nOutputs_ > 1) {
+                    if (outputs_.size() < nOutputs_ || node.firstOutput_ > outputs_.size() - nOutputs_) {
+                        throw std::runtime_error("tree invariant failed");
+                    }
+                    nodes.back().firstOutput_ = outputs.size();
+                    outputs.insert(outputs.end(), &outputs_[node.firstOutput_], &outputs_[node.firstOutput_] + nOutputs_);
+                }
+            }
+        }
+        nodes_.swap(nodes);
+        roots_.swap(roots);
+        outputs_.swap(outputs);
+    }
+};
+
+union FloatVector {
+    using AVXType = __m256;
+    static const size_t kSize = 8;
+    AVXType data_;
+    float floatData_[8];
+} __attribute__((aligned(32), packed));
+
+union DoubleVector {
+    using AVXType = __m256d;
+    static const size_t kSize = 4;
+    __m256d data_;
+    double floatData_[4];
+} __attribute__((aligned(32), packed));
+
+union IVector8 {
+    using AVXType = __m256i;
+    static const size_t kSize = 8;
+    __m256i data_;
+    int intData_[8];
+} __attribute__((aligned(32), packed));
+
+union IVector4 {
+    using AVXType = __m128i;
+    static const size_t kSize = 4;
+    __m128i data_;
+    int intData_[4];
+} __attribute__((aligned(16), packed));
+
+template<typename T>
+T InitVector(int value);
+
+template<>
+inline __m128i InitVector<__m128i>(int value) {
+    return _mm_set1_epi32(value);
+}
+
+template<>
+inline __m256i InitVector<__m256i>(int value) {
+    return _mm256_set1_epi32(value);
+}
+
+template<typename T>
+struct AVXTraits;
+
+template<>
+struct AVXTraits<float> {
+    using IVectorType = IVector8;
+    using FloatVectorType = FloatVector;
+    static constexpr size_t kSize = 8;
+};
+
+template<>
+struct AVXTraits<double> {
+    using IVectorType = IVector4;
+    using FloatVectorType = DoubleVector;
+    static constexpr size_t kSize = 4;
+};
+
+// read-only mapping of a whole file, unmapped when the last owner goes away
+struct MappedFile {
+    void* data_;
+    size_t size_;
+
+    MappedFile(const string& path)
+        : data_(nullptr)
+        , size_(0)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("cannot open " + path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            close(fd);
+            throw std::runtime_error("cannot stat " + path);
+        }
+        size_ = st.st_size;
+        if (size_) {
+            data_ = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (MAP_FAILED == data_) {
+            throw std::runtime_error("cannot map " + path);
+        }
+    }
+
+    ~MappedFile() {
+        if (data_) {
+            munmap(data_, size_);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const {
+        return reinterpret_cast<const char*>(data_);
+    }
+
+    size_t size() const {
+        return size_;
+    }
+};
+
+// either owns its elements or views memory that belongs to someone else, e.g. a mapped model
+template<typename T>
+struct Array {
+    vector<T> storage_;
+    T* data_;
+    size_t size_;
+
+    Array()
+        : data_(nullptr)
+        , size_(0)
+    {
+    }
+
+    Array(const Array& other)
+        : storage_(other.storage_)
+        , data_(other.owns() ? storage_.data() : other.data_)
+        , size_(other.size_)
+    {
+    }
+
+    Array& operator=(const Array& other) {
+        if (this != &other) {
+            storage_ = other.storage_;
+            data_ = other.owns() ? storage_.data() : other.data_;
+            size_ = other.size_;
+        }
+        return *this;
+    }
+
+    bool owns() const {
+        return data_ == storage_.data();
+    }
+
+    void resize(size_t size) {
+        if (!owns()) {
+            storage_.assign(data_, data_ + min(size, size_));
+        }
+        storage_.resize(size);
+        data_ = storage_.data();
+        size_ = size;
+    }
+
+    void view(const T* data, size_t size) {
+        storage_.clear();
+        storage_.shrink_to_fit();
+        data_ = const_cast<T*>(data);
+        size_ = size;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    T* data() {
+        return data_;
+    }
+
+    const T* data() const {
+        return data_;
+    }
+
+    T& operator[](size_t i) {
+        return data_[i];
+    }
+
+    const T& operator[](size_t i) const {
+        return data_[i];
+    }
+};
+
+// on-disk FlatForest: this header followed by the node arrays, each starting at a kFlatForestAlignment
+// boundary. Native byte order, byteOrder_ catches files written on a machine with the other one
+struct FlatForestHeader {
+    static constexpr uint32_t kByteOrder = 0x01020304;
+
+    char magic_[8];
+    uint32_t version_;
+    uint32_t byteOrder_;
+    uint32_t featureSize_;
+    uint32_t nOutputs_; // 0 before version 3, meaning 1
+    uint64_t nNodes_;
+    uint64_t nTrees_;
+    int64_t iTerminator_;
+    uint64_t featureIndexOffset_;
+    uint64_t featureValueOffset_;
+    uint64_t leftIndexOffset_;
+    uint64_t rightIndexOffset_;
+    uint64_t nodeValueOffset_;
+    uint64_t treeRootsOffset_;
+    // version 3 on, only for more than one output
+    uint64_t outputIndexOffset_;
+    uint64_t outputsOffset_;
+    uint64_t nOutputValues_;
+};
+
+static const char kFlatForestMagic[8] = {'R', 'F', 'F', 'L', 'A', 'T', 0, 0};
+// version 2 added the missing-left bit of featureIndex_, version 1 files never set it and read the same.
+// Version 3 added multi-output leaves
+static constexpr uint32_t kFlatForestVersion = 3;
+static constexpr uint32_t kFlatForestMinVersion = 1;
+static constexpr size_t kFlatForestAlignment = 64;
+
+// visit count per FlatForest node, indexed like the model it was recorded on. Saved next to the model
+// (see profilePath) so a re-layout can be redone without replaying traffic
+struct NodeProfileHeader {
+    char magic_[8];
+    uint32_t version_;
+    uint32_t reserved_;
+    uint64_t nNodes_;
+};
+
+static const char kNodeProfileMagic[8] = {'R', 'F', 'P', 'R', 'O', 'F', 0, 0};
+static constexpr uint32_t kNodeProfileVersion = 1;
+
+struct NodeProfile {
+    vector<uint64_t> visits_;
+
+    static string profilePath(const string& modelPath) {
+        return modelPath + ".profile";
+    }
+
+    void save(const string& path) const {
+        ofstream out(path.c_str(), ios::binary | ios::trunc);
+        NodeProfileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic_, kNodeProfileMagic, sizeof(kNodeProfileMagic));
+        header.version_ = kNodeProfileVersion;
+        header.nNodes_ = visits_.size();
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(visits_.data()), visits_.size()*sizeof(uint64_t));
+        if (!out) {
+            throw std::runtime_error("cannot write " + path);
+        }
+    }
+
+    static NodeProfile load(const string& path) {
+        ifstream in(path.c_str(), ios::binary);
+        NodeProfileHeader header;
+        if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))
+            || memcmp(header.magic_, kNodeProfileMagic, sizeof(kNodeProfileMagic))
+            || header.version_ != kNodeProfileVersion) {
+            throw std::runtime_error("not a node profile " + path);
+        }
+        if (header.nNodes_ > static_cast<uint64_t>(numeric_limits<int>::max())) {
+            throw std::runtime_error("bad node profile size");
+        }
+        NodeProfile profile;
+        profile.visits_.resize(header.nNodes_);
+        if (!in.read(reinterpret_cast<char*>(profile.visits_.data()), header.nNodes_*sizeof(uint64_t))) {
+            throw std::runtime_error("node profile is truncated");
+        }
+        return profile;
+    }
+};
+
+// compressed sparse rows: row i has values_[k] at column indices_[k] for offsets_[i] <= k < offsets_[i + 1],
+// columns that are not listed are 0
+template<typename FeatureType>
+struct CsrRows {
+    const size_t* offsets_; // nRows_ + 1 entries
+    const int* indices_;
+    const FeatureType* values_;
+    size_t nRows_;
+};
+
+template<typename FeatureType>
+struct FlatForest {
+    using RandomForestF = RandomForest<FeatureType>;
+    using Traits = AVXTraits<FeatureType>;
+    using IVectorType = typename Traits::IVectorType;
+    using FloatVectorType = typename Traits::FloatVectorType;
+    static constexpr size_t kSize = Traits::kSize;
+
+    // featureIndex_ holds the column in its low 31 bits and sets the top bit when a NaN feature goes
+    // left, so the kernels get the missing direction from the gather they already do
+    static constexpr int kMissingLeft = numeric_limits<int>::min();
+    static constexpr int kColumnMask = numeric_limits<int>::max();
+
+    int iTerminator_;
+    IVectorType terminator_; // should be the first field
+    Array<int> featureIndex_;
+    Array<FeatureType> featureValue_;
+    Array<int> leftIndex_;
+    Array<int> rightIndex_;
+    Array<FeatureType> nodeValue_;
+    Array<int> treeRoots_; // one past the last tree is the terminator
+    // multi-output models: node i adds outputs_[outputIndex_[i]] and the nOutputs_ - 1 values after it.
+    // outputs_ starts with a block of zeros for internal nodes, the terminator and retired roots;
+    // nodeValue_ keeps output 0 so the single-output kernels score that
+    size_t nOutputs_ = 1;
+    Array<int> outputIndex_;
+    Array<FeatureType> outputs_;
+    shared_ptr<MappedFile> mapping_; // set when the arrays view a mapped model file
+    size_t retiredNodes_ = 0; // nodes of retired trees still in the arrays, see retire()
+
+    FlatForest(const RandomForestF& f) {
+        if (!f.isPreorder()) {
+            throw std::runtime_error("tree is not in pre-order");
+        }
+        iTerminator_ = f.nodes_.size();
+        size_t size = iTerminator_ + 1;
+        treeRoots_.resize(f.nTrees() + 1);
+        for (size_t i = 0; i < f.nTrees(); ++i) {
+            treeRoots_[i] = f.roots_[i];
+        }
+        treeRoots_[f.nTrees()] = iTerminator_;
+        nOutputs_ = f.nOutputs_;
+        if (nOutputs_ > 1) {
+            outputs_.resize(nOutputs_ + f.outputs_.size());
+            copy(f.outputs_.begin(), f.outputs_.end(), &outputs_[nOutputs_]);
+        }
+        resizeNodes(size);
+
+        fill(f, 0, nOutputs_);
+
+        size_t address = reinterpret_cast<size_t>(&(terminator_.data_));
+        if (address % 16) {
+            cout << "address: " << (address % 16) << " " << sizeof(terminator_.data_) << endl;
+            throw std::runtime_error("bad alignment");
+        }
+        setTerminator(iTerminator_);
+    }
+
+    // zero-copy view of a file written by save(), nothing is parsed or copied
+    FlatForest(shared_ptr<MappedFile> mapping)
+        : mapping_(mapping)
+    {
+        const char* data = mapping->data();
+        if (mapping->size() < sizeof(FlatForestHeader)) {
+            throw std::runtime_error("model file is too small");
+        }
+        const FlatForestHeader& header = *reinterpret_cast<const FlatForestHeader*>(data);
+        if (memcmp(header.magic_, kFlatForestMagic, sizeof(kFlatForestMagic))) {
+            throw std::runtime_error("not a flat forest model");
+        }
+        if (header.version_ < kFlatForestMinVersion || header.version_ > kFlatForestVersion) {
+            throw std::runtime_error("unsupported model version");
+        }
+        if (header.byteOrder_ != FlatForestHeader::kByteOrder) {
+            throw std::runtime_error("model byte order does not match");
+        }
+        if (header.featureSize_ != sizeof(FeatureType)) {
+            throw std::runtime_error("model feature type does not match");
+        }
+        if (header.nNodes_ == 0 || header.nNodes_ > static_cast<uint64_t>(numeric_limits<int>::max())
+            || header.iTerminator_ != static_cast<int64_t>(header.nNodes_ - 1)) {
+            throw std::runtime_error("bad model node count");
+        }
+        iTerminator_ = header.iTerminator_;
+        nOutputs_ = (header.version_ >= 3) ? max<uint32_t>(1, header.nOutputs_) : 1;
+        if (nOutputs_ > 1) {
+            if (header.nOutputValues_ < nOutputs_ || header.nOutputValues_ > static_cast<uint64_t>(numeric_limits<int>::max())) {
+                throw std::runtime_error("bad model output count");
+            }
+            mapArray(outputIndex_, header.outputIndexOffset_, header.nNodes_);
+            mapArray(outputs_, header.outputsOffset_, header.nOutputValues_);
+        }
+        mapArray(featureIndex_, header.featureIndexOffset_, header.nNodes_);
+        mapArray(featureValue_, header.featureValueOffset_, header.nNodes_);
+        mapArray(leftIndex_, header.leftIndexOffset_, header.nNodes_);
+        mapArray(rightIndex_, header.rightIndexOffset_, header.nNodes_);
+        mapArray(nodeValue_, header.nodeValueOffset_, header.nNodes_);
+        mapArray(treeRoots_, header.treeRootsOffset_, header.nTrees_ + 1);
+        terminator_.data_ = InitVector<typename IVectorType::AVXType>(iTerminator_);
+        verify();
+    }
+
+    // the kernels trust every index they gather, so a mapped file is checked once, O(nNodes): children
+    // come after their parent and stay within the nodes, which also rules out cycles, the terminator
+    // loops onto itself, leaves read column 0 and every output block lies inside outputs_
+    void verify() const {
+        int nNodes = featureIndex_.size();
+        for (int i = 0; i < iTerminator_; ++i) {
+            if (leftIndex_[i] <= i || leftIndex_[i] > iTerminator_ || rightIndex_[i] <= i || rightIndex_[i] > iTerminator_) {
+                throw std::runtime_error("corrupt model: child index out of range");
+            }
+            if (isLeaf(i) && featureIndex_[i]) {
+                throw std::runtime_error("corrupt model: leaf tests a feature");
+            }
+        }
+        if (iTerminator_ != nNodes - 1 || leftIndex_[iTerminator_] != iTerminator_ || rightIndex_[iTerminator_] != iTerminator_
+            || featureIndex_[iTerminator_]) {
+            throw std::runtime_error("corrupt model: bad terminator");
+        }
+        for (size_t t = 0; t < treeRoots_.size(); ++t) {
+            if (treeRoots_[t] < (t ? treeRoots_[t - 1] : 0) || treeRoots_[t] > iTerminator_) {
+                throw std::runtime_error("corrupt model: tree root out of range");
+            }
+        }
+        if (!treeRoots_.size() || treeRoots_[treeRoots_.size() - 1] != iTerminator_) {
+            throw std::runtime_error("corrupt model: trees do not end at the terminator");
+        }
+        if (nOutputs_ > 1) {
+            for (int i = 0; i < nNodes; ++i) {
+                if (outputIndex_[i] < 0 || static_cast<size_t>(outputIndex_[i]) > outputs_.size() - nOutputs_) {
+                    throw std::runtime_error("corrupt model: output index out of range");
+                }
+            }
+        }
+    }
+
+    template<typename T>
+    void mapArray(Array<T>& array, uint64_t offset, uint64_t size) {
+        if (offset % kFlatForestAlignment || offset > mapping_->size() || size > (mapping_->size() - offset)/sizeof(T)) {
+            throw std::runtime_error("model array out of bounds");
+        }
+        array.view(reinterpret_cast<const T*>(mapping_->data() + offset), size);
+    }
+
+    static shared_ptr<FlatForest> load(const string& path) {
+        return shared_ptr<FlatForest>(new FlatForest(make_shared<MappedFile>(path)));
+    }
+
+    template<typename T>
+    static uint64_t writeArray(ofstream& out, const Array<T>& array) {
+        static const char kZeros[kFlatForestAlignment] = {};
+        uint64_t offset = out.tellp();
+        if (offset % kFlatForestAlignment) {
+            out.write(kZeros, kFlatForestAlignment - offset % kFlatForestAlignment);
+            offset = out.tellp();
+        }
+        out.write(reinterpret_cast<const char*>(array.data()), array.size()*sizeof(T));
+        return offset;
+    }
+
+    void save(const string& path) const {
+        ofstream out(path.c_str(), ios::binary | ios::trunc);
+        if (!out) {
+            throw std::runtime_error("cannot write " + path);
+        }
+        FlatForestHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic_, kFlatForestMagic, sizeof(kFlatForestMagic));
+        header.version_ = kFlatForestVersion;
+        header.byteOrder_ = FlatForestHeader::kByteOrder;
+        header.featureSize_ = sizeof(FeatureType);
+        header.nNodes_ = featureIndex_.size();
+        header.nTrees_ = treeRoots_.size() - 1;
+        header.iTerminator_ = iTerminator_;
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        header.featureIndexOffset_ = writeArray(out, featureIndex_);
+        header.featureValueOffset_ = writeArray(out, featureValue_);
+        header.leftIndexOffset_ = writeArray(out, leftIndex_);
+        header.rightIndexOffset_ = writeArray(out, rightIndex_);
+        header.nodeValueOffset_ = writeArray(out, nodeValue_);
+        header.treeRootsOffset_ = writeArray(out, treeRoots_);
+        header.nOutputs_ = nOutputs_;
+        if (nOutputs_ > 1) {
+            header.outputIndexOffset_ = writeArray(out, outputIndex_);
+            header.outputsOffset_ = writeArray(out, outputs_);
+            header.nOutputValues_ = outputs_.size();
+        }
+
+        out.seekp(0);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        if (!out) {
+            throw std::runtime_error("cannot write " + path);
+        }
+    }
+
+    bool isLeaf(int i) const {
+        return leftIndex_[i] == rightIndex_[i];
+    }
+
+    static inline int column(int featureIndex) {
+        return featureIndex & kColumnMask;
+    }
+
+    static inline bool goesLeft(FeatureType x, FeatureType featureValue, int featureIndex) {
+        return (x < featureValue) | ((x != x) & (featureIndex < 0));
+    }
+
+    static inline __m256i columns(__m256i featureIndices) {
+        return _mm256_and_si256(featureIndices, _mm256_set1_epi32(kColumnMask));
+    }
+
+    static inline __m128i columns(__m128i featureIndices) {
+        return _mm_and_si128(featureIndices, _mm_set1_epi32(kColumnMask));
+    }
+
+    // all-ones lanes go left: x < featureValue, or x is NaN and the node sends missing values left
+    static inline __m256 goesLeft(__m256 x, __m256 featureValues, __m256i featureIndices) {
+        __m256 missingLeft = _mm256_castsi256_ps(_mm256_srai_epi32(featureIndices, 31));
+        __m256 missing = _mm256_and_ps(_mm256_cmp_ps(x, x, _CMP_UNORD_Q), missingLeft);
+        return _mm256_or_ps(_mm256_cmp_ps(x, featureValues, _CMP_LT_OS), missing);
+    }
+
+    static inline __m256d goesLeft(__m256d x, __m256d featureValues, __m128i featureIndices) {
+        __m256d missingLeft = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(_mm_srai_epi32(featureIndices, 31)));
+        __m256d missing = _mm256_and_pd(_mm256_cmp_pd(x, x, _CMP_UNORD_Q), missingLeft);
+        return _mm256_or_pd(_mm256_cmp_pd(x, featureValues, _CMP_LT_OS), missing);
+    }
+
+    void resizeNodes(size_t size) {
+        featureIndex_.resize(size);
+        featureValue_.resize(size);
+        leftIndex_.resize(size);
+        rightIndex_.resize(size);
+        nodeValue_.resize(size);
+        if (nOutputs_ > 1) {
+            outputIndex_.resize(size);
+        }
+    }
+
+    // the terminator adds nothing and loops to itself, the kernels stop on it
+    void setTerminator(int iTerminator) {
+        iTerminator_ = iTerminator;
+        leftIndex_[iTerminator_] = iTerminator_;
+        rightIndex_[iTerminator_] = iTerminator_;
+        featureIndex_[iTerminator_] = 0;
+        nodeValue_[iTerminator_] = 0.f;
+        featureValue_[iTerminator_] = numeric_limits<FeatureType>::max();
+        if (nOutputs_ > 1) {
+            outputIndex_[iTerminator_] = 0;
+        }
+        terminator_.data_ = InitVector<typename IVectorType::AVXType>(iTerminator_);
+    }
+
+    // trees are contiguous and every leaf links to whatever follows its tree, so any leaf gives the end
+    int treeEnd(int root) const {
+        int i = root;
+        while (!isLeaf(i)) {
+            i = leftIndex_[i];
+        }
+        return leftIndex_[i];
+    }
+
+    // incremental updates write into the arrays, a mapped model is copied out first
+    void detach() {
+        if (!mapping_) {
+            return;
+        }
+        featureIndex_.resize(featureIndex_.size());
+        featureValue_.resize(featureValue_.size());
+        leftIndex_.resize(leftIndex_.size());
+        rightIndex_.resize(rightIndex_.size());
+        nodeValue_.resize(nodeValue_.size());
+        treeRoots_.resize(treeRoots_.size());
+        outputIndex_.resize(outputIndex_.size());
+        outputs_.resize(outputs_.size());
+        mapping_.reset();
+    }
+
+    // adds the trees of f after the last one. The old terminator slot becomes the root of the first new
+    // tree, so the old last tree already links to it and no existing node changes; the arrays grow
+    // geometrically, which makes this amortised O(new nodes)
+    void append(const RandomForestF& f) {
+        if (!f.isPreorder()) {
+            throw std::runtime_error("tree is not in pre-order");
+        }
+        if (f.nodes_.empty()) {
+            return;
+        }
+        if (f.nOutputs_ != nOutputs_) {
+            throw std::runtime_error("forests have different output counts");
+        }
+        if (f.nodes_.size() >= static_cast<size_t>(numeric_limits<int>::max() - iTerminator_)
+            || f.outputs_.size() >= static_cast<size_t>(numeric_limits<int>::max()) - outputs_.size()) {
+            throw std::runtime_error("too many nodes");
+        }
+        detach();
+        int base = iTerminator_;
+        size_t nOld = nTrees();
+        size_t outputBase = outputs_.size();
+        if (nOutputs_ > 1) {
+            outputs_.resize(outputBase + f.outputs_.size());
+            copy(f.outputs_.begin(), f.outputs_.end(), &outputs_[outputBase]);
+        }
+        resizeNodes(base + f.nodes_.size() + 1);
+        fill(f, base, outputBase);
+        setTerminator(base + f.nodes_.size());
+        treeRoots_.resize(nOld + f.nTrees() + 1);
+        for (size_t t = 0; t < f.nTrees(); ++t) {
+            treeRoots_[nOld + t] = base + f.roots_[t];
+        }
+        treeRoots_[nOld + f.nTrees()] = iTerminator_;
+    }
+
+    // drops tree iTree (counted among the live trees). Its root becomes a leaf worth 0 that links to
+    // whatever followed the tree, so no other node changes and index 0 stays a valid start for the
+    // kernels. The other nodes are garbage until compact(), which runs once garbage outnumbers the live
+    // nodes so the cost stays amortised O(retired nodes)
+    void retire(size_t iTree) {
+        if (iTree >= nTrees()) {
+            throw std::runtime_error("no such tree");
+        }
+        detach();
+        int root = treeRoots_[iTree];
+        int end = treeEnd(root);
+        featureIndex_[root] = 0;
+        featureValue_[root] = numeric_limits<FeatureType>::max();
+        leftIndex_[root] = end;
+        rightIndex_[root] = end;
+        nodeValue_[root] = 0;
+        if (nOutputs_ > 1) {
+            outputIndex_[root] = 0;
+        }
+        retiredNodes_ += end - root;
+        for (size_t t = iTree; t < nTrees(); ++t) {
+            treeRoots_[t] = treeRoots_[t + 1];
+        }
+        treeRoots_.resize(treeRoots_.size() - 1);
+        if (2*retiredNodes_ > static_cast<size_t>(iTerminator_)) {
+            compact();
+        }
+    }
+
+    // moves the live trees over the retired ones, O(nodes)
+    void compact() {
+        if (!retiredNodes_) {
+            return;
+        }
+        size_t size = featureIndex_.size() - retiredNodes_;
+        Array<int> featureIndex;
+        Array<FeatureType> featureValue;
+        Array<int> leftIndex;
+        Array<int> rightIndex;
+        Array<FeatureType> nodeValue;
+        featureIndex.resize(size);
+        featureValue.resize(size);
+        leftIndex.resize(size);
+        rightIndex.resize(size);
+        nodeValue.resize(size);
+        Array<int> outputIndex;
+        vector<FeatureType> outputs(nOutputs_ > 1 ? nOutputs_ : 0);
+        if (nOutputs_ > 1) {
+            outputIndex.resize(size);
+        }
+        int base = 0;
+        for (size_t t = 0; t < nTrees(); ++t) {
+            int root = treeRoots_[t];
+            int end = treeEnd(root);
+            int nextBase = base + (end - root);
+            if (nextBase >= static_cast<int>(size)) {
+                throw std::runtime_error("tree invariant failed");
+            }
+            for (int i = root; i < end; ++i) {
+                int k = base + (i - root);
+                featureIndex[k] = featureIndex_[i];
+                featureValue[k] = featureValue_[i];
+                nodeValue[k] = nodeValue_[i];
+                leftIndex[k] = isLeaf(i) ? nextBase : leftIndex_[i] - root + base;
+                rightIndex[k] = isLeaf(i) ? nextBase : rightIndex_[i] - root + base;
+                if (nOutputs_ > 1) {
+                    outputIndex[k] = isLeaf(i) ? outputs.size() : 0;
+                    if (isLeaf(i)) {
+                        outputs.insert(outputs.end(), &outputs_[outputIndex_[i]], &outputs_[outputIndex_[i]] + nOutputs_);
+                    }
+                }
+            }
+            treeRoots_[t] = base;
+            base = nextBase;
+        }
+        if (base + 1 != static_cast<int>(size)) {
+            throw std::runtime_error("tree invariant failed");
+        }
+        featureIndex_ = featureIndex;
+        featureValue_ = featureValue;
+        leftIndex_ = leftIndex;
+        rightIndex_ = rightIndex;
+        nodeValue_ = nodeValue;
+        if (nOutputs_ > 1) {
+            outputIndex_ = outputIndex;
+            outputs_.resize(outputs.size());
+            copy(outputs.begin(), outputs.end(), &outputs_[0]);
+        }
+        setTerminator(base);
+        treeRoots_[nTrees()] = base;
+        retiredNodes_ = 0;
+        mapping_.reset();
+    }
+
+    // walks every row like eval and counts the visits, adding to what the profile already holds
+    void profile(const FeatureType* rows, size_t nRows, size_t stride, NodeProfile& profile) const {
+        if (profile.visits_.empty()) {
+            profile.visits_.resize(featureIndex_.size());
+        }
+        if (profile.visits_.size() != featureIndex_.size()) {
+            throw std::runtime_error("profile does not match the model");
+        }
+        for (size_t i = 0; i < nRows; ++i) {
+            const FeatureType* features = rows + i*stride;
+            int current = 0;
+            while (current != iTerminator_) {
+                ++profile.visits_[current];
+                current = goesLeft(features[column(featureIndex_[current])], featureValue_[current], featureIndex_[current]) ? leftIndex_[current] : rightIndex_[current];
+            }
+        }
+    }
+
+    // profile-guided layout, trees stay contiguous and in order. Inside a tree the hottest remaining
+    // node starts a chain that always continues into the hotter child, so that child sits right after
+    // its parent and the hot paths share cache lines in every node array; colder siblings start later
+    // chains. The profile is permuted along with the nodes so it keeps matching the model
+    void relayout(NodeProfile& profile) {
+        if (retiredNodes_) {
+            throw std::runtime_error("compact() before relayout");
+        }
+        const size_t nNodes = featureIndex_.size();
+        if (profile.visits_.size() != nNodes) {
+            throw std::runtime_error("profile does not match the model");
+        }
+        const vector<uint64_t>& visits = profile.visits_;
+        vector<int> order; // new index -> old index
+        order.reserve(nNodes);
+        for (size_t t = 0; t + 1 < treeRoots_.size(); ++t) {
+            // ties keep the old (pre-order) position
+            priority_queue<pair<uint64_t, int>> chains;
+            chains.push(make_pair(visits[treeRoots_[t]], -treeRoots_[t]));
+            while (!chains.empty()) {
+                int current = -chains.top().second;
+                chains.pop();
+                for (;;) {
+                    order.push_back(current);
+                    if (isLeaf(current)) {
+                        break;
+                    }
+                    int hot = leftIndex_[current];
+                    int cold = rightIndex_[current];
+                    if (visits[cold] > visits[hot]) {
+                        swap(hot, cold);
+                    }
+                    chains.push(make_pair(visits[cold], -cold));
+                    current = hot;
+                }
+            }
+        }
+        order.push_back(iTerminator_);
+        if (order.size() != nNodes) {
+            throw std::runtime_error("tree invariant failed");
+        }
+
+        vector<int> newIndex(nNodes);
+        for (size_t k = 0; k < nNodes; ++k) {
+            newIndex[order[k]] = k;
+        }
+        Array<int> featureIndex;
+        Array<FeatureType> featureValue;
+        Array<int> leftIndex;
+        Array<int> rightIndex;
+        Array<FeatureType> nodeValue;
+        Array<int> outputIndex;
+        featureIndex.resize(nNodes);
+        featureValue.resize(nNodes);
+        leftIndex.resize(nNodes);
+        rightIndex.resize(nNodes);
+        nodeValue.resize(nNodes);
+        if (nOutputs_ > 1) {
+            outputIndex.resize(nNodes);
+        }
+        vector<uint64_t> permuted(nNodes);
+        for (size_t k = 0; k < nNodes; ++k) {
+            int old = order[k];
+            featureIndex[k] = featureIndex_[old];
+            featureValue[k] = featureValue_[old];
+            leftIndex[k] = newIndex[leftIndex_[old]];
+            rightIndex[k] = newIndex[rightIndex_[old]];
+            nodeValue[k] = nodeValue_[old];
+            if (nOutputs_ > 1) {
+                outputIndex[k] = outputIndex_[old];
+            }
+            permuted[k] = visits[old];
+        }
+        Array<int> treeRoots;
+        treeRoots.resize(treeRoots_.size());
+        for (size_t t = 0; t < treeRoots_.size(); ++t) {
+            treeRoots[t] = newIndex[treeRoots_[t]];
+        }
+        featureIndex_ = featureIndex;
+        featureValue_ = featureValue;
+        leftIndex_ = leftIndex;
+        rightIndex_ = rightIndex;
+        nodeValue_ = nodeValue;
+        treeRoots_ = treeRoots;
+        if (nOutputs_ > 1) {
+            outputIndex_ = outputIndex;
+            outputs_.resize(outputs_.size());
+        }
+        profile.visits_.swap(permuted);
+        mapping_.reset();
+    }
+
+    // arena index plus base is the flat index, leaves link to the root of the next tree. Leaf outputs
+    // of f are already copied to outputs_ at outputBase
+    void fill(const RandomForestF& f, int base, size_t outputBase) {
+        for (size_t iTree = 0; iTree < f.nTrees(); ++iTree) {
+            int nextIndex = base + f.treeEnd(iTree);
+            for (int a = f.roots_[iTree]; a + base < nextIndex; ++a) {
+                const auto& node = f.nodes_[a];
+                int i = base + a;
+                if (!node.isLeaf_) {
+                    featureIndex_[i] = node.featureIndex_ | (node.missingLeft_ ? kMissingLeft : 0);
+                    featureValue_[i] = node.featureValue_;
+                    leftIndex_[i] = base + node.left_;
+                    rightIndex_[i] = base + node.right_;
+                    nodeValue_[i] = 0;
+                    if (nOutputs_ > 1) {
+                        outputIndex_[i] = 0;
+                    }
+                } else {
+                    featureIndex_[i] = 0;
+                    featureValue_[i] = numeric_limits<FeatureType>::max();
+                    leftIndex_[i] = nextIndex;
+                    rightIndex_[i] = nextIndex;
+                    nodeValue_[i] = node.leafValue_;
+                    if (nOutputs_ > 1) {
+                        outputIndex_[i] = outputBase + node.firstOutput_;
+                    }
+                }
+            }
+        }
+    }
+
+    FeatureType eval(const typename RandomForestF::Features& features) const {
+        int begin = 0;
+        FeatureType result = 0.f;
+        while (begin != iTerminator_) {
+            result += nodeValue_[begin];
+            if (goesLeft(features[column(featureIndex_[begin])], featureValue_[begin], featureIndex_[begin])) {
+                begin = leftIndex_[begin];
+            } else {
+                begin = rightIndex_[begin];
+            }
+        }
+        return result;
+    }
+
+    static inline __m256i poorManBlend8(int mask, const __m256i& a, const __m256i& b) {
+    switch (mask) {
+        case 0:
+            return _mm256_blend_epi32(a, b, 0);
+        case 1:
+                return _mm256_blend_epi32(a, b, 1);
+        case 2:
+                return _mm256_blend_epi32(a, b, 2);
+        case 3:
+                return _mm256_blend_epi32(a, b, 3);
+        case 4:
+                return _mm256_blend_epi32(a, b, 4);
+        case 5:
+                return _mm256_blend_epi32(a, b, 5);
+        case 6:
+                return _mm256_blend_epi32(a, b, 6);
+        case 7:
+                return _mm256_blend_epi32(a, b, 7);
+        case 8:
+                return _mm256_blend_epi32(a, b, 8);
+        case 9:
+                return _mm256_blend_epi32(a, b, 9);
+        case 10:
+                return _mm256_blend_epi32(a, b, 10);
+        case 11:
+                return _mm256_blend_epi32(a, b, 11);
+        case 12:
+                return _mm256_blend_epi32(a, b, 12);
+        case 13:
+                return _mm256_blend_epi32(a, b, 13);
+        case 14:
+                return _mm256_blend_epi32(a, b, 14);
+        case 15:
+                return _mm256_blend_epi32(a, b, 15);
+        case 16:
+                return _mm256_blend_epi32(a, b, 16);
+        case 17:
+                return _mm256_blend_epi32(a, b, 17);
+        case 18:
+                return _mm256_blend_epi32(a, b, 18);
+        case 19:
+                return _mm256_blend_epi32(a, b, 19);
+        case 20:
+                return _mm256_blend_epi32(a, b, 20);
+        case 21:
+                return _mm256_blend_epi32(a, b, 21);
+        case 22:
+                return _mm256_blend_epi32(a, b, 22);
+        case 23:
+                return _mm256_blend_epi32(a, b, 23);
+        case 24:
+                return _mm256_blend_epi32(a, b, 24);
+        case 25:
+                return _mm256_blend_epi32(a, b, 25);
+        case 26:
+                return _mm256_blend_epi32(a, b, 26);
+        case 27:
+                return _mm256_blend_epi32(a, b, 27);
+        case 28:
+                return _mm256_blend_epi32(a, b, 28);
+        case 29:
+                return _mm256_blend_epi32(a, b, 29);
+        case 30:
+                return _mm256_blend_epi32(a, b, 30);
+        case 31:
+                return _mm256_blend_epi32(a, b, 31);
+        case 32:
+                return _mm256_blend_epi32(a, b, 32);
+        case 33:
+                return _mm256_blend_epi32(a, b, 33);
+        case 34:
+                return _mm256_blend_epi32(a, b, 34);
+        case 35:
+                return _mm256_blend_epi32(a, b, 35);
+        case 36:
+                return _mm256_blend_epi32(a, b, 36);
+        case 37:
+                return _mm256_blend_epi32(a, b, 37);
+        case 38:
+                return _mm256_blend_epi32(a, b, 38);
+        case 39:
+                return _mm256_blend_epi32(a, b, 39);
+        case 40:
+                return _mm256_blend_epi32(a, b, 40);
+        case 41:
+                return _mm256_blend_epi32(a, b, 41);
+        case 42:
+                return _mm256_blend_epi32(a, b, 42);
+        case 43:
+                return _mm256_blend_epi32(a, b, 43);
+        case 44:
+                return _mm256_blend_epi32(a, b, 44);
+        case 45:
+                return _mm256_blend_epi32(a, b, 45);
+        case 46:
+                return _mm256_blend_epi32(a, b, 46);
+        case 47:
+                return _mm256_blend_epi32(a, b, 47);
+        case 48:
+                return _mm256_blend_epi32(a, b, 48);
+        case 49:
+                return _mm256_blend_epi32(a, b, 49);
+        case 50:
+                return _mm256_blend_epi32(a, b, 50);
+        case 51:
+                return _mm256_blend_epi32(a, b, 51);
+        case 52:
+                return _mm256_blend_epi32(a, b, 52);
+        case 53:
+                return _mm256_blend_epi32(a, b, 53);
+        case 54:
+                return _mm256_blend_epi32(a, b, 54);
+        case 55:
+                return _mm256_blend_epi32(a, b, 55);
+        case 56:
+                return _mm256_blend_epi32(a, b, 56);
+        case 57:
+                return _mm256_blend_epi32(a, b, 57);
+        case 58:
+                return _mm256_blend_epi32(a, b, 58);
+        case 59:
+                return _mm256_blend_epi32(a, b, 59);
+        case 60:
+                return _mm256_blend_epi32(a, b, 60);
+        case 61:
+                return _mm256_blend_epi32(a, b, 61);
+        case 62:
+                return _mm256_blend_epi32(a, b, 62);
+        case 63:
+                return _mm256_blend_epi32(a, b, 63);
+        case 64:
+                return _mm256_blend_epi32(a, b, 64);
+        case 65:
+                return _mm256_blend_epi32(a, b, 65);
+        case 66:
+                return _mm256_blend_epi32(a, b, 66);
+        case 67:
+                return _mm256_blend_epi32(a, b, 67);
+        case 68:
+                return _mm256_blend_epi32(a, b, 68);
+        case 69:
+                return _mm256_blend_epi32(a, b, 69);
+        case 70:
+                return _mm256_blend_epi32(a, b, 70);
+        case 71:
+                return _mm256_blend_epi32(a, b, 71);
+        case 72:
+                return _mm256_blend_epi32(a, b, 72);
+        case 73:
+                return _mm256_blend_epi32(a, b, 73);
+        case 74:
+                return _mm256_blend_epi32(a, b, 74);
+        case 75:
+                return _mm256_blend_epi32(a, b, 75);
+        case 76:
+                return _mm256_blend_epi32(a, b, 76);
+        case 77:
+                return _mm256_blend_epi32(a, b, 77);
+        case 78:
+                return _mm256_blend_epi32(a, b, 78);
+        case 79:
+                return _mm256_blend_epi32(a, b, 79);
+        case 80:
+                return _mm256_blend_epi32(a, b, 80);
+        case 81:
+                return _mm256_blend_epi32(a, b, 81);
+        case 82:
+                return _mm256_blend_epi32(a, b, 82);
+        case 83:
+                return _mm256_blend_epi32(a, b, 83);
+        case 84:
+                return _mm256_blend_epi32(a, b, 84);
+        case 85:
+                return _mm256_blend_epi32(a, b, 85);
+        case 86:
+                return _mm256_blend_epi32(a, b, 86);
+        case 87:
+                return _mm256_blend_epi32(a, b, 87);
+        case 88:
+                return _mm256_blend_epi32(a, b, 88);
+        case 89:
+                return _mm256_blend_epi32(a, b, 89);
+        case 90:
+                return _mm256_blend_epi32(a, b, 90);
+        case 91:
+                return _mm256_blend_epi32(a, b, 91);
+        case 92:
+                return _mm256_blend_epi32(a, b, 92);
+        case 93:
+                return _mm256_blend_epi32(a, b, 93);
+        case 94:
+                return _mm256_blend_epi32(a, b, 94);
+        case 95:
+                return _mm256_blend_epi32(a, b, 95);
+        case 96:
+                return _mm256_blend_epi32(a, b, 96);
+        case 97:
+                return _mm256_blend_epi32(a, b, 97);
+        case 98:
+                return _mm256_blend_epi32(a, b, 98);
+        case 99:
+                return _mm256_blend_epi32(a, b, 99);
+        case 100:
+                return _mm256_blend_epi32(a, b, 100);
+        case 101:
+                return _mm256_blend_epi32(a, b, 101);
+        case 102:
+                return _mm256_blend_epi32(a, b, 102);
+        case 103:
+                return _mm256_blend_epi32(a, b, 103);
+        case 104:
+                return _mm256_blend_epi32(a, b, 104);
+        case 105:
+                return _mm256_blend_epi32(a, b, 105);
+        case 106:
+                return _mm256_blend_epi32(a, b, 106);
+        case 107:
+                return _mm256_blend_epi32(a, b, 107);
+        case 108:
+                return _mm256_blend_epi32(a, b, 108);
+        case 109:
+                return _mm256_blend_epi32(a, b, 109);
+        case 110:
+                return _mm256_blend_epi32(a, b, 110);
+        case 111:
+                return _mm256_blend_epi32(a, b, 111);
+        case 112:
+                return _mm256_blend_epi32(a, b, 112);
+        case 113:
+                return _mm256_blend_epi32(a, b, 113);
+        case 114:
+                return _mm256_blend_epi32(a, b, 114);
+        case 115:
+                return _mm256_blend_epi32(a, b, 115);
+        case 116:
+                return _mm256_blend_epi32(a, b, 116);
+        case 117:
+                return _mm256_blend_epi32(a, b, 117);
+        case 118:
+                return _mm256_blend_epi32(a, b, 118);
+        case 119:
+                return _mm256_blend_epi32(a, b, 119);
+        case 120:
+                return _mm256_blend_epi32(a, b, 120);
+        case 121:
+                return _mm256_blend_epi32(a, b, 121);
+        case 122:
+                return _mm256_blend_epi32(a, b, 122);
+        case 123:
+                return _mm256_blend_epi32(a, b, 123);
+        case 124:
+                return _mm256_blend_epi32(a, b, 124);
+        case 125:
+                return _mm256_blend_epi32(a, b, 125);
+        case 126:
+                return _mm256_blend_epi32(a, b, 126);
+        case 127:
+                return _mm256_blend_epi32(a, b, 127);
+        case 128:
+                return _mm256_blend_epi32(a, b, 128);
+        case 129:
+                return _mm256_blend_epi32(a, b, 129);
+        case 130:
+                return _mm256_blend_epi32(a, b, 130);
+        case 131:
+                return _mm256_blend_epi32(a, b, 131);
+        case 132:
+                return _mm256_blend_epi32(a, b, 132);
+        case 133:
+                return _mm256_blend_epi32(a, b, 133);
+        case 134:
+                return _mm256_blend_epi32(a, b, 134);
+        case 135:
+                return _mm256_blend_epi32(a, b, 135);
+        case 136:
+                return _mm256_blend_epi32(a, b, 136);
+        case 137:
+                return _mm256_blend_epi32(a, b, 137);
+        case 138:
+                return _mm256_blend_epi32(a, b, 138);
+        case 139:
+                return _mm256_blend_epi32(a, b, 139);
+        case 140:
+                return _mm256_blend_epi32(a, b, 140);
+        case 141:
+                return _mm256_blend_epi32(a, b, 141);
+        case 142:
+                return _mm256_blend_epi32(a, b, 142);
+        case 143:
+                return _mm256_blend_epi32(a, b, 143);
+        case 144:
+                return _mm256_blend_epi32(a, b, 144);
+        case 145:
+                return _mm256_blend_epi32(a, b, 145);
+        case 146:
+                return _mm256_blend_epi32(a, b, 146);
+        case 147:
+                return _mm256_blend_epi32(a, b, 147);
+        case 148:
+                return _mm256_blend_epi32(a, b, 148);
+        case 149:
+                return _mm256_blend_epi32(a, b, 149);
+        case 150:
+                return _mm256_blend_epi32(a, b, 150);
+        case 151:
+                return _mm256_blend_epi32(a, b, 151);
+        case 152:
+                return _mm256_blend_epi32(a, b, 152);
+        case 153:
+                return _mm256_blend_epi32(a, b, 153);
+        case 154:
+                return _mm256_blend_epi32(a, b, 154);
+        case 155:
+                return _mm256_blend_epi32(a, b, 155);
+        case 156:
+                return _mm256_blend_epi32(a, b, 156);
+        case 157:
+                return _mm256_blend_epi32(a, b, 157);
+        case 158:
+                return _mm256_blend_epi32(a, b, 158);
+        case 159:
+                return _mm256_blend_epi32(a, b, 159);
+        case 160:
+                return _mm256_blend_epi32(a, b, 160);
+        case 161:
+                return _mm256_blend_epi32(a, b, 161);
+        case 162:
+                return _mm256_blend_epi32(a, b, 162);
+        case 163:
+                return _mm256_blend_epi32(a, b, 163);
+        case 164:
+                return _mm256_blend_epi32(a, b, 164);
+        case 165:
+                return _mm256_blend_epi32(a, b, 165);
+        case 166:
+                return _mm256_blend_epi32(a, b, 166);
+        case 167:
+                return _mm256_blend_epi32(a, b, 167);
+        case 168:
+                return _mm256_blend_epi32(a, b, 168);
+        case 169:
+                return _mm256_blend_epi32(a, b, 169);
+        case 170:
+                return _mm256_blend_epi32(a, b, 170);
+        case 171:
+                return _mm256_blend_epi32(a, b, 171);
+        case 172:
+                return _mm256_blend_epi32(a, b, 172);
+        case 173:
+                return _mm256_blend_epi32(a, b, 173);
+        case 174:
+                return _mm256_blend_epi32(a, b, 174);
+        case 175:
+                return _mm256_blend_epi32(a, b, 175);
+        case 176:
+                return _mm256_blend_epi32(a, b, 176);
+        case 177:
+                return _mm256_blend_epi32(a, b, 177);
+        case 178:
+                return _mm256_blend_epi32(a, b, 178);
+        case 179:
+                return _mm256_blend_epi32(a, b, 179);
+        case 180:
+                return _mm256_blend_epi32(a, b, 180);
+        case 181:
+                return _mm256_blend_epi32(a, b, 181);
+        case 182:
+                return _mm256_blend_epi32(a, b, 182);
+        case 183:
+                return _mm256_blend_epi32(a, b, 183);
+        case 184:
+                return _mm256_blend_epi32(a, b, 184);
+        case 185:
+                return _mm256_blend_epi32(a, b, 185);
+        case 186:
+                return _mm256_blend_epi32(a, b, 186);
+        case 187:
+                return _mm256_blend_epi32(a, b, 187);
+        case 188:
+                return _mm256_blend_epi32(a, b, 188);
+        case 189:
+                return _mm256_blend_epi32(a, b, 189);
+        case 190:
+                return _mm256_blend_epi32(a, b, 190);
+        case 191:
+                return _mm256_blend_epi32(a, b, 191);
+        case 192:
+                return _mm256_blend_epi32(a, b, 192);
+        case 193:
+                return _mm256_blend_epi32(a, b, 193);
+        case 194:
+                return _mm256_blend_epi32(a, b, 194);
+        case 195:
+                return _mm256_blend_epi32(a, b, 195);
+        case 196:
+                return _mm256_blend_epi32(a, b, 196);
+        case 197:
+                return _mm256_blend_epi32(a, b, 197);
+        case 198:
+                return _mm256_blend_epi32(a, b, 198);
+        case 199:
+                return _mm256_blend_epi32(a, b, 199);
+        case 200:
+                return _mm256_blend_epi32(a, b, 200);
+        case 201:
+                return _mm256_blend_epi32(a, b, 201);
+        case 202:
+                return _mm256_blend_epi32(a, b, 202);
+        case 203:
+                return _mm256_blend_epi32(a, b, 203);
+        case 204:
+                return _mm256_blend_epi32(a, b, 204);
+        case 205:
+                return _mm256_blend_epi32(a, b, 205);
+        case 206:
+                return _mm256_blend_epi32(a, b, 206);
+        case 207:
+                return _mm256_blend_epi32(a, b, 207);
+        case 208:
+                return _mm256_blend_epi32(a, b, 208);
+        case 209:
+                return _mm256_blend_epi32(a, b, 209);
+        case 210:
+                return _mm256_blend_epi32(a, b, 210);
+        case 211:
+                return _mm256_blend_epi32(a, b, 211);
+        case 212:
+                return _mm256_blend_epi32(a, b, 212);
+        case 213:
+                return _mm256_blend_epi32(a, b, 213);
+        case 214:
+                return _mm256_blend_epi32(a, b, 214);
+        case 215:
+                return _mm256_blend_epi32(a, b, 215);
+        case 216:
+                return _mm256_blend_epi32(a, b, 216);
+        case 217:
+                return _mm256_blend_epi32(a, b, 217);
+        case 218:
+                return _mm256_blend_epi32(a, b, 218);
+        case 219:
+                return _mm256_blend_epi32(a, b, 219);
+        case 220:
+                return _mm256_blend_epi32(a, b, 220);
+        case 221:
+                return _mm256_blend_epi32(a, b, 221);
+        case 222:
+                return _mm256_blend_epi32(a, b, 222);
+        case 223:
+                return _mm256_blend_epi32(a, b, 223);
+        case 224:
+                return _mm256_blend_epi32(a, b, 224);
+        case 225:
+                return _mm256_blend_epi32(a, b, 225);
+        case 226:
+                return _mm256_blend_epi32(a, b, 226);
+        case 227:
+                return _mm256_blend_epi32(a, b, 227);
+        case 228:
+                return _mm256_blend_epi32(a, b, 228);
+        case 229:
+                return _mm256_blend_epi32(a, b, 229);
+        case 230:
+                return _mm256_blend_epi32(a, b, 230);
+        case 231:
+                return _mm256_blend_epi32(a, b, 231);
+        case 232:
+                return _mm256_blend_epi32(a, b, 232);
+        case 233:
+                return _mm256_blend_epi32(a, b, 233);
+        case 234:
+                return _mm256_blend_epi32(a, b, 234);
+        case 235:
+                return _mm256_blend_epi32(a, b, 235);
+        case 236:
+                return _mm256_blend_epi32(a, b, 236);
+        case 237:
+                return _mm256_blend_epi32(a, b, 237);
+        case 238:
+                return _mm256_blend_epi32(a, b, 238);
+        case 239:
+                return _mm256_blend_epi32(a, b, 239);
+        case 240:
+                return _mm256_blend_epi32(a, b, 240);
+        case 241:
+                return _mm256_blend_epi32(a, b, 241);
+        case 242:
+                return _mm256_blend_epi32(a, b, 242);
+        case 243:
+                return _mm256_blend_epi32(a, b, 243);
+        case 244:
+                return _mm256_blend_epi32(a, b, 244);
+        case 245:
+                return _mm256_blend_epi32(a, b, 245);
+        case 246:
+                return _mm256_blend_epi32(a, b, 246);
+        case 247:
+                return _mm256_blend_epi32(a, b, 247);
+        case 248:
+                return _mm256_blend_epi32(a, b, 248);
+        case 249:
+                return _mm256_blend_epi32(a, b, 249);
+        case 250:
+                return _mm256_blend_epi32(a, b, 250);
+        case 251:
+                return _mm256_blend_epi32(a, b, 251);
+        case 252:
+                return _mm256_blend_epi32(a, b, 252);
+        case 253:
+                return _mm256_blend_epi32(a, b, 253);
+        case 254:
+                return _mm256_blend_epi32(a, b, 254);
+        case 255:
+                return _mm256_blend_epi32(a, b, 255);
+        default:
+            throw std::runtime_error("bad blend mask");
+        }
+    }
+
+    FloatVector evalAVXSparse(float** features) const {
+        IVector8 current;
+        current.data_ = _mm256_set1_epi32(0);
+        FloatVector result;
+        result.data_ = _mm256_set1_ps(0.f);
+
+        FloatVector nodeValues;
+        IVector8 featureIndices;
+        FloatVector featureValues;
+        IVector8 leftIndices;
+        IVector8 rightIndices;
+        FloatVector featuresHere;
+
+        while (-1 != _mm256_movemask_epi8(_mm256_cmpeq_epi32(current.data_, terminator_.data_))) {
+            nodeValues.data_ = _mm256_i32gather_ps(&nodeValue_[0], current.data_, 4);
+            result.data_ = _mm256_add_ps(result.data_, nodeValues.data_);
+
+            featureIndices.data_ = _mm256_i32gather_epi32(&featureIndex_[0], current.data_, 4);
+            featureValues.data_ = _mm256_i32gather_ps(&featureValue_[0], current.data_, 4);
+            leftIndices.data_ = _mm256_i32gather_epi32(&leftIndex_[0], current.data_, 4);
+            rightIndices.data_ = _mm256_i32gather_epi32(&rightIndex_[0], current.data_, 4);
+            for (size_t i = 0; i < 8; ++i) {
+                featuresHere.floatData_[i] = features[i][column(featureIndices.intData_[i])];
+            }
+            int mask = _mm256_movemask_ps(goesLeft(featuresHere.data_, featureValues.data_, featureIndices.data_));
+            current.data_ = poorManBlend8(mask, rightIndices.data_, leftIndices.data_);
+        }
+        return result;
+    }
+
+    FloatVector evalAVXDense(const float* features0, const IVector8& offsets) const {
+        IVector8 current;
+        current.data_ = _mm256_set1_epi32(0);
+        return evalAVXDense(features0, offsets, current);
+    }
+
+    FloatVector evalAVXDense(const float* features0, const IVector8& offsets, IVector8 current) const {
+        FloatVector result;
+        result.data_ = _mm256_set1_ps(0.f);
+
+        FloatVector nodeValues;
+        IVector8 featureIndices;
+        FloatVector featureValues;
+        IVector8 leftIndices;
+        IVector8 rightIndices;
+        FloatVector featuresHere;
+        IVector8 featureAddresses;
+
+        while (-1 != _mm256_movemask_epi8(_mm256_cmpeq_epi32(current.data_, terminator_.data_))) {
+            nodeValues.data_ = _mm256_i32gather_ps(&nodeValue_[0], current.data_, 4);
+            result.data_ = _mm256_add_ps(result.data_, nodeValues.data_);
+
+            featureIndices.data_ = _mm256_i32gather_epi32(&featureIndex_[0], current.data_, 4);
+            featureValues.data_ = _mm256_i32gather_ps(&featureValue_[0], current.data_, 4);
+            leftIndices.data_ = _mm256_i32gather_epi32(&leftIndex_[0], current.data_, 4);
+            rightIndices.data_ = _mm256_i32gather_epi32(&rightIndex_[0], current.data_, 4);
+
+            featureAddresses.data_ = _mm256_add_epi32(columns(featureIndices.data_), offsets.data_);
+            featuresHere.data_ = _mm256_i32gather_ps(features0, featureAddresses.data_, 4);
+
+            int mask = _mm256_movemask_ps(goesLeft(featuresHere.data_, featureValues.data_, featureIndices.data_));
+            current.data_ = poorManBlend8(mask, rightIndices.data_, leftIndices.data_);
+        }
+        return result;
+    }
+
+    FloatVector evalAVX(float** features) const {
+        IVector8 offsets;
+        for (size_t i = 0; i < 8; ++i) {
+            ssize_t diff = features[i] - features[0];
+            if ( diff >= numeric_limits<int>::max() && diff <= numeric_limits<int>::min() ) {
+                return evalAVXSparse(features);
+            }
+            offsets.intData_[i] = diff;
+        }
+        return evalAVXDense(features[0], offsets);
+    }
+
+    static inline __m128i poorManBlend4(int mask, const __m128i& a, const __m128i& b) {
+    switch (mask) {
+        case 0:
+                return _mm_blend_epi32(a, b, 0);
+        case 1:
+                return _mm_blend_epi32(a, b, 1);
+        case 2:
+                return _mm_blend_epi32(a, b, 2);
+        case 3:
+                return _mm_blend_epi32(a, b, 3);
+        case 4:
+                return _mm_blend_epi32(a, b, 4);
+        case 5:
+                return _mm_blend_epi32(a, b, 5);
+        case 6:
+                return _mm_blend_epi32(a, b, 6);
+        case 7:
+                return _mm_blend_epi32(a, b, 7);
+        case 8:
+                return _mm_blend_epi32(a, b, 8);
+        case 9:
+                return _mm_blend_epi32(a, b, 9);
+        case 10:
+                return _mm_blend_epi32(a, b, 10);
+        case 11:
+                return _mm_blend_epi32(a, b, 11);
+        case 12:
+                return _mm_blend_epi32(a, b, 12);
+        case 13:
+                return _mm_blend_epi32(a, b, 13);
+        case 14:
+                return _mm_blend_epi32(a, b, 14);
+        case 15:
+                return _mm_blend_epi32(a, b, 15);
+        default:
+            throw std::runtime_error("bad blend mask");
+        }
+    }
+
+    DoubleVector evalAVXSparse(double** features) const {
+        IVector4 current;
+        current.data_ = _mm_set1_epi32(0);
+        DoubleVector result;
+        result.data_ = _mm256_set1_pd(0.);
+
+        DoubleVector nodeValues;
+        IVector4 featureIndices;
+        DoubleVector featureValues;
+        IVector4 leftIndices;
+        IVector4 rightIndices;
+        DoubleVector featuresHere;
+        while (((1 << 16) - 1) != _mm_movemask_epi8(_mm_cmpeq_epi32(current.data_, terminator_.data_))) {
+            nodeValues.data_ = _mm256_i32gather_pd(&nodeValue_[0], current.data_, 8);
+            result.data_ = _mm256_add_pd(result.data_, nodeValues.data_);
+
+            featureIndices.data_ = _mm_i32gather_epi32(&featureIndex_[0], current.data_, 4);
+            featureValues.data_ = _mm256_i32gather_pd(&featureValue_[0], current.data_, 8);
+            leftIndices.data_ = _mm_i32gather_epi32(&leftIndex_[0], current.data_, 4);
+            rightIndices.data_ = _mm_i32gather_epi32(&rightIndex_[0], current.data_, 4);
+            for (size_t i = 0; i < 4; ++i) {
+                featuresHere.floatData_[i] = features[i][column(featureIndices.intData_[i])];
+            }
+            int mask = _mm256_movemask_pd(goesLeft(featuresHere.data_, featureValues.data_, featureIndices.data_));
+            current.data_ = poorManBlend4(mask, rightIndices.data_, leftIndices.data_);
+        }
+        return std::move(result);
+    }
+
+    DoubleVector evalAVXDense(const double* features0, const IVector4& offsets) const {
+        IVector4 current;
+        current.data_ = _mm_set1_epi32(0);
+        return evalAVXDense(features0, offsets, current);
+    }
+
+    DoubleVector evalAVXDense(const double* features0, const IVector4& offsets, IVector4 current) const {
+        DoubleVector result;
+        result.data_ = _mm256_set1_pd(0.);
+
+        DoubleVector nodeValues;
+        IVector4 featureIndices;
+        DoubleVector featureValues;
+        IVector4 leftIndices;
+        IVector4 rightIndices;
+        DoubleVector featuresHere;
+        IVector4 featureAddresses;
+        while (((1 << 16) - 1) != _mm_movemask_epi8(_mm_cmpeq_epi32(current.data_, terminator_.data_))) {
+            nodeValues.data_ = _mm256_i32gather_pd(&nodeValue_[0], current.data_, 8);
+            result.data_ = _mm256_add_pd(result.data_, nodeValues.data_);
+
+            featureIndices.data_ = _mm_i32gather_epi32(&featureIndex_[0], current.data_, 4);
+            featureValues.data_ = _mm256_i32gather_pd(&featureValue_[0], current.data_, 8);
+            leftIndices.data_ = _mm_i32gather_epi32(&leftIndex_[0], current.data_, 4);
+            rightIndices.data_ = _mm_i32gather_epi32(&rightIndex_[0], current.data_, 4);
+
+            featureAddresses.data_ = _mm_add_epi32(columns(featureIndices.data_), offsets.data_);
+            featuresHere.data_ = _mm256_i32gather_pd(features0, featureAddresses.data_, 8);
+
+            int mask = _mm256_movemask_pd(goesLeft(featuresHere.data_, featureValues.data_, featureIndices.data_));
+            current.data_ = poorManBlend4(mask, rightIndices.data_, leftIndices.data_);
+        }
+        return result;
+    }
+
+    DoubleVector evalAVX(double** features) const {
+        IVector4 offsets;
+        for (size_t i = 0; i < 4; ++i) {
+            ssize_t diff = features[i] - features[0];
+            if ( diff >= numeric_limits<int>::max() && diff <= numeric_limits<int>::min() ) {
+                return evalAVXSparse(features);
+            }
+            offsets.intData_[i] = diff;
+        }
+        return evalAVXDense(features[0], offsets);
+    }
+
+    // rows are laid out row-major, stride is the distance between rows in elements
+    void evalBatch(const FeatureType* rows, size_t nRows, size_t stride, FeatureType* out) const {
+        if ((kSize - 1)*stride > static_cast<size_t>(numeric_limits<int>::max())) {
+            throw std::runtime_error("stride too large");
+        }
+        IVectorType offsets;
+        for (size_t k = 0; k < kSize; ++k) {
+            offsets.intData_[k] = k*stride;
+        }
+
+        size_t i = 0;
+        for (; i + kSize <= nRows; i += kSize) {
+            FloatVectorType v = evalAVXDense(rows + i*stride, offsets);
+            storeVector(out + i, v);
+        }
+
+        size_t tail = nRows - i;
+        if (tail) {
+            // idle lanes start at the terminator and read row 0 of the group, so they never leave it
+            IVectorType current;
+            for (size_t k = 0; k < kSize; ++k) {
+                current.intData_[k] = (k < tail) ? 0 : iTerminator_;
+                if (k >= tail) {
+                    offsets.intData_[k] = 0;
+                }
+            }
+            FloatVectorType v = evalAVXDense(rows + i*stride, offsets, current);
+            storeVectorMasked(out + i, v, tail);
+        }
+    }
+
+    static inline void addVector(float* out, const float* values) {
+        _mm256_storeu_ps(out, _mm256_add_ps(_mm256_loadu_ps(out), _mm256_loadu_ps(values)));
+    }
+
+    static inline void addVector(double* out, const double* values) {
+        _mm256_storeu_pd(out, _mm256_add_pd(_mm256_loadu_pd(out), _mm256_loadu_pd(values)));
+    }
+
+    void addOutputs(FeatureType* out, int node) const {
+        const FeatureType* values = &outputs_[outputIndex_[node]];
+        size_t j = 0;
+        for (; j + kSize <= nOutputs_; j += kSize) {
+            addVector(out + j, values + j);
+        }
+        for (; j < nOutputs_; ++j) {
+            out[j] += values[j];
+        }
+    }
+
+    // all nOutputs_ outputs from one walk
+    void eval(const typename RandomForestF::Features& features, FeatureType* out) const {
+        if (nOutputs_ == 1) {
+            out[0] = eval(features);
+            return;
+        }
+        fill_n(out, nOutputs_, FeatureType(0));
+        int current = 0;
+        while (current != iTerminator_) {
+            if (isLeaf(current)) {
+                addOutputs(out, current);
+            }
+            current = goesLeft(features[column(featureIndex_[current])], featureValue_[current], featureIndex_[current]) ? leftIndex_[current] : rightIndex_[current];
+        }
+    }
+
+    // like evalAVXDense, but lanes standing on a leaf add its outputs to their own row of out (lane k
+    // at out + k*nOutputs_). That is one vector add per kSize outputs per tree, the walk is shared
+    void evalAVXDenseOutputs(const float* features0, const IVector8& offsets, IVector8 current, float* out) const {
+        __m256i done = _mm256_cmpeq_epi32(current.data_, terminator_.data_);
+        while (-1 != _mm256_movemask_epi8(done)) {
+            __m256i featureIndices = _mm256_i32gather_epi32(&featureIndex_[0], current.data_, 4);
+            __m256 featureValues = _mm256_i32gather_ps(&featureValue_[0], current.data_, 4);
+            __m256i leftIndices = _mm256_i32gather_epi32(&leftIndex_[0], current.data_, 4);
+            __m256i rightIndices = _mm256_i32gather_epi32(&rightIndex_[0], current.data_, 4);
+
+            __m256i leaves = _mm256_andnot_si256(done, _mm256_cmpeq_epi32(leftIndices, rightIndices));
+            for (int mask = _mm256_movemask_ps(_mm256_castsi256_ps(leaves)); mask; mask &= mask - 1) {
+                int k = __builtin_ctz(mask);
+                addOutputs(out + k*nOutputs_, current.intData_[k]);
+            }
+
+            __m256i featureAddresses = _mm256_add_epi32(columns(featureIndices), offsets.data_);
+            __m256 featuresHere = _mm256_i32gather_ps(features0, featureAddresses, 4);
+            __m256 goLeft = goesLeft(featuresHere, featureValues, featureIndices);
+            current.data_ = _mm256_blendv_epi8(rightIndices, leftIndices, _mm256_castps_si256(goLeft));
+            done = _mm256_cmpeq_epi32(current.data_, terminator_.data_);
+        }
+    }
+
+    void evalAVXDenseOutputs(const double* features0, const IVector4& offsets, IVector4 current, double* out) const {
+        const __m256i evenLanes = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+        __m128i done = _mm_cmpeq_epi32(current.data_, terminator_.data_);
+        while (((1 << 16) - 1) != _mm_movemask_epi8(done)) {
+            __m128i featureIndices = _mm_i32gather_epi32(&featureIndex_[0], current.data_, 4);
+            __m256d featureValues = _mm256_i32gather_pd(&featureValue_[0], current.data_, 8);
+            __m128i leftIndices = _mm_i32gather_epi32(&leftIndex_[0], current.data_, 4);
+            __m128i rightIndices = _mm_i32gather_epi32(&rightIndex_[0], current.data_, 4);
+
+            __m128i leaves = _mm_andnot_si128(done, _mm_cmpeq_epi32(leftIndices, rightIndices));
+            for (int mask = _mm_movemask_ps(_mm_castsi128_ps(leaves)); mask; mask &= mask - 1) {
+                int k = __builtin_ctz(mask);
+                addOutputs(out + k*nOutputs_, current.intData_[k]);
+            }
+
+            __m128i featureAddresses = _mm_add_epi32(columns(featureIndices), offsets.data_);
+            __m256d featuresHere = _mm256_i32gather_pd(features0, featureAddresses, 8);
+            __m256i goLeft64 = _mm256_castpd_si256(goesLeft(featuresHere, featureValues, featureIndices));
+            __m128i goLeft = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(goLeft64, evenLanes));
+            current.data_ = _mm_blendv_epi8(rightIndices, leftIndices, goLeft);
+            done = _mm_cmpeq_epi32(current.data_, terminator_.data_);
+        }
+    }
+
+    // nOutputs_ values per row, row i at out + i*nOutputs_
+    void evalBatchOutputs(const FeatureType* rows, size_t nRows, size_t stride, FeatureType* out) const {
+        if (nOutputs_ == 1) {
+            evalBatch(rows, nRows, stride, out);
+            return;
+        }
+        if ((kSize - 1)*stride > static_cast<size_t>(numeric_limits<int>::max())) {
+            throw std::runtime_error("stride too large");
+        }
+        fill_n(out, nRows*nOutputs_, FeatureType(0));
+        for (size_t i = 0; i < nRows; i += kSize) {
+            size_t n = min(kSize, nRows - i);
+            // idle lanes of a short group start at the terminator and read row 0 of the group
+            IVectorType offsets;
+            IVectorType current;
+            for (size_t k = 0; k < kSize; ++k) {
+                offsets.intData_[k] = (k < n) ? k*stride : 0;
+                current.intData_[k] = (k < n) ? 0 : iTerminator_;
+            }
+            evalAVXDenseOutputs(rows + i*stride, offsets, current, out + i*nOutputs_);
+        }
+    }
+
+    // columns past the last one a split tests are never read
+    size_t featureWidth() const {
+        size_t width = 0;
+        for (size_t i = 0; i < featureIndex_.size(); ++i) {
+            if (static_cast<int>(i) != iTerminator_ && !isLeaf(i)) {
+                width = max<size_t>(width, column(featureIndex_[i]) + 1);
+            }
+        }
+        return width;
+    }
+
+    // dense rows for kSize sparse rows at a time, only as wide as the model reads. Rows are scattered in
+    // and the same entries are zeroed afterwards, so a row costs O(non-zeros) on top of the tree walk.
+    // One per thread, it is only valid for the model it was made for
+    struct CsrScratch {
+        size_t width_;
+        vector<FeatureType> values_;
+
+        CsrScratch(const FlatForest& forest)
+            : width_(max<size_t>(1, forest.featureWidth()))
+            , values_(kSize*width_)
+        {
+        }
+
+        FeatureType* scatter(size_t lane, const CsrRows<FeatureType>& rows, size_t i) {
+            FeatureType* dense = &values_[lane*width_];
+            for (size_t k = rows.offsets_[i]; k < rows.offsets_[i + 1]; ++k) {
+                if (static_cast<size_t>(rows.indices_[k]) < width_) {
+                    dense[rows.indices_[k]] = rows.values_[k];
+                }
+            }
+            return dense;
+        }
+
+        void clear(size_t lane, const CsrRows<FeatureType>& rows, size_t i) {
+            FeatureType* dense = &values_[lane*width_];
+            for (size_t k = rows.offsets_[i]; k < rows.offsets_[i + 1]; ++k) {
+                if (static_cast<size_t>(rows.indices_[k]) < width_) {
+                    dense[rows.indices_[k]] = 0;
+                }
+            }
+        }
+    };
+
+    FeatureType evalCsr(const CsrRows<FeatureType>& rows, size_t i, CsrScratch& scratch) const {
+        const FeatureType* features = scratch.scatter(0, rows, i);
+        int current = 0;
+        FeatureType result = 0.f;
+        while (current != iTerminator_) {
+            result += nodeValue_[current];
+            current = goesLeft(features[column(featureIndex_[current])], featureValue_[current], featureIndex_[current]) ? leftIndex_[current] : rightIndex_[current];
+        }
+        scratch.clear(0, rows, i);
+        return result;
+    }
+
+    void evalBatchCsr(const CsrRows<FeatureType>& rows, FeatureType* out, CsrScratch& scratch) const {
+        if ((kSize - 1)*scratch.width_ > static_cast<size_t>(numeric_limits<int>::max())) {
+            throw std::runtime_error("too many features");
+        }
+        IVectorType offsets;
+        for (size_t k = 0; k < kSize; ++k) {
+            offsets.intData_[k] = k*scratch.width_;
+        }
+        for (size_t i = 0; i < rows.nRows_; i += kSize) {
+            size_t n = min(kSize, rows.nRows_ - i);
+            // idle lanes of a short group start at the terminator and read an all-zero row
+            IVectorType current;
+            for (size_t k = 0; k < kSize; ++k) {
+                current.intData_[k] = (k < n) ? 0 : iTerminator_;
+            }
+            for (size_t k = 0; k < n; ++k) {
+                scratch.scatter(k, rows, i + k);
+            }
+            FloatVectorType v = evalAVXDense(&scratch.values_[0], offsets, current);
+            for (size_t k = 0; k < n; ++k) {
+                scratch.clear(k, rows, i + k);
+            }
+            storeVectorMasked(out + i, v, n);
+        }
+    }
+
+    void evalBatchCsr(const CsrRows<FeatureType>& rows, FeatureType* out) const {
+        CsrScratch scratch(*this);
+        evalBatchCsr(rows, out, scratch);
+    }
+
+    static constexpr size_t kDefaultBlockBytes = 256*1024;
+    static constexpr size_t kDefaultRowsPerTile = 512;
+
+    size_t nTrees() const {
+        return treeRoots_.size() - 1;
+    }
+
+    size_t defaultTreesPerBlock() const {
+        size_t nodeBytes = 3*sizeof(int) + 2*sizeof(FeatureType);
+        size_t modelBytes = nodeValue_.size()*nodeBytes;
+        return max<size_t>(1, nTrees()*kDefaultBlockBytes/max<size_t>(modelBytes, 1));
+    }
+
+    // runs a block of trees over a tile of rows at a time so the block stays in cache, out collects partial sums
+    void evalBatchBlocked(const FeatureType* rows, size_t nRows, size_t stride, FeatureType* out,
+                          size_t treesPerBlock = 0, size_t rowsPerTile = kDefaultRowsPerTile) const {
+        if ((kSize - 1)*stride > static_cast<size_t>(numeric_limits<int>::max())) {
+            throw std::runtime_error("stride too large");
+        }
+        if (!treesPerBlock) {
+            treesPerBlock = defaultTreesPerBlock();
+        }
+        rowsPerTile = max<size_t>(rowsPerTile, 1);
+        IVectorType offsets;
+        for (size_t k = 0; k < kSize; ++k) {
+            offsets.intData_[k] = k*stride;
+        }
+
+        for (size_t tileBegin = 0; tileBegin < nRows; tileBegin += rowsPerTile) {
+            size_t tileEnd = min(nRows, tileBegin + rowsPerTile);
+            std::fill(out + tileBegin, out + tileEnd, FeatureType(0));
+            for (size_t blockBegin = 0; blockBegin < nTrees(); blockBegin += treesPerBlock) {
+                size_t blockEnd = min(nTrees(), blockBegin + treesPerBlock);
+                IVectorType start;
+                IVectorType stop;
+                start.data_ = InitVector<typename IVectorType::AVXType>(treeRoots_[blockBegin]);
+                stop.data_ = InitVector<typename IVectorType::AVXType>(treeRoots_[blockEnd]);
+
+                size_t i = tileBegin;
+                for (; i + kSize <= tileEnd; i += kSize) {
+                    FloatVectorType v = evalAVXDenseRange(rows + i*stride, offsets, start, stop);
+                    accumulateVector(out + i, v);
+                }
+                size_t tail = tileEnd - i;
+                if (tail) {
+                    IVectorType tailStart = start;
+                    IVectorType tailOffsets = offsets;
+                    for (size_t k = tail; k < kSize; ++k) {
+                        tailStart.intData_[k] = treeRoots_[blockEnd];
+                        tailOffsets.intData_[k] = 0;
+                    }
+                    FloatVectorType v = evalAVXDenseRange(rows + i*stride, tailOffsets, tailStart, stop);
+                    for (size_t k = 0; k < tail; ++k) {
+                        out[i + k] += v.floatData_[k];
+                    }
+                }
+            }
+        }
+    }
+
+    // lanes stop at the root of the tree after the block; unlike the terminator that root does not loop
+    // onto itself, so finished lanes are frozen and stop accumulating
+    FloatVector evalAVXDenseRange(const float* features0, const IVector8& offsets, IVector8 current, const IVector8& stop) const {
+        FloatVector result;
+        result.data_ = _mm256_set1_ps(0.f);
+
+        __m256i finished = _mm256_cmpeq_epi32(current.data_, stop.data_);
+        while (-1 != _mm256_movemask_epi8(finished)) {
+            __m256 nodeValues = _mm256_i32gather_ps(&nodeValue_[0], current.data_, 4);
+            result.data_ = _mm256_add_ps(result.data_, _mm256_andnot_ps(_mm256_castsi256_ps(finished), nodeValues));
+
+            __m256i featureIndices = _mm256_i32gather_epi32(&featureIndex_[0], current.data_, 4);
+            __m256 featureValues = _mm256_i32gather_ps(&featureValue_[0], current.data_, 4);
+            __m256i leftIndices = _mm256_i32gather_epi32(&leftIndex_[0], current.data_, 4);
+            __m256i rightIndices = _mm256_i32gather_epi32(&rightIndex_[0], current.data_, 4);
+
+            __m256i featureAddresses = _mm256_add_epi32(columns(featureIndices), offsets.data_);
+            __m256 featuresHere = _mm256_i32gather_ps(features0, featureAddresses, 4);
+
+            __m256 goLeft = goesLeft(featuresHere, featureValues, featureIndices);
+            __m256i next = _mm256_blendv_epi8(rightIndices, leftIndices, _mm256_castps_si256(goLeft));
+            current.data_ = _mm256_blendv_epi8(next, current.data_, finished);
+            finished = _mm256_cmpeq_epi32(current.data_, stop.data_);
+        }
+        return result;
+    }
+
+    DoubleVector evalAVXDenseRange(const double* features0, const IVector4& offsets, IVector4 current, const IVector4& stop) const {
+        const __m256i evenLanes = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+        DoubleVector result;
+        result.data_ = _mm256_set1_pd(0.);
+
+        __m128i finished = _mm_cmpeq_epi32(current.data_, stop.data_);
+        while (((1 << 16) - 1) != _mm_movemask_epi8(finished)) {
+            __m256d nodeValues = _mm256_i32gather_pd(&nodeValue_[0], current.data_, 8);
+            __m256d finished64 = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(finished));
+            result.data_ = _mm256_add_pd(result.data_, _mm256_andnot_pd(finished64, nodeValues));
+
+            __m128i featureIndices = _mm_i32gather_epi32(&featureIndex_[0], current.data_, 4);
+            __m256d featureValues = _mm256_i32gather_pd(&featureValue_[0], current.data_, 8);
+            __m128i leftIndices = _mm_i32gather_epi32(&leftIndex_[0], current.data_, 4);
+            __m128i rightIndices = _mm_i32gather_epi32(&rightIndex_[0], current.data_, 4);
+
+            __m128i featureAddresses = _mm_add_epi32(columns(featureIndices), offsets.data_);
+            __m256d featuresHere = _mm256_i32gather_pd(features0, featureAddresses, 8);
+
+            __m256i goLeft64 = _mm256_castpd_si256(goesLeft(featuresHere, featureValues, featureIndices));
+            __m128i goLeft = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(goLeft64, evenLanes));
+            __m128i next = _mm_blendv_epi8(rightIndices, leftIndices, goLeft);
+            current.data_ = _mm_blendv_epi8(next, current.data_, finished);
+            finished = _mm_cmpeq_epi32(current.data_, stop.data_);
+        }
+        return result;
+    }
+
+    static inline void accumulateVector(float* out, const FloatVector& v) {
+        _mm256_storeu_ps(out, _mm256_add_ps(_mm256_loadu_ps(out), v.data_));
+    }
+
+    static inline void accumulateVector(double* out, const DoubleVector& v) {
+        _mm256_storeu_pd(out, _mm256_add_pd(_mm256_loadu_pd(out), v.data_));
+    }
+
+    // keeps kGroups independent SIMD groups in flight so their gathers overlap, rows that do not fill
+    // a whole set of groups go through evalBatch. The other groups' gathers already cover the latency;
+    // software prefetches of the next nodes (or of both children) measured slower than plain x4
+    template<size_t kGroups>
+    void evalBatchInterleaved(const FeatureType* rows, size_t nRows, size_t stride, FeatureType* out) const {
+        if ((kGroups*kSize - 1)*stride > static_cast<size_t>(numeric_limits<int>::max())) {
+            throw std::runtime_error("stride too large");
+        }
+        IVectorType offsets[kGroups];
+        for (size_t g = 0; g < kGroups; ++g) {
+            for (size_t k = 0; k < kSize; ++k) {
+                offsets[g].intData_[k] = (g*kSize + k)*stride;
+            }
+        }
+
+        size_t i = 0;
+        for (; i + kGroups*kSize <= nRows; i += kGroups*kSize) {
+            FloatVectorType results[kGroups];
+            evalAVXDenseInterleaved<kGroups>(rows + i*stride, offsets, results);
+            for (size_t g = 0; g < kGroups; ++g) {
+                storeVector(out + i + g*kSize, results[g]);
+            }
+        }
+        if (i < nRows) {
+            evalBatch(rows + i*stride, nRows - i, stride, out + i);
+        }
+    }
+
+    template<size_t kGroups>
+    void evalAVXDenseInterleaved(const float* features0, const IVector8 (&offsets)[kGroups], FloatVector (&results)[kGroups]) const {
+        IVector8 current[kGroups];
+        for (size_t g = 0; g < kGroups; ++g) {
+            current[g].data_ = _mm256_set1_epi32(0);
+            results[g].data_ = _mm256_set1_ps(0.f);
+        }
+
+        while (true) {
+            __m256i finished = _mm256_cmpeq_epi32(current[0].data_, terminator_.data_);
+            for (size_t g = 1; g < kGroups; ++g) {
+                finished = _mm256_and_si256(finished, _mm256_cmpeq_epi32(current[g].data_, terminator_.data_));
+            }
+            if (-1 == _mm256_movemask_epi8(finished)) {
+                break;
+            }
+
+            for (size_t g = 0; g < kGroups; ++g) {
+                __m256 nodeValues = _mm256_i32gather_ps(&nodeValue_[0], current[g].data_, 4);
+                results[g].data_ = _mm256_add_ps(results[g].data_, nodeValues);
+
+                __m256i featureIndices = _mm256_i32gather_epi32(&featureIndex_[0], current[g].data_, 4);
+                __m256 featureValues = _mm256_i32gather_ps(&featureValue_[0], current[g].data_, 4);
+                __m256i leftIndices = _mm256_i32gather_epi32(&leftIndex_[0], current[g].data_, 4);
+                __m256i rightIndices = _mm256_i32gather_epi32(&rightIndex_[0], current[g].data_, 4);
+
+                __m256i featureAddresses = _mm256_add_epi32(columns(featureIndices), offsets[g].data_);
+                __m256 featuresHere = _mm256_i32gather_ps(features0, featureAddresses, 4);
+
+                __m256 goLeft = goesLeft(featuresHere, featureValues, featureIndices);
+                current[g].data_ = _mm256_blendv_epi8(rightIndices, leftIndices, _mm256_castps_si256(goLeft));
+            }
+        }
+    }
+
+    template<size_t kGroups>
+    void evalAVXDenseInterleaved(const double* features0, const IVector4 (&offsets)[kGroups], DoubleVector (&results)[kGroups]) const {
+        IVector4 current[kGroups];
+        for (size_t g = 0; g < kGroups; ++g) {
+            current[g].data_ = _mm_set1_epi32(0);
+            results[g].data_ = _mm256_set1_pd(0.);
+        }
+
+        while (true) {
+            __m128i finished = _mm_cmpeq_epi32(current[0].data_, terminator_.data_);
+            for (size_t g = 1; g < kGroups; ++g) {
+                finished = _mm_and_si128(finished, _mm_cmpeq_epi32(current[g].data_, terminator_.data_));
+            }
+            if (((1 << 16) - 1) == _mm_movemask_epi8(finished)) {
+                break;
+            }
+
+            for (size_t g = 0; g < kGroups; ++g) {
+                __m256d nodeValues = _mm256_i32gather_pd(&nodeValue_[0], current[g].data_, 8);
+                results[g].data_ = _mm256_add_pd(results[g].data_, nodeValues);
+
+                __m128i featureIndices = _mm_i32gather_epi32(&featureIndex_[0], current[g].data_, 4);
+                __m256d featureValues = _mm256_i32gather_pd(&featureValue_[0], current[g].data_, 8);
+                __m128i leftIndices = _mm_i32gather_epi32(&leftIndex_[0], current[g].data_, 4);
+                __m128i rightIndices = _mm_i32gather_epi32(&rightIndex_[0], current[g].data_, 4);
+
+                __m128i featureAddresses = _mm_add_epi32(columns(featureIndices), offsets[g].data_);
+                __m256d featuresHere = _mm256_i32gather_pd(features0, featureAddresses, 8);
+
+                __m256i goLeft64 = _mm256_castpd_si256(goesLeft(featuresHere, featureValues, featureIndices));
+                __m128i goLeft = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(goLeft64, _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6)));
+                current[g].data_ = _mm_blendv_epi8(rightIndices, leftIndices, goLeft);
+            }
+        }
+    }
+
+    // lanes that reach the terminator write their row out and pick up the next pending row
+    void evalBatchStreaming(const FeatureType* rows, size_t nRows, size_t stride, FeatureType* out) const {
+        if ((kSize - 1)*stride > static_cast<size_t>(numeric_limits<int>::max())) {
+            throw std::runtime_error("stride too large");
+        }
+        size_t chunk = max<size_t>(kSize, numeric_limits<int>::max()/max<size_t>(stride, 1));
+        for (size_t begin = 0; begin < nRows; begin += chunk) {
+            evalStreamingChunk(rows + begin*stride, min(chunk, nRows - begin), stride, out + begin);
+        }
+    }
+
+    static constexpr size_t kNoRow = numeric_limits<size_t>::max();
+
+    void evalStreamingChunk(const float* rows, size_t nRows, size_t stride, float* out) const {
+        IVector8 current;
+        IVector8 offsets;
+        FloatVector result;
+        result.data_ = _mm256_set1_ps(0.f);
+        size_t laneRows[8];
+        size_t next = 0;
+        size_t nBusy = 0;
+        for (size_t k = 0; k < 8; ++k) {
+            if (next < nRows) {
+                current.intData_[k] = 0;
+                offsets.intData_[k] = next*stride;
+                laneRows[k] = next++;
+                ++nBusy;
+            } else {
+                current.intData_[k] = iTerminator_;
+                offsets.intData_[k] = 0;
+                laneRows[k] = kNoRow;
+            }
+        }
+
+        FloatVector nodeValues;
+        IVector8 featureIndices;
+        FloatVector featureValues;
+        IVector8 leftIndices;
+        IVector8 rightIndices;
+        FloatVector featuresHere;
+        IVector8 featureAddresses;
+
+        while (nBusy) {
+            int finished = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(current.data_, terminator_.data_)));
+            if (finished) {
+                for (size_t k = 0; k < 8; ++k) {
+                    if (!(finished & (1 << k)) || kNoRow == laneRows[k]) {
+                        continue;
+                    }
+                    out[laneRows[k]] = result.floatData_[k];
+                    result.floatData_[k] = 0.f;
+                    if (next < nRows) {
+                        current.intData_[k] = 0;
+                        offsets.intData_[k] = next*stride;
+                        laneRows[k] = next++;
+                    } else {
+                        offsets.intData_[k] = 0;
+                        laneRows[k] = kNoRow;
+                        --nBusy;
+                    }
+                }
+            }
+
+            nodeValues.data_ = _mm256_i32gather_ps(&nodeValue_[0], current.data_, 4);
+            result.data_ = _mm256_add_ps(result.data_, nodeValues.data_);
+
+            featureIndices.data_ = _mm256_i32gather_epi32(&featureIndex_[0], current.data_, 4);
+            featureValues.data_ = _mm256_i32gather_ps(&featureValue_[0], current.data_, 4);
+            leftIndices.data_ = _mm256_i32gather_epi32(&leftIndex_[0], current.data_, 4);
+            rightIndices.data_ = _mm256_i32gather_epi32(&rightIndex_[0], current.data_, 4);
+
+            featureAddresses.data_ = _mm256_add_epi32(columns(featureIndices.data_), offsets.data_);
+            featuresHere.data_ = _mm256_i32gather_ps(rows, featureAddresses.data_, 4);
+
+            __m256 goLeft = goesLeft(featuresHere.data_, featureValues.data_, featureIndices.data_);
+            current.data_ = _mm256_blendv_epi8(rightIndices.data_, leftIndices.data_, _mm256_castps_si256(goLeft));
+        }
+    }
+
+    void evalStreamingChunk(const double* rows, size_t nRows, size_t stride, double* out) const {
+        IVector4 current;
+        IVector4 offsets;
+        DoubleVector result;
+        result.data_ = _mm256_set1_pd(0.);
+        size_t laneRows[4];
+        size_t next = 0;
+        size_t nBusy = 0;
+        for (size_t k = 0; k < 4; ++k) {
+            if (next < nRows) {
+                current.intData_[k] = 0;
+                offsets.intData_[k] = next*stride;
+                laneRows[k] = next++;
+                ++nBusy;
+            } else {
+                current.intData_[k] = iTerminator_;
+                offsets.intData_[k] = 0;
+                laneRows[k] = kNoRow;
+            }
+        }
+
+        DoubleVector nodeValues;
+        IVector4 featureIndices;
+        DoubleVector featureValues;
+        IVector4 leftIndices;
+        IVector4 rightIndices;
+        DoubleVector featuresHere;
+        IVector4 featureAddresses;
+
+        while (nBusy) {
+            int finished = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(current.data_, terminator_.data_)));
+            if (finished) {
+                for (size_t k = 0; k < 4; ++k) {
+                    if (!(finished & (1 << k)) || kNoRow == laneRows[k]) {
+                        continue;
+                    }
+                    out[laneRows[k]] = result.floatData_[k];
+                    result.floatData_[k] = 0.;
+                    if (next < nRows) {
+                        current.intData_[k] = 0;
+                        offsets.intData_[k] = next*stride;
+                        laneRows[k] = next++;
+                    } else {
+                        offsets.intData_[k] = 0;
+                        laneRows[k] = kNoRow;
+                        --nBusy;
+                    }
+                }
+            }
+
+            nodeValues.data_ = _mm256_i32gather_pd(&nodeValue_[0], current.data_, 8);
+            result.data_ = _mm256_add_pd(result.data_, nodeValues.data_);
+
+            featureIndices.data_ = _mm_i32gather_epi32(&featureIndex_[0], current.data_, 4);
+            featureValues.data_ = _mm256_i32gather_pd(&featureValue_[0], current.data_, 8);
+            leftIndices.data_ = _mm_i32gather_epi32(&leftIndex_[0], current.data_, 4);
+            rightIndices.data_ = _mm_i32gather_epi32(&rightIndex_[0], current.data_, 4);
+
+            featureAddresses.data_ = _mm_add_epi32(columns(featureIndices.data_), offsets.data_);
+            featuresHere.data_ = _mm256_i32gather_pd(rows, featureAddresses.data_, 8);
+
+            __m256i goLeft64 = _mm256_castpd_si256(goesLeft(featuresHere.data_, featureValues.data_, featureIndices.data_));
+            __m128i goLeft = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(goLeft64, _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6)));
+            current.data_ = _mm_blendv_epi8(rightIndices.data_, leftIndices.data_, goLeft);
+        }
+    }
+
+    static constexpr size_t kParallelGrain = 1024;
+
+    void evalBatch(ThreadPool& pool, const FeatureType* rows, size_t nRows, size_t stride, FeatureType* out) const {
+        if ((kSize - 1)*stride > static_cast<size_t>(numeric_limits<int>::max())) {
+            throw std::runtime_error("stride too large");
+        }
+        size_t nGroups = (nRows + kSize - 1)/kSize;
+        pool.parallelFor(nGroups, kParallelGrain/kSize, [&](size_t begin, size_t end) {
+            size_t rowBegin = begin*kSize;
+            size_t rowEnd = min(nRows, end*kSize);
+            evalBatch(rows + rowBegin*stride, rowEnd - rowBegin, stride, out + rowBegin);
+        });
+    }
+
+    static inline void storeVector(float* out, const FloatVector& v) {
+        _mm256_storeu_ps(out, v.data_);
+    }
+
+    static inline void storeVector(double* out, const DoubleVector& v) {
+        _mm256_storeu_pd(out, v.data_);
+    }
+
+    static inline void storeVectorMasked(float* out, const FloatVector& v, size_t n) {
+        __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(n), lanes);
+        _mm256_maskstore_ps(out, mask, v.data_);
+    }
+
+    static inline void storeVectorMasked(double* out, const DoubleVector& v, size_t n) {
+        __m256i lanes = _mm256_setr_epi64x(0, 1, 2, 3);
+        __m256i mask = _mm256_cmpgt_epi64(_mm256_set1_epi64x(n), lanes);
+        _mm256_maskstore_pd(out, mask, v.data_);
+    }
+
+    // terminator_ needs 32-byte alignment, which plain new does not promise before C++17
+    static void* operator new(size_t size) throw()
+    {
+        void* mem = malloc(size + 32 + sizeof(void*));
+        if (!mem) {
+            return nullptr;
+        }
+        char* alignedMem = reinterpret_cast<char*>(mem) + sizeof(void*);
+        size_t sMem = reinterpret_cast<size_t>(alignedMem);
+        if (sMem % 32) {
+            alignedMem += 32 - (sMem % 32);
+        }
+        *(reinterpret_cast<void**>(alignedMem - sizeof(void*))) = mem;
+
+        return alignedMem;
+    }
+
+    static void operator delete(void* ptr) throw()
+    {
+        if (!ptr) {
+            return;
+        }
+        void** mem = reinterpret_cast<void**>(reinterpret_cast<char*>(ptr) - sizeof(void*));
+
+        free(*mem);
+    }
+
+    static void* operator new(std::size_t, void *) throw() = delete;
+    static void operator delete (void *, void *) throw() = delete;
+};
+
+// one record per node, left child is implicit (pre-order puts it right after its parent)
+template<typename FeatureType>
+struct PackedNode {
+    int featureIndex_;
+    int rightIndex_;
+    FeatureType featureValue_;
+    FeatureType nodeValue_;
+} __attribute__((aligned(4*sizeof(FeatureType))));
+
+template<typename FeatureType>
+struct PackedFlatForest {
+    using RandomForestF = RandomForest<FeatureType>;
+    using Traits = AVXTraits<FeatureType>;
+    using IVectorType = typename Traits::IVectorType;
+    using FloatVectorType = typename Traits::FloatVectorType;
+    static constexpr size_t kSize = Traits::kSize;
+
+    int iTerminator_;
+    vector<PackedNode<FeatureType>> nodes_;
+
+    PackedFlatForest(const RandomForestF& f) {
+        if (!f.isPreorder()) {
+            throw std::runtime_error("tree is not in pre-order");
+        }
+        if (f.hasMissingLeft()) {
+            throw std::runtime_error("missing-value directions need FlatForest");
+        }
+        iTerminator_ = f.nodes_.size();
+        nodes_.resize(iTerminator_ + 1);
+
+        fill(f);
+        nodes_[iTerminator_].featureIndex_ = 0;
+        nodes_[iTerminator_].rightIndex_ = iTerminator_;
+        nodes_[iTerminator_].featureValue_ = -numeric_limits<FeatureType>::infinity();
+        nodes_[iTerminator_].nodeValue_ = 0;
+    }
+
+    // leaves never go left: nothing, -inf and NaN included, is below a -inf threshold and the right child
+    // is the next tree
+    void fill(const RandomForestF& f) {
+        for (size_t iTree = 0; iTree < f.nTrees(); ++iTree) {
+            int nextIndex = f.treeEnd(iTree);
+            for (int i = f.roots_[iTree]; i < nextIndex; ++i) {
+                const auto& node = f.nodes_[i];
+                PackedNode<FeatureType>& packed = nodes_[i];
+                if (!node.isLeaf_) {
+                    packed.featureIndex_ = node.featureIndex_;
+                    packed.rightIndex_ = node.right_;
+                    packed.featureValue_ = node.featureValue_;
+                    packed.nodeValue_ = 0;
+                } else {
+                    packed.featureIndex_ = 0;
+                    packed.rightIndex_ = nextIndex;
+                    packed.featureValue_ = -numeric_limits<FeatureType>::infinity();
+                    packed.nodeValue_ = node.leafValue_;
+                }
+            }
+        }
+    }
+
+    FeatureType eval(const typename RandomForestF::Features& features) const {
+        int begin = 0;
+        FeatureType result = 0.f;
+        while (begin != iTerminator_) {
+            const PackedNode<FeatureType>& node = nodes_[begin];
+            result += node.nodeValue_;
+            if (features[node.featureIndex_] < node.featureValue_) {
+                ++begin;
+            } else {
+                begin = node.rightIndex_;
+            }
+        }
+        return result;
+    }
+
+    // one 16 byte load per lane and step, transposed into index/right/threshold/value vectors
+    FloatVector evalAVXDense(const float* features0, const IVector8& offsets, IVector8 current) const {
+        const __m256i terminator = _mm256_set1_epi32(iTerminator_);
+        const __m256i one = _mm256_set1_epi32(1);
+        FloatVector result;
+        result.data_ = _mm256_set1_ps(0.f);
+
+        while (-1 != _mm256_movemask_epi8(_mm256_cmpeq_epi32(current.data_, terminator))) {
+            __m128 r[8];
+            for (size_t k = 0; k < 8; ++k) {
+                r[k] = _mm_loadu_ps(reinterpret_cast<const float*>(&nodes_[current.intData_[k]]));
+            }
+            __m256 a0 = _mm256_insertf128_ps(_mm256_castps128_ps256(r[0]), r[4], 1);
+            __m256 a1 = _mm256_insertf128_ps(_mm256_castps128_ps256(r[1]), r[5], 1);
+            __m256 a2 = _mm256_insertf128_ps(_mm256_castps128_ps256(r[2]), r[6], 1);
+            __m256 a3 = _mm256_insertf128_ps(_mm256_castps128_ps256(r[3]), r[7], 1);
+            __m256 t0 = _mm256_unpacklo_ps(a0, a1);
+            __m256 t1 = _mm256_unpacklo_ps(a2, a3);
+            __m256 t2 = _mm256_unpackhi_ps(a0, a1);
+            __m256 t3 = _mm256_unpackhi_ps(a2, a3);
+            __m256i featureIndices = _mm256_castps_si256(_mm256_shuffle_ps(t0, t1, 0x44));
+            __m256i rightIndices = _mm256_castps_si256(_mm256_shuffle_ps(t0, t1, 0xEE));
+            __m256 featureValues = _mm256_shuffle_ps(t2, t3, 0x44);
+            __m256 nodeValues = _mm256_shuffle_ps(t2, t3, 0xEE);
+
+            result.data_ = _mm256_add_ps(result.data_, nodeValues);
+
+            __m256i featureAddresses = _mm256_add_epi32(featureIndices, offsets.data_);
+            __m256 featuresHere = _mm256_i32gather_ps(features0, featureAddresses, 4);
+
+            __m256 goLeft = _mm256_cmp_ps(featuresHere, featureValues, _CMP_LT_OS);
+            __m256i leftIndices = _mm256_add_epi32(current.data_, one);
+            current.data_ = _mm256_blendv_epi8(rightIndices, leftIndices, _mm256_castps_si256(goLeft));
+        }
+        return result;
+    }
+
+    DoubleVector evalAVXDense(const double* features0, const IVector4& offsets, IVector4 current) const {
+        const __m128i terminator = _mm_set1_epi32(iTerminator_);
+        const __m128i one = _mm_set1_epi32(1);
+        const __m256i evenLanes = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+        const __m256i oddLanes = _mm256_setr_epi32(1, 3, 5, 7, 1, 3, 5, 7);
+        DoubleVector result;
+        result.data_ = _mm256_set1_pd(0.);
+
+        // 32 byte records, so gather whole 8 byte fields at index*4 with scale 8
+        const double* base = reinterpret_cast<const double*>(&nodes_[0]);
+        while (((1 << 16) - 1) != _mm_movemask_epi8(_mm_cmpeq_epi32(current.data_, terminator))) {
+            __m128i fields = _mm_slli_epi32(current.data_, 2);
+            __m256i indexPairs = _mm256_i32gather_epi64(reinterpret_cast<const long long*>(base), fields, 8);
+            __m256d featureValues = _mm256_i32gather_pd(base + 1, fields, 8);
+            __m256d nodeValues = _mm256_i32gather_pd(base + 2, fields, 8);
+            __m128i featureIndices = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(indexPairs, evenLanes));
+            __m128i rightIndices = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(indexPairs, oddLanes));
+
+            result.data_ = _mm256_add_pd(result.data_, nodeValues);
+
+            __m128i featureAddresses = _mm_add_epi32(featureIndices, offsets.data_);
+            __m256d featuresHere = _mm256_i32gather_pd(features0, featureAddresses, 8);
+
+            __m256i goLeft64 = _mm256_castpd_si256(_mm256_cmp_pd(featuresHere, featureValues, _CMP_LT_OS));
+            __m128i goLeft = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(goLeft64, evenLanes));
+            __m128i leftIndices = _mm_add_epi32(current.data_, one);
+            current.data_ = _mm_blendv_epi8(rightIndices, leftIndices, goLeft);
+        }
+        return result;
+    }
+
+    void evalBatch(const FeatureType* rows, size_t nRows, size_t stride, FeatureType* out) const {
+        if ((kSize - 1)*stride > static_cast<size_t>(numeric_limits<int>::max())) {
+            throw std::runtime_error("stride too large");
+        }
+        IVectorType offsets;
+        IVectorType current;
+        for (size_t k = 0; k < kSize; ++k) {
+            offsets.intData_[k] = k*stride;
+            current.intData_[k] = 0;
+        }
+
+        size_t i = 0;
+        for (; i + kSize <= nRows; i += kSize) {
+            FloatVectorType v = evalAVXDense(rows + i*stride, offsets, current);
+            FlatForest<FeatureType>::storeVector(out + i, v);
+        }
+
+        size_t tail = nRows - i;
+        if (tail) {
+            for (size_t k = tail; k < kSize; ++k) {
+                current.intData_[k] = iTerminator_;
+                offsets.intData_[k] = 0;
+            }
+            FloatVectorType v = evalAVXDense(rows + i*stride, offsets, current);
+            FlatForest<FeatureType>::storeVectorMasked(out + i, v, tail);
+        }
+    }
+};
+
+// every tree is padded to a complete binary tree of depth_ comparisons stored breadth first, children of i
+// are 2i+1 and 2i+2. Leaves above the last level are replicated into all padded leaves below them, so
+// padded nodes may go either way. Evaluation runs exactly depth_ steps per tree, no terminator needed
+template<typename FeatureType>
+struct CompleteFlatForest {
+    using RandomForestF = RandomForest<FeatureType>;
+    using Traits = AVXTraits<FeatureType>;
+    using IVectorType = typename Traits::IVectorType;
+    using FloatVectorType = typename Traits::FloatVectorType;
+    static constexpr size_t kSize = Traits::kSize;
+    static constexpr int kMaxDepth = 20;
+
+    int depth_;
+    size_t nTrees_;
+    vector<int> featureIndex_;
+    vector<FeatureType> featureValue_;
+    vector<FeatureType> leafValue_;
+
+    CompleteFlatForest(const RandomForestF& f) {
+        if (!f.isPreorder()) {
+            throw std::runtime_error("tree is not in pre-order");
+        }
+        if (f.hasMissingLeft()) {
+            throw std::runtime_error("missing-value directions need FlatForest");
+        }
+        // children come after their parent, so one backward pass sees them first
+        vector<int> depths(f.nodes_.size());
+        depth_ = 0;
+        for (size_t i = f.nodes_.size(); i-- > 0;) {
+            const auto& node = f.nodes_[i];
+            depths[i] = node.isLeaf_ ? 0 : 1 + max(depths[node.left_], depths[node.right_]);
+            depth_ = max(depth_, depths[i]);
+        }
+        if (depth_ > kMaxDepth) {
+            throw std::runtime_error("tree is too deep for the complete layout");
+        }
+        nTrees_ = f.nTrees();
+        featureIndex_.resize(nTrees_*nInternal());
+        featureValue_.resize(nTrees_*nInternal());
+        leafValue_.resize(nTrees_*nLeaves());
+        vector<typename RandomForestF::NodeIndex> level;
+        vector<typename RandomForestF::NodeIndex> next;
+        for (size_t iTree = 0; iTree < nTrees_; ++iTree) {
+            fill(f, iTree, level, next);
+        }
+    }
+
+    size_t nInternal() const {
+        return (size_t(1) << depth_) - 1;
+    }
+
+    size_t nLeaves() const {
+        return size_t(1) << depth_;
+    }
+
+    // level by level: position p of a level holds the arena node that lands there. A leaf above the
+    // last level is repeated down both sides, so its padded nodes reach the same leaf whichever way the
+    // placeholder threshold sends a value
+    void fill(const RandomForestF& f, size_t iTree, vector<typename RandomForestF::NodeIndex>& level,
+              vector<typename RandomForestF::NodeIndex>& next) {
+        level.assign(1, f.roots_[iTree]);
+        for (int l = 0; l < depth_; ++l) {
+            size_t first = iTree*nInternal() + (size_t(1) << l) - 1;
+            next.resize(2*level.size());
+            for (size_t p = 0; p < level.size(); ++p) {
+                const auto& node = f.nodes_[level[p]];
+                if (node.isLeaf_) {
+                    featureIndex_[first + p] = 0;
+                    featureValue_[first + p] = numeric_limits<FeatureType>::max();
+                    next[2*p] = level[p];
+                    next[2*p + 1] = level[p];
+                } else {
+                    featureIndex_[first + p] = node.featureIndex_;
+                    featureValue_[first + p] = node.featureValue_;
+                    next[2*p] = node.left_;
+                    next[2*p + 1] = node.right_;
+                }
+            }
+            level.swap(next);
+        }
+        for (size_t p = 0; p < level.size(); ++p) {
+            leafValue_[iTree*nLeaves() + p] = f.nodes_[level[p]].leafValue_;
+        }
+    }
+
+    FeatureType eval(const typename RandomForestF::Features& features) const {
+        FeatureType result = 0.f;
+        for (size_t iTree = 0; iTree < nTrees_; ++iTree) {
+            const int* featureIndex = &featureIndex_[iTree*nInternal()];
+            const FeatureType* featureValue = &featureValue_[iTree*nInternal()];
+            size_t position = 0;
+            for (int level = 0; level < depth_; ++level) {
+                position = 2*position + ((features[featureIndex[position]] < featureValue[position]) ? 1 : 2);
+            }
+            result += leafValue_[iTree*nLeaves() + position - nInternal()];
+        }
+        return result;
+    }
+
+    // position = 2*position + 2 + goLeft, the compare mask is -1 when going left
+    template<int kDepth>
+    FloatVector evalAVXDense(const float* features0, const IVector8& offsets) const {
+        const int nInternal = (1 << kDepth) - 1;
+        const __m256i two = _mm256_set1_epi32(2);
+        FloatVector result;
+        result.data_ = _mm256_set1_ps(0.f);
+        const int* featureIndex = &featureIndex_[0];
+        const float* featureValue = &featureValue_[0];
+        const float* leafValue = &leafValue_[0];
+
+        for (size_t iTree = 0; iTree < nTrees_; ++iTree) {
+            __m256i position = _mm256_setzero_si256();
+            for (int level = 0; level < kDepth; ++level) {
+                __m256i featureIndices = _mm256_i32gather_epi32(featureIndex, position, 4);
+                __m256 featureValues = _mm256_i32gather_ps(featureValue, position, 4);
+                __m256 featuresHere = _mm256_i32gather_ps(features0, _mm256_add_epi32(featureIndices, offsets.data_), 4);
+                __m256i goLeft = _mm256_castps_si256(_mm256_cmp_ps(featuresHere, featureValues, _CMP_LT_OS));
+                position = _mm256_add_epi32(_mm256_add_epi32(_mm256_add_epi32(position, position), two), goLeft);
+            }
+            __m256i leaf = _mm256_sub_epi32(position, _mm256_set1_epi32(nInternal));
+            result.data_ = _mm256_add_ps(result.data_, _mm256_i32gather_ps(leafValue, leaf, 4));
+
+            featureIndex += nInternal;
+            featureValue += nInternal;
+            leafValue += nInternal + 1;
+        }
+        return result;
+    }
+
+    template<int kDepth>
+    DoubleVector evalAVXDense(const double* features0, const IVector4& offsets) const {
+        const int nInternal = (1 << kDepth) - 1;
+        const __m128i two = _mm_set1_epi32(2);
+        const __m256i evenLanes = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+        DoubleVector result;
+        result.data_ = _mm256_set1_pd(0.);
+        const int* featureIndex = &featureIndex_[0];
+        const double* featureValue = &featureValue_[0];
+        const double* leafValue = &leafValue_[0];
+
+        for (size_t iTree = 0; iTree < nTrees_; ++iTree) {
+            __m128i position = _mm_setzero_si128();
+            for (int level = 0; level < kDepth; ++level) {
+                __m128i featureIndices = _mm_i32gather_epi32(featureIndex, position, 4);
+                __m256d featureValues = _mm256_i32gather_pd(featureValue, position, 8);
+                __m256d featuresHere = _mm256_i32gather_pd(features0, _mm_add_epi32(featureIndices, offsets.data_), 8);
+                __m256i goLeft64 = _mm256_castpd_si256(_mm256_cmp_pd(featuresHere, featureValues, _CMP_LT_OS));
+                __m128i goLeft = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(goLeft64, evenLanes));
+                position = _mm_add_epi32(_mm_add_epi32(_mm_add_epi32(position, position), two), goLeft);
+            }
+            __m128i leaf = _mm_sub_epi32(position, _mm_set1_epi32(nInternal));
+            result.data_ = _mm256_add_pd(result.data_, _mm256_i32gather_pd(leafValue, leaf, 8));
+
+            featureIndex += nInternal;
+            featureValue += nInternal;
+            leafValue += nInternal + 1;
+        }
+        return result;
+    }
+
+    template<int kDepth>
+    void evalBatch(const FeatureType* rows, size_t nRows, size_t stride, FeatureType* out) const {
+        IVectorType offsets;
+        for (size_t k = 0; k < kSize; ++k) {
+            offsets.intData_[k] = k*stride;
+        }
+
+        size_t i = 0;
+        for (; i + kSize <= nRows; i += kSize) {
+            FloatVectorType v = evalAVXDense<kDepth>(rows + i*stride, offsets);
+            FlatForest<FeatureType>::storeVector(out + i, v);
+        }
+
+        size_t tail = nRows - i;
+        if (tail) {
+            // idle lanes read row 0 of the group, their results are not stored
+            for (size_t k = tail; k < kSize; ++k) {
+                offsets.intData_[k] = 0;
+            }
+            FloatVectorType v = evalAVXDense<kDepth>(rows + i*stride, offsets);
+            FlatForest<FeatureType>::storeVectorMasked(out + i, v, tail);
+        }
+    }
+
+    template<int kDepth>
+    void evalBatchUpTo(const FeatureType* rows, size_t nRows, size_t stride, FeatureType* out) const {
+        if (kDepth == depth_) {
+            evalBatch<kDepth>(rows, nRows, stride, out);
+        } else {
+            evalBatchUpTo<(kDepth < kMaxDepth) ? kDepth + 1 : kMaxDepth>(rows, nRows, stride, out);
+        }
+    }
+
+    void evalBatch(const FeatureType* rows, size_t nRows, size_t stride, FeatureType* out) const {
+        if ((kSize - 1)*stride > static_cast<size_t>(numeric_limits<int>::max())) {
+            throw std::runtime_error("stride too large");
+        }
+        evalBatchUpTo<0>(rows, nRows, stride, out);
+    }
+};
+
+// sums node values for 8 lanes, double needs two registers
+template<typename FeatureType>
+struct Accumulator8;
+
+template<>
+struct Accumulator8<float> {
+    __m256 sum_ = _mm256_setzero_ps();
+
+    void add(const float* values, __m256i indices) {
+        sum_ = _mm256_add_ps(sum_, _mm256_i32gather_ps(values, indices, 4));
+    }
+
+    void store(float* out, size_t n) const {
+        __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(n), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        _mm256_maskstore_ps(out, mask, sum_);
+    }
+};
+
+template<>
+struct Accumulator8<double> {
+    __m256d low_ = _mm256_setzero_pd();
+    __m256d high_ = _mm256_setzero_pd();
+
+    void add(const double* values, __m256i indices) {
+        low_ = _mm256_add_pd(low_, _mm256_i32gather_pd(values, _mm256_castsi256_si128(indices), 8));
+        high_ = _mm256_add_pd(high_, _mm256_i32gather_pd(values, _mm256_extracti128_si256(indices, 1), 8));
+    }
+
+    void store(double* out, size_t n) const {
+        __m256i lanes = _mm256_setr_epi64x(0, 1, 2, 3);
+        _mm256_maskstore_pd(out, _mm256_cmpgt_epi64(_mm256_set1_epi64x(n), lanes), low_);
+        if (n > 4) {
+            _mm256_maskstore_pd(out + 4, _mm256_cmpgt_epi64(_mm256_set1_epi64x(n - 4), lanes), high_);
+        }
+    }
+};
+
+// thresholds become bin ids over the sorted distinct thresholds of their feature and rows are binned once
+// per request. bin(x) counts the edges <= x, so x < edge[j] iff bin(x) < j + 1, NaN lands in the last bin
+// and still goes right. Feature index and threshold bin share one 32 bit word, the left child is implicit
+// (pre-order), so a step is three node gathers and one bin gather. Node indices stay 32 bit for the AVX2
+// gathers, so lanes are 8 wide for both float and double models
+template<typename FeatureType, typename BinType>
+struct QuantizedFlatForest {
+    using RandomForestF = RandomForest<FeatureType>;
+    static constexpr size_t kSize = 8;
+    static constexpr int kBinBits = 8*sizeof(BinType);
+    static constexpr int kBinMask = (1 << kBinBits) - 1;
+    // bins are gathered as 32 bit words, rows are padded so the last one can be read whole
+    static constexpr size_t kRowPadding = sizeof(int);
+
+    size_t nFeatures_;
+    vector<vector<FeatureType>> edges_;
+    int iTerminator_;
+    vector<int> split_;
+    vector<int> rightIndex_;
+    vector<FeatureType> nodeValue_;
+
+    QuantizedFlatForest(const RandomForestF& f) {
+        if (!f.isPreorder()) {
+            throw std::runtime_error("tree is not in pre-order");
+        }
+        if (f.hasMissingLeft()) {
+            throw std::runtime_error("missing-value directions need FlatForest");
+        }
+        nFeatures_ = 0;
+        for (const auto& node: f.nodes_) {
+            if (!node.isLeaf_) {
+                if (static_cast<size_t>(node.featureIndex_) >= nFeatures_) {
+                    nFeatures_ = node.featureIndex_ + 1;
+                    edges_.resize(nFeatures_);
+                }
+                edges_[node.featureIndex_].push_back(node.featureValue_);
+            }
+        }
+        if (nFeatures_ && ((nFeatures_ - 1) >> (31 - kBinBits))) {
+            throw std::runtime_error("too many features for the bin width");
+        }
+        for (auto& edges: edges_) {
+            sort(edges.begin(), edges.end());
+            edges.erase(unique(edges.begin(), edges.end()), edges.end());
+            if (edges.size() > static_cast<size_t>(kBinMask)) {
+                throw std::runtime_error("too many distinct thresholds for the bin width");
+            }
+        }
+
+        iTerminator_ = f.nodes_.size();
+        split_.resize(iTerminator_ + 1);
+        rightIndex_.resize(iTerminator_ + 1);
+        nodeValue_.resize(iTerminator_ + 1);
+        fill(f);
+        split_[iTerminator_] = 0;
+        rightIndex_[iTerminator_] = iTerminator_;
+        nodeValue_[iTerminator_] = 0;
+    }
+
+    // leaves have threshold bin 0 and never go left
+    void fill(const RandomForestF& f) {
+        for (size_t iTree = 0; iTree < f.nTrees(); ++iTree) {
+            int nextIndex = f.treeEnd(iTree);
+            for (int i = f.roots_[iTree]; i < nextIndex; ++i) {
+                const auto& node = f.nodes_[i];
+                if (!node.isLeaf_) {
+                    const auto& edges = edges_[node.featureIndex_];
+                    int threshold = lower_bound(edges.begin(), edges.end(), node.featureValue_) - edges.begin() + 1;
+                    split_[i] = (node.featureIndex_ << kBinBits) | threshold;
+                    rightIndex_[i] = node.right_;
+                    nodeValue_[i] = 0;
+                } else {
+                    split_[i] = 0;
+                    rightIndex_[i] = nextIndex;
+                    nodeValue_[i] = node.leafValue_;
+                }
+            }
+        }
+    }
+
+    BinType bin(size_t iFeature, FeatureType value) const {
+        const auto& edges = edges_[iFeature];
+        return upper_bound(edges.begin(), edges.end(), value) - edges.begin();
+    }
+
+    // binned rows are nFeatures_ apart
+    void binRows(const FeatureType* rows, size_t nRows, size_t stride, vector<BinType>& bins) const {
+        bins.resize(nRows*nFeatures_ + kRowPadding);
+        for (size_t i = 0; i < nRows; ++i) {
+            for (size_t j = 0; j < nFeatures_; ++j) {
+                bins[i*nFeatures_ + j] = bin(j, rows[i*stride + j]);
+            }
+        }
+    }
+
+    FeatureType eval(const BinType* bins) const {
+        int begin = 0;
+        FeatureType result = 0.f;
+        while (begin != iTerminator_) {
+            result += nodeValue_[begin];
+            int split = split_[begin];
+            if (bins[split >> kBinBits] < (split & kBinMask)) {
+                ++begin;
+            } else {
+                begin = rightIndex_[begin];
+            }
+        }
+        return result;
+    }
+
+    void evalAVX(const BinType* bins0, const IVector8& offsets, IVector8 current, FeatureType* out, size_t n) const {
+        const __m256i terminator = _mm256_set1_epi32(iTerminator_);
+        const __m256i one = _mm256_set1_epi32(1);
+        const __m256i binMask = _mm256_set1_epi32(kBinMask);
+        const int* binWords = reinterpret_cast<const int*>(bins0);
+        Accumulator8<FeatureType> result;
+
+        while (-1 != _mm256_movemask_epi8(_mm256_cmpeq_epi32(current.data_, terminator))) {
+            result.add(&nodeValue_[0], current.data_);
+
+            __m256i splits = _mm256_i32gather_epi32(&split_[0], current.data_, 4);
+            __m256i rightIndices = _mm256_i32gather_epi32(&rightIndex_[0], current.data_, 4);
+
+            __m256i binAddresses = _mm256_add_epi32(_mm256_srli_epi32(splits, kBinBits), offsets.data_);
+            __m256i binsHere = _mm256_and_si256(_mm256_i32gather_epi32(binWords, binAddresses, sizeof(BinType)), binMask);
+
+            __m256i goLeft = _mm256_cmpgt_epi32(_mm256_and_si256(splits, binMask), binsHere);
+            __m256i leftIndices = _mm256_add_epi32(current.data_, one);
+            current.data_ = _mm256_blendv_epi8(rightIndices, leftIndices, goLeft);
+        }
+        result.store(out, n);
+    }
+
+    void evalBatch(const BinType* bins, size_t nRows, FeatureType* out) const {
+        if ((kSize - 1)*nFeatures_ > static_cast<size_t>(numeric_limits<int>::max())) {
+            throw std::runtime_error("stride too large");
+        }
+        IVector8 offsets;
+        IVector8 current;
+        for (size_t i = 0; i < nRows; i += kSize) {
+            size_t n = min(kSize, nRows - i);
+            for (size_t k = 0; k < kSize; ++k) {
+                offsets.intData_[k] = (k < n) ? k*nFeatures_ : 0;
+                current.intData_[k] = (k < n) ? 0 : iTerminator_;
+            }
+            evalAVX(bins + i*nFeatures_, offsets, current, out + i, n);
+        }
+    }
+
+    void evalBatch(const FeatureType* rows, size_t nRows, size_t stride, FeatureType* out) const {
+        vector<BinType> bins;
+        binRows(rows, nRows, stride, bins);
+        evalBatch(&bins[0], nRows, out);
+    }
+};
+
+// 16 bit storage formats for HalfFlatForest. Values are widened to fp32 for every compare and sum. A half
+// gathered as a 32 bit word has its value in the low 16 bits, the high ones belong to the next element.
+// fp16 keeps 11 significant bits up to 65504 and needs F16C, bfloat16 keeps 8 bits over the fp32 range
+struct Float16 {
+    static uint16_t fromFloat(float x) {
+        return _cvtss_sh(x, _MM_FROUND_TO_NEAREST_INT);
+    }
+
+    // smallest half >= x
+    static uint16_t ceil(float x) {
+        return _cvtss_sh(x, _MM_FROUND_TO_POS_INF);
+    }
+
+    static float toFloat(uint16_t h) {
+        return _cvtsh_ss(h);
+    }
+
+    static __m256 toFloat(__m256i words) {
+        __m256i halves = _mm256_and_si256(words, _mm256_set1_epi32(0xffff));
+        return _mm256_cvtph_ps(_mm_packus_epi32(_mm256_castsi256_si128(halves), _mm256_extracti128_si256(halves, 1)));
+    }
+
+    static void fromFloat(const float* in, size_t n, uint16_t* out) {
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT));
+        }
+        for (; i < n; ++i) {
+            out[i] = fromFloat(in[i]);
+        }
+    }
+};
+
+// the upper half of an fp32, so widening is a shift
+struct BFloat16 {
+    static uint32_t bits(float x) {
+        uint32_t result;
+        memcpy(&result, &x, sizeof(result));
+        return result;
+    }
+
+    static uint16_t fromFloat(float x) {
+        uint32_t b = bits(x);
+        if (x != x) {
+            return (b >> 16) | 0x40;
+        }
+        return (b + 0x7fff + ((b >> 16) & 1)) >> 16;
+    }
+
+    // truncation rounds toward zero, positive values with dropped bits step up one
+    static uint16_t ceil(float x) {
+        uint32_t b = bits(x);
+        if (x != x) {
+            return (b >> 16) | 0x40;
+        }
+        return (b >> 16) + ((b & 0xffff) && !(b >> 31));
+    }
+
+    static float toFloat(uint16_t h) {
+        uint32_t b = uint32_t(h) << 16;
+        float result;
+        memcpy(&result, &b, sizeof(result));
+        return result;
+    }
+
+    static __m256 toFloat(__m256i words) {
+        return _mm256_castsi256_ps(_mm256_slli_epi32(words, 16));
+    }
+
+    static void fromFloat(const float* in, size_t n, uint16_t* out) {
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = fromFloat(in[i]);
+        }
+    }
+};
+
+// FlatForest with thresholds, leaf values and rows stored in 16 bits, half the bytes of every threshold,
+// value and feature gather in fp32. Thresholds round up, so for a half row x < ceil(t) iff x < t and the
+// decisions are exactly those of the full model on the rows rounded to halves; only leaf values lose
+// precision. Sums are kept in fp32. The left child is implicit (pre-order) and lanes are 8 wide for
+// float and double models alike
+template<typename FeatureType, typename HalfType>
+struct HalfFlatForest {
+    using RandomForestF = RandomForest<FeatureType>;
+    using FlatForestF = FlatForest<float>;
+    static constexpr size_t kSize = 8;
+    // halves are gathered as 32 bit words, arrays and rows are padded so the last one can be read whole
+    static constexpr size_t kRowPadding = 1;
+
+    size_t nFeatures_;
+    int iTerminator_;
+    vector<int> featureIndex_;
+    vector<int> rightIndex_;
+    vector<uint16_t> featureValue_;
+    vector<uint16_t> nodeValue_;
+
+    HalfFlatForest(const RandomForestF& f) {
+        if (!f.isPreorder()) {
+            throw std::runtime_error("tree is not in pre-order");
+        }
+        iTerminator_ = f.nodes_.size();
+        featureIndex_.resize(iTerminator_ + 1);
+        rightIndex_.resize(iTerminator_ + 1);
+        featureValue_.resize(iTerminator_ + 1 + kRowPadding);
+        nodeValue_.resize(iTerminator_ + 1 + kRowPadding);
+        nFeatures_ = 0;
+        fill(f);
+        featureIndex_[iTerminator_] = 0;
+        rightIndex_[iTerminator_] = iTerminator_;
+        featureValue_[iTerminator_] = HalfType::fromFloat(-numeric_limits<float>::infinity());
+        nodeValue_[iTerminator_] = 0;
+    }
+
+    // a double threshold may round down on its way to fp32, step it back up before rounding to a half
+    static uint16_t threshold(FeatureType value) {
+        float result = value;
+        if (result < value) {
+            result = nextafter(result, numeric_limits<float>::infinity());
+        }
+        return HalfType::ceil(result);
+    }
+
+    // leaves compare against -inf and never go left, NaN included
+    void fill(const RandomForestF& f) {
+        for (size_t iTree = 0; iTree < f.nTrees(); ++iTree) {
+            int nextIndex = f.treeEnd(iTree);
+            for (int i = f.roots_[iTree]; i < nextIndex; ++i) {
+                const auto& node = f.nodes_[i];
+                if (!node.isLeaf_) {
+                    featureIndex_[i] = node.featureIndex_ | (node.missingLeft_ ? FlatForestF::kMissingLeft : 0);
+                    featureValue_[i] = threshold(node.featureValue_);
+                    rightIndex_[i] = node.right_;
+                    nodeValue_[i] = 0;
+                    nFeatures_ = max<size_t>(nFeatures_, node.featureIndex_ + 1);
+                } else {
+                    featureIndex_[i] = 0;
+                    featureValue_[i] = HalfType::fromFloat(-numeric_limits<float>::infinity());
+                    rightIndex_[i] = nextIndex;
+                    nodeValue_[i] = HalfType::fromFloat(node.leafValue_);
+                }
+            }
+        }
+    }
+
+    // half rows are nFeatures_ apart and followed by kRowPadding halves
+    void halfRows(const FeatureType* rows, size_t nRows, size_t stride, vector<uint16_t>& halves) const {
+        halves.assign(nRows*nFeatures_ + kRowPadding, 0);
+        vector<float> row(nFeatures_);
+        for (size_t i = 0; i < nRows; ++i) {
+            copy(rows + i*stride, rows + i*stride + nFeatures_, row.begin());
+            HalfType::fromFloat(row.data(), nFeatures_, &halves[i*nFeatures_]);
+        }
+    }
+
+    FeatureType eval(const uint16_t* row) const {
+        int begin = 0;
+        float result = 0.f;
+        while (begin != iTerminator_) {
+            result += HalfType::toFloat(nodeValue_[begin]);
+            int featureIndex = featureIndex_[begin];
+            float x = HalfType::toFloat(row[FlatForestF::column(featureIndex)]);
+            if (FlatForestF::goesLeft(x, HalfType::toFloat(featureValue_[begin]), featureIndex)) {
+                ++begin;
+            } else {
+                begin = rightIndex_[begin];
+            }
+        }
+        return result;
+    }
+
+    void evalAVX(const uint16_t* rows0, const IVector8& offsets, IVector8 current, FeatureType* out, size_t n) const {
+        const __m256i terminator = _mm256_set1_epi32(iTerminator_);
+        const __m256i one = _mm256_set1_epi32(1);
+        const int* rowWords = reinterpret_cast<const int*>(rows0);
+        const int* featureValueWords = reinterpret_cast<const int*>(&featureValue_[0]);
+        const int* nodeValueWords = reinterpret_cast<const int*>(&nodeValue_[0]);
+        __m256 result = _mm256_setzero_ps();
+
+        while (-1 != _mm256_movemask_epi8(_mm256_cmpeq_epi32(current.data_, terminator))) {
+            result = _mm256_add_ps(result, HalfType::toFloat(_mm256_i32gather_epi32(nodeValueWords, current.data_, 2)));
+
+            __m256i featureIndices = _mm256_i32gather_epi32(&featureIndex_[0], current.data_, 4);
+            __m256i rightIndices = _mm256_i32gather_epi32(&rightIndex_[0], current.data_, 4);
+            __m256 featureValues = HalfType::toFloat(_mm256_i32gather_epi32(featureValueWords, current.data_, 2));
+
+            __m256i featureAddresses = _mm256_add_epi32(FlatForestF::columns(featureIndices), offsets.data_);
+            __m256 featuresHere = HalfType::toFloat(_mm256_i32gather_epi32(rowWords, featureAddresses, 2));
+
+            __m256i goLeft = _mm256_castps_si256(FlatForestF::goesLeft(featuresHere, featureValues, featureIndices));
+            __m256i leftIndices = _mm256_add_epi32(current.data_, one);
+            current.data_ = _mm256_blendv_epi8(rightIndices, leftIndices, goLeft);
+        }
+        FloatVector sums;
+        sums.data_ = result;
+        copy(sums.floatData_, sums.floatData_ + n, out);
+    }
+
+    // rows must be followed by kRowPadding readable halves
+    void evalBatch(const uint16_t* rows, size_t nRows, size_t stride, FeatureType* out) const {
+        if ((kSize - 1)*stride + nFeatures_ > static_cast<size_t>(numeric_limits<int>::max())) {
+            throw std::runtime_error("stride too large");
+        }
+        IVector8 offsets;
+        IVector8 current;
+        for (size_t i = 0; i < nRows; i += kSize) {
+            size_t n = min(kSize, nRows - i);
+            for (size_t k = 0; k < kSize; ++k) {
+                offsets.intData_[k] = (k < n) ? k*stride : 0;
+                current.intData_[k] = (k < n) ? 0 : iTerminator_;
+            }
+            evalAVX(rows + i*stride, offsets, current, out + i, n);
+        }
+    }
+
+    void evalBatch(const FeatureType* rows, size_t nRows, size_t stride, FeatureType* out) const {
+        vector<uint16_t> halves;
+        halfRows(rows, nRows, stride, halves);
+        evalBatch(&halves[0], nRows, nFeatures_, out);
+    }
+};
+
+// QuickScorer: instead of walking every tree, visit the thresholds of each feature in ascending order and
+// knock out the leaves of the left subtree of every node whose test is false. The exit leaf of a tree is
+// the leftmost leaf that survives. Trees may have any number of leaves, bitvectors span several words
+template<typename FeatureType>
+struct QuickScorer {
+    using RandomForestF = RandomForest<FeatureType>;
+
+    // nodes of all trees grouped by feature, sorted by threshold within a feature
+    vector<size_t> featureOffsets_;
+    vector<FeatureType> thresholds_;
+    vector<int> nodeTree_;
+    vector<int> nodeLeafBegin_;
+    vector<int> nodeLeafEnd_;
+
+    vector<size_t> treeWordOffsets_;
+    vector<uint64_t> initialLeaves_;
+    vector<size_t> treeLeafOffsets_;
+    vector<FeatureType> leafValues_;
+
+    struct FalseNode {
+        FeatureType threshold_;
+        int tree_;
+        int leafBegin_;
+        int leafEnd_;
+    };
+
+    QuickScorer(const RandomForestF& f) {
+        vector<vector<FalseNode>> byFeature;
+        if (!f.isPreorder()) {
+            throw std::runtime_error("tree is not in pre-order");
+        }
+        if (f.hasMissingLeft()) {
+            throw std::runtime_error("missing-value directions need FlatForest");
+        }
+        for (size_t iTree = 0; iTree < f.nTrees(); ++iTree) {
+            treeLeafOffsets_.push_back(leafValues_.size());
+            add(f, iTree, byFeature);
+            size_t nLeaves = leafValues_.size() - treeLeafOffsets_.back();
+            treeWordOffsets_.push_back(initialLeaves_.size());
+            for (size_t i = 0; i < nLeaves; i += 64) {
+                size_t nBits = min<size_t>(64, nLeaves - i);
+                initialLeaves_.push_back((64 == nBits) ? ~0ULL : ((1ULL << nBits) - 1));
+            }
+        }
+        treeLeafOffsets_.push_back(leafValues_.size());
+        treeWordOffsets_.push_back(initialLeaves_.size());
+
+        featureOffsets_.push_back(0);
+        for (auto& nodes: byFeature) {
+            sort(nodes.begin(), nodes.end(), [](const FalseNode& a, const FalseNode& b) {
+                return a.threshold_ < b.threshold_;
+            });
+            for (const auto& node: nodes) {
+                thresholds_.push_back(node.threshold_);
+                nodeTree_.push_back(node.tree_);
+                nodeLeafBegin_.push_back(node.leafBegin_);
+                nodeLeafEnd_.push_back(node.leafEnd_);
+            }
+            featureOffsets_.push_back(thresholds_.size());
+        }
+    }
+
+    // numbers leaves left to right, which is their pre-order, then a backward pass gives every node
+    // the range of leaves below it since children come after their parent
+    void add(const RandomForestF& f, size_t iTree, vector<vector<FalseNode>>& byFeature) {
+        int begin = f.roots_[iTree];
+        int end = f.treeEnd(iTree);
+        vector<pair<int, int>> leafRanges(end - begin);
+        for (int i = begin; i < end; ++i) {
+            const auto& node = f.nodes_[i];
+            if (node.isLeaf_) {
+                int leaf = leafValues_.size() - treeLeafOffsets_.back();
+                leafRanges[i - begin] = make_pair(leaf, leaf + 1);
+                leafValues_.push_back(node.leafValue_);
+            }
+        }
+        for (int i = end; i-- > begin;) {
+            const auto& node = f.nodes_[i];
+            if (node.isLeaf_) {
+                continue;
+            }
+            pair<int, int> left = leafRanges[node.left_ - begin];
+            pair<int, int> right = leafRanges[node.right_ - begin];
+            leafRanges[i - begin] = make_pair(left.first, right.second);
+            if (static_cast<size_t>(node.featureIndex_) >= byFeature.size()) {
+                byFeature.resize(node.featureIndex_ + 1);
+            }
+            FalseNode falseNode;
+            falseNode.threshold_ = node.featureValue_;
+            falseNode.tree_ = iTree;
+            falseNode.leafBegin_ = left.first;
+            falseNode.leafEnd_ = left.second;
+            byFeature[node.featureIndex_].push_back(falseNode);
+        }
+    }
+
+    size_t nFeatures() const {
+        return featureOffsets_.size() - 1;
+    }
+
+    static inline void clearLeaves(uint64_t* leaves, int begin, int end) {
+        int beginWord = begin/64;
+        int lastWord = (end - 1)/64;
+        for (int w = beginWord; w <= lastWord; ++w) {
+            int lo = (w == beginWord) ? begin % 64 : 0;
+            int hi = (w == lastWord) ? (end - 1) % 64 + 1 : 64;
+            uint64_t bits = ((64 == hi) ? ~0ULL : ((1ULL << hi) - 1)) & ~((1ULL << lo) - 1);
+            leaves[w] &= ~bits;
+        }
+    }
+
+    FeatureType eval(const FeatureType* features, vector<uint64_t>& leaves) const {
+        leaves = initialLeaves_;
+        for (size_t iFeature = 0; iFeature < nFeatures(); ++iFeature) {
+            FeatureType value = features[iFeature];
+            for (size_t i = featureOffsets_[iFeature]; i < featureOffsets_[iFeature + 1]; ++i) {
+                if (value < thresholds_[i]) {
+                    break;
+                }
+                clearLeaves(&leaves[treeWordOffsets_[nodeTree_[i]]], nodeLeafBegin_[i], nodeLeafEnd_[i]);
+            }
+        }
+
+        FeatureType result = 0.f;
+        for (size_t iTree = 0; iTree + 1 < treeWordOffsets_.size(); ++iTree) {
+            size_t w = treeWordOffsets_[iTree];
+            while (!leaves[w]) {
+                ++w;
+            }
+            size_t leaf = (w - treeWordOffsets_[iTree])*64 + __builtin_ctzll(leaves[w]);
+            result += leafValues_[treeLeafOffsets_[iTree] + leaf];
+        }
+        return result;
+    }
+
+    FeatureType eval(const typename RandomForestF::Features& features) const {
+        vector<uint64_t> leaves;
+        return eval(&features[0], leaves);
+    }
+
+    void evalBatch(const FeatureType* rows, size_t nRows, size_t stride, FeatureType* out) const {
+        vector<uint64_t> leaves(initialLeaves_.size());
+        for (size_t i = 0; i < nRows; ++i) {
+            out[i] = eval(rows + i*stride, leaves);
+        }
+    }
+};
+
+template<typename FeatureType>
+typename RandomForest<FeatureType>::NodeIndex generateRandomNode(RandomForest<FeatureType>& forest, size_t nFeatures, size_t maxLevel, size_t level) {
+    bool isLeaf = 0 == (rand() % (maxLevel - level));
+    if (isLeaf) {
+        return forest.addLeaf(static_cast<FeatureType>(rand())/RAND_MAX);
+    }
+    int featureIndex = rand() % nFeatures;
+    FeatureType featureValue = static_cast<FeatureType>(rand())/RAND_MAX;
+    auto index = forest.addSplit(featureIndex, featureValue);
+    auto left = generateRandomNode<FeatureType>(forest, nFeatures, maxLevel, level + 1);
+    auto right = generateRandomNode<FeatureType>(forest, nFeatures, maxLevel, level + 1);
+    forest.nodes_[index].left_ = left;
+    forest.nodes_[index].right_ = right;
+    return index;
+}
+
+template<typename FeatureType>
+shared_ptr<RandomForest<FeatureType>> generateRandomForest(size_t nFeatures, size_t nTrees, size_t nLevel) {
+    auto result = make_shared<RandomForest<FeatureType>>();
+    for (size_t iTree = 0; iTree < nTrees; ++iTree) {
+        result->roots_.push_back(generateRandomNode<FeatureType>(*result, nFeatures, nLevel, 0));
+    }
+    result->reindex();
+
+    return result;
+}
@@ -0,0 +1,121 @@
+#include "scorer.h"
+#include "importers.h"
+
+#include <cstring>
+
+struct Options {
+    bool double_ = false;
+    string model_;
+    string format_ = "flat";
+    RowFormat rowFormat_ = RowFormat::Csv;
+    PredictionFormat predictionFormat_ = PredictionFormat::Text;
+    bool skipHeader_ = false;
+    size_t nFeatures_ = 0;
+    size_t batchRows_ = 4096;
+    size_t nBatches_ = 4;
+    string output_;
+    vector<string> inputs_;
+};
+
+void usage() {
+    cerr << "usage: forestScore --model path [--format flat|xgboost|lightgbm|sklearn] [--double] "
+         << "[--input csv|binary] [--header] [--features n] [--output-format text|binary] [--output path] "
+         << "[--batch rows] [--buffers n] [input ...]" << endl
+         << "reads stdin when no input or '-' is given, writes predictions to stdout unless --output is set" << endl
+         << "binary input needs --features, the number of native values per row" << endl;
+}
+
+template<typename FT>
+int run(const Options& options) {
+    shared_ptr<FlatForest<FT>> forest;
+    if ("flat" == options.format_) {
+        forest = FlatForest<FT>::load(options.model_);
+    } else {
+        forest = shared_ptr<FlatForest<FT>>(new FlatForest<FT>(*importModel<FT>(options.model_, options.format_)));
+    }
+    // binary rows carry no framing, the model's widest column says nothing about the file's row width
+    if (RowFormat::Binary == options.rowFormat_ && !options.nFeatures_) {
+        throw std::runtime_error("binary input needs --features");
+    }
+    size_t nFeatures = options.nFeatures_ ? options.nFeatures_ : minFeatures(*forest);
+    if (nFeatures < minFeatures(*forest)) {
+        throw std::runtime_error("model tests features beyond --features");
+    }
+    vector<string> inputs = options.inputs_.empty() ? vector<string>(1, "-") : options.inputs_;
+    if (RowFormat::Binary == options.rowFormat_) {
+        for (const string& path : inputs) {
+            struct stat status;
+            if ("-" != path && !stat(path.c_str(), &status) && S_ISREG(status.st_mode)
+                && status.st_size % (nFeatures*sizeof(FT))) {
+                throw std::runtime_error(path + " is not a whole number of " + to_string(nFeatures) + " feature rows");
+            }
+        }
+    }
+
+    FILE* out = options.output_.empty() ? stdout : fopen(options.output_.c_str(), "wb");
+    if (!out) {
+        throw std::runtime_error("cannot create " + options.output_);
+    }
+    ScoringPipeline<FT> pipeline(*forest, nFeatures, options.batchRows_, options.nBatches_,
+                                 options.rowFormat_, options.predictionFormat_, options.skipHeader_);
+    size_t nRows = pipeline.run(inputs, out);
+    if (out != stdout && fclose(out)) {
+        throw std::runtime_error("cannot write " + options.output_);
+    }
+    cerr << "scored " << nRows << " rows" << endl;
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "--double")) {
+            options.double_ = true;
+        } else if (!strcmp(argv[i], "--model") && hasValue) {
+            options.model_ = argv[++i];
+        } else if (!strcmp(argv[i], "--format") && hasValue) {
+            options.format_ = argv[++i];
+        } else if (!strcmp(argv[i], "--input") && hasValue) {
+            string format = argv[++i];
+            if ("csv" != format && "binary" != format) {
+                usage();
+                return 1;
+            }
+            options.rowFormat_ = "csv" == format ? RowFormat::Csv : RowFormat::Binary;
+        } else if (!strcmp(argv[i], "--header")) {
+            options.skipHeader_ = true;
+        } else if (!strcmp(argv[i], "--features") && hasValue) {
+            options.nFeatures_ = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "--output-format") && hasValue) {
+            string format = argv[++i];
+            if ("text" != format && "binary" != format) {
+                usage();
+                return 1;
+            }
+            options.predictionFormat_ = "text" == format ? PredictionFormat::Text : PredictionFormat::Binary;
+        } else if (!strcmp(argv[i], "--output") && hasValue) {
+            options.output_ = argv[++i];
+        } else if (!strcmp(argv[i], "--batch") && hasValue) {
+            options.batchRows_ = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "--buffers") && hasValue) {
+            options.nBatches_ = atol(argv[++i]);
+        } else if (strncmp(argv[i], "--", 2)) {
+            options.inputs_.push_back(argv[i]);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (options.model_.empty()) {
+        usage();
+        return 1;
+    }
+
+    try {
+        return options.double_ ? run<double>(options) : run<float>(options);
+    } catch (const std::exception& e) {
+        cerr << "forestScore: " << e.what() << endl;
+        return 1;
+    }
+}
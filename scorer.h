@@ -0,0 +1,304 @@
+#pragma once
+
+#include "randomForest.h"
+
+#include <cstdio>
+#include <exception>
+
+enum class RowFormat {
+    Csv,
+    Binary, // native FeatureType values, nFeatures per row
+};
+
+enum class PredictionFormat {
+    Text, // one prediction per line
+    Binary, // native FeatureType values
+};
+
+// fixed capacity FIFO between two pipeline stages. push blocks while full, pop while empty;
+// after close() push fails and pop drains what is left
+template<typename T>
+struct BoundedQueue {
+    mutex mutex_;
+    condition_variable notFull_;
+    condition_variable notEmpty_;
+    deque<T> items_;
+    size_t capacity_;
+    bool closed_;
+
+    BoundedQueue(size_t capacity)
+        : capacity_(capacity)
+        , closed_(false)
+    {
+    }
+
+    bool push(T item) {
+        unique_lock<mutex> lock(mutex_);
+        notFull_.wait(lock, [this]() { return closed_ || items_.size() < capacity_; });
+        if (closed_) {
+            return false;
+        }
+        items_.push_back(move(item));
+        notEmpty_.notify_one();
+        return true;
+    }
+
+    bool pop(T& item) {
+        unique_lock<mutex> lock(mutex_);
+        notEmpty_.wait(lock, [this]() { return closed_ || !items_.empty(); });
+        if (items_.empty()) {
+            return false;
+        }
+        item = move(items_.front());
+        items_.pop_front();
+        notFull_.notify_one();
+        return true;
+    }
+
+    void close() {
+        lock_guard<mutex> lock(mutex_);
+        closed_ = true;
+        notFull_.notify_all();
+        notEmpty_.notify_all();
+    }
+};
+
+// parse -> score -> write on three threads. A fixed set of batches circulates through the stages
+// (free -> parsed -> scored -> free), so buffers are allocated once and input order is preserved
+template<typename FeatureType>
+struct ScoringPipeline {
+    using FlatForestF = FlatForest<FeatureType>;
+
+    struct Batch {
+        vector<FeatureType> rows_;
+        vector<FeatureType> out_;
+        size_t nRows_ = 0;
+    };
+
+    FlatForestF& forest_;
+    size_t nFeatures_;
+    size_t batchRows_;
+    RowFormat rowFormat_;
+    PredictionFormat predictionFormat_;
+    bool skipHeader_;
+
+    vector<Batch> batches_;
+    BoundedQueue<Batch*> free_;
+    BoundedQueue<Batch*> parsed_;
+    BoundedQueue<Batch*> scored_;
+    mutex errorMutex_;
+    exception_ptr error_;
+    size_t nScored_;
+
+    ScoringPipeline(FlatForestF& forest, size_t nFeatures, size_t batchRows, size_t nBatches,
+                    RowFormat rowFormat, PredictionFormat predictionFormat, bool skipHeader)
+        : forest_(forest)
+        , nFeatures_(nFeatures)
+        , batchRows_(max<size_t>(1, batchRows))
+        , rowFormat_(rowFormat)
+        , predictionFormat_(predictionFormat)
+        , skipHeader_(skipHeader)
+        , batches_(max<size_t>(2, nBatches))
+        , free_(batches_.size())
+        , parsed_(batches_.size())
+        , scored_(batches_.size())
+        , nScored_(0)
+    {
+        if (!nFeatures_) {
+            throw std::runtime_error("rows need at least one feature");
+        }
+        for (auto& batch : batches_) {
+            batch.rows_.resize(batchRows_*nFeatures_);
+            batch.out_.resize(batchRows_*forest_.nOutputs_);
+            free_.push(&batch);
+        }
+    }
+
+    void fail() {
+        {
+            lock_guard<mutex> lock(errorMutex_);
+            if (!error_) {
+                error_ = current_exception();
+            }
+        }
+        free_.close();
+        parsed_.close();
+        scored_.close();
+    }
+
+    // empty fields are missing values and read as NaN
+    static FeatureType parseField(const char* begin, const char* end, size_t line) {
+        if (begin == end) {
+            return numeric_limits<FeatureType>::quiet_NaN();
+        }
+        char* parsed;
+        double value = strtod(begin, &parsed);
+        while (parsed < end && (' ' == *parsed || '\t' == *parsed)) {
+            ++parsed;
+        }
+        if (parsed != end) {
+            throw std::runtime_error("bad number on line " + to_string(line));
+        }
+        return value;
+    }
+
+    // returns false once the input is exhausted, a batch may end up partially filled
+    bool readCsv(FILE* in, Batch& batch, char*& line, size_t& capacity, size_t& lineNumber) {
+        batch.nRows_ = 0;
+        while (batch.nRows_ < batchRows_) {
+            ssize_t length = getline(&line, &capacity, in);
+            if (length < 0) {
+                return false;
+            }
+            ++lineNumber;
+            while (length && ('\n' == line[length - 1] || '\r' == line[length - 1])) {
+                line[--length] = 0;
+            }
+            if ((1 == lineNumber && skipHeader_) || !length) {
+                continue;
+            }
+            FeatureType* row = &batch.rows_[batch.nRows_*nFeatures_];
+            const char* field = line;
+            size_t j = 0;
+            for (;; ++j) {
+                const char* end = strchr(field, ',');
+                if (!end) {
+                    end = line + length;
+                }
+                if (j >= nFeatures_) {
+                    throw std::runtime_error("too many fields on line " + to_string(lineNumber));
+                }
+                row[j] = parseField(field, end, lineNumber);
+                if (!*end) {
+                    break;
+                }
+                field = end + 1;
+            }
+            if (j + 1 != nFeatures_) {
+                throw std::runtime_error("too few fields on line " + to_string(lineNumber));
+            }
+            ++batch.nRows_;
+        }
+        return true;
+    }
+
+    bool readBinary(FILE* in, Batch& batch) {
+        size_t rowBytes = nFeatures_*sizeof(FeatureType);
+        char* data = reinterpret_cast<char*>(&batch.rows_[0]);
+        size_t nBytes = fread(data, 1, batchRows_*rowBytes, in);
+        if (ferror(in)) {
+            throw std::runtime_error("cannot read rows");
+        }
+        if (nBytes % rowBytes) {
+            throw std::runtime_error("input ends in the middle of a row");
+        }
+        batch.nRows_ = nBytes/rowBytes;
+        return batch.nRows_ == batchRows_;
+    }
+
+    void parse(const vector<string>& paths) {
+        try {
+            char* line = nullptr;
+            size_t capacity = 0;
+            Batch* batch = nullptr;
+            for (const string& path : paths) {
+                FILE* in = "-" == path ? stdin : fopen(path.c_str(), "rb");
+                if (!in) {
+                    throw std::runtime_error("cannot open " + path);
+                }
+                size_t lineNumber = 0;
+                bool more = true;
+                while (more) {
+                    if (!batch && !free_.pop(batch)) {
+                        break;
+                    }
+                    more = RowFormat::Csv == rowFormat_ ? readCsv(in, *batch, line, capacity, lineNumber) : readBinary(in, *batch);
+                    if (batch->nRows_) {
+                        if (!parsed_.push(batch)) {
+                            break;
+                        }
+                        batch = nullptr;
+                    }
+                }
+                if (in != stdin) {
+                    fclose(in);
+                }
+            }
+            free(line);
+            parsed_.close();
+        } catch (...) {
+            fail();
+        }
+    }
+
+    void score() {
+        try {
+            Batch* batch;
+            while (parsed_.pop(batch)) {
+                forest_.evalBatchOutputs(&batch->rows_[0], batch->nRows_, nFeatures_, &batch->out_[0]);
+                if (!scored_.push(batch)) {
+                    break;
+                }
+            }
+            scored_.close();
+        } catch (...) {
+            fail();
+        }
+    }
+
+    void write(FILE* out) {
+        try {
+            string text;
+            char number[64];
+            Batch* batch;
+            while (scored_.pop(batch)) {
+                size_t nRows = batch->nRows_;
+                size_t nOutputs = forest_.nOutputs_;
+                size_t written;
+                if (PredictionFormat::Text == predictionFormat_) {
+                    // one line per row, outputs separated by commas
+                    text.clear();
+                    for (size_t i = 0; i < nRows*nOutputs; ++i) {
+                        int length = snprintf(number, sizeof(number), "%.*g%c", numeric_limits<FeatureType>::max_digits10,
+                                              double(batch->out_[i]), (i + 1) % nOutputs ? ',' : '\n');
+                        text.append(number, length);
+                    }
+                    written = fwrite(text.data(), 1, text.size(), out) == text.size() ? nRows : 0;
+                } else {
+                    written = fwrite(&batch->out_[0], sizeof(FeatureType)*nOutputs, nRows, out);
+                }
+                if (written != nRows) {
+                    throw std::runtime_error("cannot write predictions");
+                }
+                nScored_ += nRows;
+                if (!free_.push(batch)) {
+                    break;
+                }
+            }
+            if (fflush(out)) {
+                throw std::runtime_error("cannot write predictions");
+            }
+        } catch (...) {
+            fail();
+        }
+    }
+
+    // parse and score get their own threads, predictions are written from the calling one
+    size_t run(const vector<string>& paths, FILE* out) {
+        thread parser([&]() { parse(paths); });
+        thread scorer([&]() { score(); });
+        write(out);
+        parser.join();
+        scorer.join();
+        if (error_) {
+            rethrow_exception(error_);
+        }
+        return nScored_;
+    }
+};
+
+// rows must cover the largest feature index the model tests
+template<typename FeatureType>
+size_t minFeatures(const FlatForest<FeatureType>& forest) {
+    return forest.featureWidth();
+}
@@ -0,0 +1,268 @@
+#pragma once
+
+#include "randomForest.h"
+
+#include <random>
+
+struct TrainerParams {
+    size_t nTrees_ = 100;
+    size_t maxDepth_ = 10;
+    size_t minSamplesLeaf_ = 1;
+    size_t minSamplesSplit_ = 2;
+    double featureFraction_ = 1./3; // features tried per split
+    double sampleFraction_ = 1.; // bootstrap size relative to the number of rows
+    size_t maxBins_ = 256;
+    size_t binningSample_ = 100000; // rows used to pick the bin edges
+    unsigned seed_ = 1;
+    size_t histogramBudget_ = size_t(256) << 20; // bytes of node histograms the out of core trainer holds
+};
+
+// one {sum of labels, count} pair per bin, accumulated as a 128 bit vector. Two interleaved copies break
+// the store-to-load dependency when consecutive rows fall into the same bin, they are merged with AVX
+struct Histogram {
+    static constexpr size_t kCopies = 2;
+    static constexpr size_t kBins = 256;
+
+    __m128d bins_[kCopies][kBins];
+
+    void build(const uint8_t* column, const double* labels, const uint32_t* rows, size_t nRows) {
+        for (size_t c = 0; c < kCopies; ++c) {
+            for (size_t b = 0; b < kBins; ++b) {
+                bins_[c][b] = _mm_setzero_pd();
+            }
+        }
+        size_t i = 0;
+        for (; i + kCopies <= nRows; i += kCopies) {
+            for (size_t c = 0; c < kCopies; ++c) {
+                uint32_t row = rows[i + c];
+                __m128d& bin = bins_[c][column[row]];
+                bin = _mm_add_pd(bin, _mm_set_pd(1., labels[row]));
+            }
+        }
+        for (; i < nRows; ++i) {
+            uint32_t row = rows[i];
+            __m128d& bin = bins_[0][column[row]];
+            bin = _mm_add_pd(bin, _mm_set_pd(1., labels[row]));
+        }
+        __m256d* merged = reinterpret_cast<__m256d*>(bins_[0]);
+        const __m256d* other = reinterpret_cast<const __m256d*>(bins_[1]);
+        for (size_t b = 0; b < kBins/2; ++b) {
+            _mm256_storeu_pd(reinterpret_cast<double*>(merged + b),
+                             _mm256_add_pd(_mm256_loadu_pd(reinterpret_cast<const double*>(merged + b)),
+                                           _mm256_loadu_pd(reinterpret_cast<const double*>(other + b))));
+        }
+    }
+
+    double sum(size_t bin) const {
+        return _mm_cvtsd_f64(bins_[0][bin]);
+    }
+
+    double count(size_t bin) const {
+        return _mm_cvtsd_f64(_mm_unpackhi_pd(bins_[0][bin], bins_[0][bin]));
+    }
+};
+
+// features quantized to uint8 bins, stored column by column so histograms stream one feature at a time.
+// bin(x) counts the edges <= x, so bin(x) <= b exactly when x < edges[b]
+template<typename FeatureType>
+struct BinnedDataset {
+    static constexpr size_t kMaxBins = Histogram::kBins;
+
+    size_t nRows_;
+    size_t nFeatures_;
+    vector<vector<FeatureType>> edges_;
+    vector<uint8_t> columns_;
+
+    BinnedDataset(const FeatureType* rows, size_t nRows, size_t nFeatures, size_t stride, const TrainerParams& params)
+        : nRows_(nRows)
+        , nFeatures_(nFeatures)
+        , edges_(nFeatures)
+        , columns_(nRows*nFeatures)
+    {
+        size_t maxBins = min(params.maxBins_, kMaxBins);
+        size_t nSample = min(nRows, params.binningSample_);
+        vector<FeatureType> sample(nSample);
+        for (size_t j = 0; j < nFeatures; ++j) {
+            for (size_t i = 0; i < nSample; ++i) {
+                sample[i] = rows[(i*nRows/nSample)*stride + j];
+            }
+            edges_[j] = quantileEdges(sample, maxBins);
+            const auto& edges = edges_[j];
+            uint8_t* column = &columns_[j*nRows];
+            for (size_t i = 0; i < nRows; ++i) {
+                column[i] = upper_bound(edges.begin(), edges.end(), rows[i*stride + j]) - edges.begin();
+            }
+        }
+    }
+
+    // at most maxBins - 1 distinct cut points, NaN sorts to the end and ends up in the last bin
+    static vector<FeatureType> quantileEdges(vector<FeatureType> values, size_t maxBins) {
+        values.erase(remove_if(values.begin(), values.end(), [](FeatureType v) { return v != v; }), values.end());
+        sort(values.begin(), values.end());
+        vector<FeatureType> edges;
+        if (values.empty()) {
+            return edges;
+        }
+        for (size_t b = 1; b < maxBins; ++b) {
+            FeatureType edge = values[b*values.size()/maxBins];
+            if (edge != values.front() && (edges.empty() || edges.back() < edge)) {
+                edges.push_back(edge);
+            }
+        }
+        return edges;
+    }
+
+    const uint8_t* column(size_t iFeature) const {
+        return &columns_[iFeature*nRows_];
+    }
+};
+
+// regression forest: bootstrap rows per tree, a random subset of features per split, splits picked from
+// per-feature histograms by variance reduction. Trees are trained in parallel, leaves hold the mean label
+// divided by the number of trees so RandomForest::eval returns the average
+template<typename FeatureType>
+struct ForestTrainer {
+    using RandomForestF = RandomForest<FeatureType>;
+
+    const BinnedDataset<FeatureType>& data_;
+    vector<double> labels_;
+    TrainerParams params_;
+
+    ForestTrainer(const BinnedDataset<FeatureType>& data, const FeatureType* labels, const TrainerParams& params)
+        : data_(data)
+        , labels_(labels, labels + data.nRows_)
+        , params_(params)
+    {
+    }
+
+    struct Split {
+        double gain_ = 0.;
+        size_t feature_ = 0;
+        size_t bin_ = 0;
+    };
+
+    // grows one tree into its own arena, the trees are appended to the forest afterwards
+    struct TreeBuilder {
+        using NodeIndex = typename RandomForestF::NodeIndex;
+
+        const ForestTrainer& trainer_;
+        mt19937 random_;
+        vector<uint32_t> features_;
+        Histogram histogram_;
+        RandomForestF tree_;
+
+        TreeBuilder(const ForestTrainer& trainer, unsigned seed)
+            : trainer_(trainer)
+            , random_(seed)
+            , features_(trainer.data_.nFeatures_)
+        {
+            for (size_t j = 0; j < features_.size(); ++j) {
+                features_[j] = j;
+            }
+        }
+
+        NodeIndex leaf(const uint32_t* rows, size_t nRows) {
+            double sum = 0.;
+            for (size_t i = 0; i < nRows; ++i) {
+                sum += trainer_.labels_[rows[i]];
+            }
+            return tree_.addLeaf(nRows ? sum/nRows/trainer_.params_.nTrees_ : 0.);
+        }
+
+        Split findSplit(const uint32_t* rows, size_t nRows) {
+            const TrainerParams& params = trainer_.params_;
+            size_t nTry = min(features_.size(), max<size_t>(1, params.featureFraction_*features_.size()));
+            double total = 0.;
+            for (size_t i = 0; i < nRows; ++i) {
+                total += trainer_.labels_[rows[i]];
+            }
+            double parentScore = total*total/nRows;
+
+            Split best;
+            for (size_t t = 0; t < nTry; ++t) {
+                swap(features_[t], features_[t + random_() % (features_.size() - t)]);
+                size_t feature = features_[t];
+                size_t nBins = trainer_.data_.edges_[feature].size() + 1;
+                histogram_.build(trainer_.data_.column(feature), &trainer_.labels_[0], rows, nRows);
+
+                double leftSum = 0.;
+                double leftCount = 0.;
+                for (size_t b = 0; b + 1 < nBins; ++b) {
+                    leftSum += histogram_.sum(b);
+                    leftCount += histogram_.count(b);
+                    double rightCount = nRows - leftCount;
+                    if (leftCount < params.minSamplesLeaf_ || rightCount < params.minSamplesLeaf_) {
+                        continue;
+                    }
+                    double rightSum = total - leftSum;
+                    double gain = leftSum*leftSum/leftCount + rightSum*rightSum/rightCount - parentScore;
+                    if (gain > best.gain_) {
+                        best.gain_ = gain;
+                        best.feature_ = feature;
+                        best.bin_ = b;
+                    }
+                }
+            }
+            return best;
+        }
+
+        NodeIndex build(uint32_t* rows, size_t nRows, size_t depth) {
+            const TrainerParams& params = trainer_.params_;
+            if (depth >= params.maxDepth_ || nRows < params.minSamplesSplit_ || nRows < 2*params.minSamplesLeaf_) {
+                return leaf(rows, nRows);
+            }
+            Split split = findSplit(rows, nRows);
+            if (split.gain_ <= 0.) {
+                return leaf(rows, nRows);
+            }
+            const uint8_t* column = trainer_.data_.column(split.feature_);
+            uint32_t* middle = partition(rows, rows + nRows, [&](uint32_t row) {
+                return column[row] <= split.bin_;
+            });
+
+            NodeIndex left = build(rows, middle - rows, depth + 1);
+            NodeIndex right = build(middle, rows + nRows - middle, depth + 1);
+            return tree_.addSplit(split.feature_, trainer_.data_.edges_[split.feature_][split.bin_], left, right);
+        }
+
+        void buildTree() {
+            size_t nRows = trainer_.data_.nRows_;
+            size_t nSample = max<size_t>(1, trainer_.params_.sampleFraction_*nRows);
+            vector<uint32_t> rows(nSample);
+            for (size_t i = 0; i < nSample; ++i) {
+                rows[i] = random_() % nRows;
+            }
+            tree_.roots_.push_back(build(&rows[0], nSample, 0));
+        }
+    };
+
+    shared_ptr<RandomForestF> train(ThreadPool& pool) const {
+        if (data_.nRows_ > numeric_limits<uint32_t>::max()) {
+            throw std::runtime_error("too many rows");
+        }
+        if (!data_.nRows_ || !data_.nFeatures_) {
+            throw std::runtime_error("empty training set");
+        }
+        vector<RandomForestF> trees(params_.nTrees_);
+        pool.parallelFor(params_.nTrees_, 1, [&](size_t begin, size_t end) {
+            for (size_t iTree = begin; iTree < end; ++iTree) {
+                TreeBuilder builder(*this, params_.seed_ + iTree);
+                builder.buildTree();
+                trees[iTree] = move(builder.tree_);
+            }
+        });
+        auto forest = make_shared<RandomForestF>();
+        for (const auto& tree: trees) {
+            forest->append(tree);
+        }
+        forest->reindex();
+        return forest;
+    }
+};
+
+template<typename FeatureType>
+shared_ptr<RandomForest<FeatureType>> trainRandomForest(ThreadPool& pool, const FeatureType* rows, const FeatureType* labels,
+                                                        size_t nRows, size_t nFeatures, size_t stride, const TrainerParams& params) {
+    BinnedDataset<FeatureType> data(rows, nRows, nFeatures, stride, params);
+    return ForestTrainer<FeatureType>(data, labels, params).train(pool);
+}